@@ -1,22 +1,60 @@
 #include "api.h"
 
 int main(int argc, char *argv[]) {
+    log_init();
+    if (!config_load(&argc, argv)) {
+        return 1;
+    }
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <command> [options]\n", argv[0]);
+        fprintf(stderr, "Usage: %s [settings] <command> [options]\n", argv[0]);
+        fprintf(stderr, "Settings (also read from %s and PSAR_ environment variables):\n", CONFIG_FILE);
+        fprintf(stderr, "  --config file            Read the settings from file instead of %s.\n", CONFIG_FILE);
+        fprintf(stderr, "  --files N                Number of test files (default %d).\n", DEFAULT_NUMBER_OF_FILES);
+        fprintf(stderr, "  --processes N            Number of writer processes (default %d).\n", DEFAULT_NUMBER_OF_PROCESSES);
+        fprintf(stderr, "  --file-folder dir        Folder of the test files (default %s).\n", DEFAULT_TEST_FILE_FOLDER);
+        fprintf(stderr, "  --log-folder dir         Folder of the logs (default %s).\n", DEFAULT_LOG_FOLDER);
+        fprintf(stderr, "  --zero-copy              Log whole page writes from the privatized page.\n");
+        fprintf(stderr, "  --simulate               Use simulated page tables instead of the PTEditor module.\n");
+        fprintf(stderr, "  --dirty-tracking         Write to private mappings and log the dirty pages found by scanning.\n");
+        fprintf(stderr, "  --file-size N[K|M|G]     Size of the test files created by init (default %zu).\n", DEFAULT_FILE_SIZE);
+        fprintf(stderr, "  --file-pattern name      Content of the test files: demo, constant, random or compressible.\n");
+        fprintf(stderr, "  --direct-io              Write the test files with O_DIRECT.\n");
+        fprintf(stderr, "  --window-size N[K|M|G]   Map the files by write only windows of this size, 0 for whole files (default).\n");
+        fprintf(stderr, "  --window-budget N[K|M|G] Bytes of windows a process keeps mapped (default %d MB).\n", DEFAULT_WINDOW_BUDGET >> 20);
+        fprintf(stderr, "  --access-policy name     Hint for the file mappings: normal, sequential, random, willneed or hugepage.\n");
         fprintf(stderr, "Commands:\n");
-        fprintf(stderr, "  init                     Initialize the project environment with necessary setup.\n");
-        fprintf(stderr, "  test                     Start the file write processes for testing.\n");
+        fprintf(stderr, "  init [-j threads]        Initialize the project environment, the test files written by threads threads.\n");
+        fprintf(stderr, "  test [-p rounds]         Start the file write processes for testing, or a pool of workers running several rounds.\n");
         fprintf(stderr, "  merge -s [source_file] -l [log_file]  Merge changes from a log file into the specified source file.\n");
         fprintf(stderr, "  merge_all -s [source_file]  Apply all accumulated log modifications to the specified source file.\n");
+        fprintf(stderr, "  verify [-l log_file]     Check the checksums of one log file, or of every log file.\n");
+        fprintf(stderr, "  stats [-f stats_file]    Show signal handler latency per phase, aggregated over every writer.\n");
+        fprintf(stderr, "  metrics [-o file|unix:path]  Print the metrics, write them to a file or serve them on a Unix socket.\n");
+        fprintf(stderr, "  config                   Print the settings in effect.\n");
         return 1;
     }
 
     const char *command = argv[1];
 
     if (strcmp(command, "init") == 0) {
-        initialize_project_environment();
+        if (argc == 4 && strcmp(argv[2], "-j") == 0 && atoi(argv[3]) > 0) {
+            initialize_project_environment(atoi(argv[3]));
+        } else if (argc == 2) {
+            initialize_project_environment(sysconf(_SC_NPROCESSORS_ONLN));
+        } else {
+            fprintf(stderr, "Usage: %s init [-j threads]\n", argv[0]);
+            return 1;
+        }
     } else if (strcmp(command, "test") == 0) {
-        start_file_write_processes();
+        if (argc == 4 && strcmp(argv[2], "-p") == 0) {
+            start_file_write_pool(atoi(argv[3]));
+        } else if (argc == 2) {
+            start_file_write_processes();
+        } else {
+            fprintf(stderr, "Usage: %s test [-p rounds]\n", argv[0]);
+            return 1;
+        }
+        metrics_export(METRICS_TEXT_FILE);
     } else if (strcmp(command, "merge") == 0) {
         if (argc != 6) {
             fprintf(stderr, "Usage: %s merge -s [source_file] -l [log_file]\n", argv[0]);
@@ -32,7 +70,9 @@ int main(int argc, char *argv[]) {
             }
         }
         if (source_file && log_file) {
-            merge(source_file, log_file);
+            bool merged = merge(source_file, log_file);
+            metrics_export(METRICS_TEXT_FILE);
+            return merged ? 0 : 1;
         } else {
             fprintf(stderr, "Missing arguments for merge\n");
             return 1;
@@ -42,7 +82,38 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Usage: %s merge_all -s [source_file]\n", argv[0]);
             return 1;
         }
-        merge_all(argv[3]);
+        bool merged = merge_all(argv[3]);
+        metrics_export(METRICS_TEXT_FILE);
+        return merged ? 0 : 1;
+    } else if (strcmp(command, "verify") == 0) {
+        if (argc == 2) {
+            return verify_all_logs() ? 0 : 1;
+        }
+        if (argc != 4 || strcmp(argv[2], "-l") != 0) {
+            fprintf(stderr, "Usage: %s verify [-l log_file]\n", argv[0]);
+            return 1;
+        }
+        return verify_log(argv[3]) ? 0 : 1;
+    } else if (strcmp(command, "stats") == 0) {
+        if (argc == 2) {
+            return stats_report(NULL) ? 0 : 1;
+        }
+        if (argc != 4 || strcmp(argv[2], "-f") != 0) {
+            fprintf(stderr, "Usage: %s stats [-f stats_file]\n", argv[0]);
+            return 1;
+        }
+        return stats_report(argv[3]) ? 0 : 1;
+    } else if (strcmp(command, "metrics") == 0) {
+        if (argc == 2) {
+            return metrics_export("-") ? 0 : 1;
+        }
+        if (argc != 4 || strcmp(argv[2], "-o") != 0) {
+            fprintf(stderr, "Usage: %s metrics [-o file|unix:path]\n", argv[0]);
+            return 1;
+        }
+        return metrics_export(argv[3]) ? 0 : 1;
+    } else if (strcmp(command, "config") == 0) {
+        config_print(stdout);
     } else {
         fprintf(stderr, "Unknown command '%s'\n", command);
         return 1;
@@ -0,0 +1,267 @@
+#ifndef BENCH_H // prevent double inclusion
+#define BENCH_H
+
+/*
+Small harness shared by the benchmarks: wall clock timing, warmup and repetitions,
+median/p99 summaries and table, CSV or JSON-lines reporting.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+typedef enum { BENCH_FORMAT_TABLE, BENCH_FORMAT_CSV, BENCH_FORMAT_JSON } BenchFormat;
+
+typedef struct {
+    int warmup;
+    int repetitions;
+    BenchFormat format;
+    FILE *out;
+    int rows;
+} BenchConfig;
+
+typedef struct {
+    int samples;
+    double min, median, p99, max, mean; // seconds
+} BenchStats;
+
+typedef void (*BenchFn)(void *context);
+
+static inline double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--warmup N] [--reps N] [--format table|csv|json] [--output file]\n", program);
+}
+
+/*
+Parse the options common to every benchmark. Options the harness does not know are
+left to the benchmark, their index is returned through *next (argc when none left).
+*/
+static bool bench_parse_args(BenchConfig *config, int argc, char **argv, int *next) {
+    config->warmup = 3;
+    config->repetitions = 30;
+    config->format = BENCH_FORMAT_TABLE;
+    config->out = stdout;
+    config->rows = 0;
+    int i = 1;
+    for (; i < argc; i++) {
+        if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            config->warmup = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+            config->repetitions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "csv") == 0) config->format = BENCH_FORMAT_CSV;
+            else if (strcmp(argv[i], "json") == 0) config->format = BENCH_FORMAT_JSON;
+            else if (strcmp(argv[i], "table") == 0) config->format = BENCH_FORMAT_TABLE;
+            else {
+                bench_usage(argv[0]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            config->out = fopen(argv[++i], "w");
+            if (!config->out) {
+                perror("Error opening output file");
+                return false;
+            }
+        } else if (strcmp(argv[i], "--help") == 0) {
+            bench_usage(argv[0]);
+            return false;
+        } else {
+            break;
+        }
+    }
+    if (config->repetitions < 1) config->repetitions = 1;
+    if (next) *next = i;
+    return true;
+}
+
+static BenchStats bench_summarize(double *samples, int count) {
+    BenchStats stats = { count, 0, 0, 0, 0, 0 };
+    if (count == 0) return stats;
+    qsort(samples, count, sizeof(double), bench_compare_double);
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += samples[i];
+    stats.min = samples[0];
+    stats.max = samples[count - 1];
+    stats.median = count % 2 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+    int p99 = (int)(0.99 * count + 0.5);
+    stats.p99 = samples[p99 >= count ? count - 1 : (p99 > 0 ? p99 - 1 : 0)];
+    stats.mean = sum / count;
+    return stats;
+}
+
+/*
+Run fn config->warmup times untimed, then config->repetitions times timed
+*/
+static BenchStats bench_run(BenchConfig *config, BenchFn fn, void *context) {
+    double *samples = malloc(config->repetitions * sizeof(double));
+    if (!samples) {
+        perror("Error allocating samples");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < config->warmup; i++) fn(context);
+    for (int i = 0; i < config->repetitions; i++) {
+        double start = bench_now();
+        fn(context);
+        samples[i] = bench_now() - start;
+    }
+    BenchStats stats = bench_summarize(samples, config->repetitions);
+    free(samples);
+    return stats;
+}
+
+/*
+Print one result. params is a comma separated list of key=value pairs describing
+the configuration; bytes is the amount of data processed by one repetition and
+gives the throughput (0 when it does not apply).
+*/
+static void bench_report(BenchConfig *config, const char *name, const char *params, size_t bytes, BenchStats *stats) {
+    double throughput = bytes && stats->median > 0 ? bytes / stats->median / 1e6 : 0;
+    FILE *out = config->out;
+    switch (config->format) {
+    case BENCH_FORMAT_TABLE:
+        if (config->rows == 0) {
+            fprintf(out, "%-22s %-40s %12s %12s %12s %10s\n", "benchmark", "params", "median(us)", "p99(us)", "min(us)", "MB/s");
+        }
+        fprintf(out, "%-22s %-40s %12.2f %12.2f %12.2f %10.1f\n", name, params, stats->median * 1e6, stats->p99 * 1e6, stats->min * 1e6, throughput);
+        break;
+    case BENCH_FORMAT_CSV:
+        if (config->rows == 0) {
+            fprintf(out, "benchmark,params,samples,min_ns,median_ns,p99_ns,max_ns,mean_ns,bytes,mb_per_s\n");
+        }
+        fprintf(out, "%s,\"%s\",%d,%.0f,%.0f,%.0f,%.0f,%.0f,%zu,%.2f\n", name, params, stats->samples, stats->min * 1e9,
+                stats->median * 1e9, stats->p99 * 1e9, stats->max * 1e9, stats->mean * 1e9, bytes, throughput);
+        break;
+    case BENCH_FORMAT_JSON:
+        fprintf(out, "{\"benchmark\":\"%s\",\"params\":{", name);
+        for (const char *p = params; *p;) {
+            const char *comma = strchr(p, ',');
+            size_t len = comma ? (size_t)(comma - p) : strlen(p);
+            const char *equal = memchr(p, '=', len);
+            if (equal) {
+                fprintf(out, "%s\"%.*s\":\"%.*s\"", p == params ? "" : ",", (int)(equal - p), p, (int)(len - (equal - p) - 1), equal + 1);
+            }
+            p += len + (comma ? 1 : 0);
+        }
+        fprintf(out, "},\"samples\":%d,\"min_ns\":%.0f,\"median_ns\":%.0f,\"p99_ns\":%.0f,\"max_ns\":%.0f,\"mean_ns\":%.0f,\"bytes\":%zu,\"mb_per_s\":%.2f}\n",
+                stats->samples, stats->min * 1e9, stats->median * 1e9, stats->p99 * 1e9, stats->max * 1e9, stats->mean * 1e9, bytes, throughput);
+        break;
+    }
+    fflush(out);
+    config->rows++;
+}
+
+static void bench_finish(BenchConfig *config) {
+    if (config->out != stdout) fclose(config->out);
+}
+
+#ifdef INTERNAL_H // benchmarks of the copy on write engine, api.h included first
+
+#define BENCH_DIRECTORY_TEMPLATE "/tmp/psar_bench_XXXXXX"
+
+static void bench_remove_directory(const char *directory) {
+    if (system("rm -rf logs merge files " STATS_FOLDER) == 0 && chdir("/") == 0) {
+        rmdir(directory);
+    }
+}
+
+/*
+Create directory from BENCH_DIRECTORY_TEMPLATE, move into it and start the copy on
+write engine there, on the simulated page tables when simulate is set unless
+PSAR_SIMULATE says otherwise. The engine logs only errors, on the standard error,
+unless PSAR_LOG_LEVEL and PSAR_LOG_FILE say otherwise, so that the report can be
+parsed. Exits when the directory cannot be created, and skips the benchmark when
+the engine is unavailable.
+*/
+static void bench_engine_start(char *directory, bool simulate) {
+    if (simulate && !getenv("PSAR_SIMULATE")) psar_config.simulate = true;
+    setenv("PSAR_LOG_LEVEL", "error", 0);
+    setenv("PSAR_LOG_FILE", "/dev/stderr", 0);
+    if (!mkdtemp(directory) || chdir(directory) == -1) {
+        perror("Error creating benchmark directory");
+        exit(EXIT_FAILURE);
+    }
+    create_required_directories();
+    if (!initialize_cow_engine()) {
+        fprintf(stderr, "Copy on write engine unavailable, benchmark skipped\n");
+        bench_remove_directory(directory);
+        exit(EXIT_SUCCESS);
+    }
+}
+
+static void bench_engine_stop(const char *directory) {
+    cleanup_cow_engine();
+    bench_remove_directory(directory);
+}
+
+typedef void (*BenchWriterFn)(BenchConfig *config, double *samples, void *context);
+
+/*
+Run writer in a forked child, so that every run starts from the memory and the
+mappings of the parent, and hand it sample_slots doubles shared with the parent.
+A writer repeating its work runs config->warmup untimed rounds then
+config->repetitions timed ones, like bench_run, and calls _exit(EXIT_FAILURE) on
+error. Returns the samples, released with bench_release_samples, or NULL when the
+writer failed.
+*/
+static double *bench_run_forked(BenchConfig *config, BenchWriterFn writer, void *context, size_t sample_slots) {
+    double *samples = mmap(NULL, sample_slots * sizeof(double), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (samples == MAP_FAILED) {
+        perror("Error allocating samples");
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        writer(config, samples, context);
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        munmap(samples, sample_slots * sizeof(double));
+        return NULL;
+    }
+    return samples;
+}
+
+static void bench_release_samples(double *samples, size_t sample_slots) {
+    munmap(samples, sample_slots * sizeof(double));
+}
+
+// A file of size bytes (a multiple of PAGE_SIZE) filled with byte
+static void bench_create_file(const char *path, size_t size, char byte) {
+    char block[PAGE_SIZE];
+    memset(block, byte, sizeof(block));
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, FILE_PERMISSIONS);
+    if (fd == -1) {
+        perror("Error creating benchmark file");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        if (pwrite(fd, block, sizeof(block), offset) != (ssize_t)sizeof(block)) {
+            perror("Error creating benchmark file");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,136 @@
+#include "api.h"
+#include "bench.h"
+
+/*
+Incremental checkpointing against the SIGSEGV path. Every round modifies a
+fraction of the pages of a file, writes stores into each of them, then:
+  signal: the stores go through log_and_write_memory_region on a read only
+  mapping, the first store into a page faults into signal_handler and every
+  store is logged
+  checkpoint: the stores go straight into a DirtyRegion and dirty_region_checkpoint
+  logs the changed runs of the written pages once per round
+The duration of a round and the log bytes of the configuration are reported. On
+PTEditor (PSAR_SIMULATE=0) the checkpoint finds the pages through their private
+copies unless the kernel has soft-dirty bits.
+*/
+
+#define CHECKPOINT_FILE "files/checkpoint0"
+#define CHECKPOINT_FILE_SIZE (4 << 20)
+#define CHECKPOINT_STORE_SIZE 16
+
+// Offset of store number store into the page picked as number index of the round
+static size_t store_offset(int round, size_t index, int percent, int store) {
+    size_t pages = CHECKPOINT_FILE_SIZE / PAGE_SIZE;
+    size_t page = (index * 100 / percent + round) % pages;
+    return page * PAGE_SIZE + (size_t)store * CHECKPOINT_STORE_SIZE * 3 % PAGE_SIZE;
+}
+
+typedef struct {
+    bool checkpoint;
+    int percent;
+    int stores;
+} CheckpointParams;
+
+// Every round of a configuration from one mapping, a duration per timed round
+static void checkpoint_writer(BenchConfig *config, double *durations, void *context) {
+    CheckpointParams *params = context;
+    bool checkpoint = params->checkpoint;
+    int percent = params->percent, stores = params->stores;
+    size_t picked = CHECKPOINT_FILE_SIZE / PAGE_SIZE * percent / 100;
+    char data[CHECKPOINT_STORE_SIZE];
+    DirtyRegion region;
+    char *mapped_region = NULL;
+    int fd = -1;
+    if (checkpoint) {
+        if (!dirty_region_open(&region, CHECKPOINT_FILE)) _exit(EXIT_FAILURE);
+        mapped_region = region.region;
+    } else {
+        fd = open(CHECKPOINT_FILE, O_RDONLY);
+        mapped_region = mmap(NULL, CHECKPOINT_FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+        if (fd == -1 || mapped_region == MAP_FAILED) _exit(EXIT_FAILURE);
+    }
+    for (int round = 0; round < config->warmup + config->repetitions; round++) {
+        memset(data, 'A' + round, sizeof(data));
+        double start = bench_now();
+        for (size_t index = 0; index < picked; index++) {
+            for (int store = 0; store < stores; store++) {
+                size_t offset = store_offset(round, index, percent, store);
+                if (checkpoint) memcpy(mapped_region + offset, data, sizeof(data));
+                else if (!log_and_write_memory_region(mapped_region, offset, data, sizeof(data), CHECKPOINT_FILE_SIZE, CHECKPOINT_FILE)) {
+                    _exit(EXIT_FAILURE);
+                }
+            }
+        }
+        if (checkpoint && !dirty_region_checkpoint(&region)) _exit(EXIT_FAILURE);
+        if (round >= config->warmup) durations[round - config->warmup] = bench_now() - start;
+    }
+    if (checkpoint) {
+        dirty_region_close(&region);
+    } else {
+        zero_copy_flush(mapped_region);
+        delta_snapshot_release(mapped_region, CHECKPOINT_FILE_SIZE);
+        unmap_file_region(mapped_region, CHECKPOINT_FILE_SIZE);
+        close(fd);
+    }
+}
+
+// Bytes of the log segments in the log folder, cleared before every configuration
+static size_t log_bytes() {
+    DIR *logs = opendir(LOG_FOLDER);
+    size_t bytes = 0;
+    struct dirent *writer;
+    while (logs && (writer = readdir(logs)) != NULL) {
+        if (writer->d_name[0] == '.') continue;
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", LOG_FOLDER, writer->d_name);
+        DIR *d = opendir(path);
+        struct dirent *entry;
+        while (d && (entry = readdir(d)) != NULL) {
+            char log_path[1024];
+            struct stat st;
+            snprintf(log_path, sizeof(log_path), "%s/%s", path, entry->d_name);
+            if (entry->d_name[0] != '.' && stat(log_path, &st) == 0) bytes += st.st_size;
+        }
+        if (d) closedir(d);
+    }
+    if (logs) closedir(logs);
+    return bytes;
+}
+
+static void checkpoint_configuration(BenchConfig *config, bool checkpoint, int percent, int stores) {
+    if (system("rm -rf logs/*") != 0) fprintf(stderr, "Failed to clear logs\n");
+    CheckpointParams writer_params = { checkpoint, percent, stores };
+    double *durations = bench_run_forked(config, checkpoint_writer, &writer_params, config->repetitions);
+    if (!durations) {
+        fprintf(stderr, "The %s writer failed\n", checkpoint ? "checkpoint" : "signal");
+        exit(EXIT_FAILURE);
+    }
+
+    char params[192];
+    snprintf(params, sizeof(params), "path=%s,pages_pct=%d,stores_per_page=%d,rounds=%d,log_kb=%zu,simulated=%d",
+             checkpoint ? "checkpoint" : "signal", percent, stores, config->warmup + config->repetitions, log_bytes() / 1024, psar_config.simulate);
+    BenchStats stats = bench_summarize(durations, config->repetitions);
+    bench_report(config, "checkpoint_round", params, CHECKPOINT_FILE_SIZE / 100 * percent, &stats);
+    bench_release_samples(durations, config->repetitions);
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    if (!bench_parse_args(&config, argc, argv, NULL)) return 1;
+
+    char directory[] = BENCH_DIRECTORY_TEMPLATE;
+    bench_engine_start(directory, true);
+    bench_create_file(CHECKPOINT_FILE, CHECKPOINT_FILE_SIZE, 'c');
+    const int percents[] = { 1, 10, 50, 100 };
+    const int stores[] = { 1, 16 };
+    for (size_t i = 0; i < sizeof(percents) / sizeof(percents[0]); i++) {
+        for (size_t j = 0; j < sizeof(stores) / sizeof(stores[0]); j++) {
+            checkpoint_configuration(&config, false, percents[i], stores[j]);
+            checkpoint_configuration(&config, true, percents[i], stores[j]);
+        }
+    }
+
+    bench_engine_stop(directory);
+    bench_finish(&config);
+    return 0;
+}
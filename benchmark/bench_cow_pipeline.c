@@ -0,0 +1,177 @@
+#include "api.h"
+#include "bench.h"
+
+/*
+End to end benchmark of the copy on write pipeline: forked writers map a file read
+only, take one SIGSEGV per page they modify (signal_handler), append a log record
+per modification, then merge_all rebuilds the file. Swept over the number of
+processes, the file size and the fraction of pages modified.
+*/
+
+#define BENCH_FILE "files/bench0"
+#define BENCH_WRITE_SIZE 64
+
+typedef struct {
+    size_t file_size;
+    int processes;
+    double fraction;
+    size_t pages_per_writer;
+    double *fault_samples;  // MAP_SHARED, one slot per (process, page)
+    double *append_samples;
+} PipelineRun;
+
+static void create_bench_file(size_t size) {
+    int fd = open(BENCH_FILE, O_WRONLY | O_CREAT | O_TRUNC, FILE_PERMISSIONS);
+    if (fd == -1 || ftruncate(fd, size) == -1) {
+        perror("Error creating benchmark file");
+        exit(EXIT_FAILURE);
+    }
+    char block[PAGE_SIZE];
+    for (size_t i = 0; i < sizeof(block); i++) block[i] = (char)('a' + i % 26);
+    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        pwrite(fd, block, PAGE_SIZE, offset);
+    }
+    close(fd);
+}
+
+static void clear_logs() {
+    if (system("rm -rf logs/* merge/*") != 0) {
+        fprintf(stderr, "Failed to clear logs\n");
+    }
+}
+
+/*
+One writer: first touch of a page is timed alone (fault + privatization), then the
+logged modification of that page (record append + store, no fault any more).
+*/
+static void pipeline_writer(PipelineRun *run, int index) {
+    int fd = open(BENCH_FILE, O_RDONLY);
+    if (fd == -1) _exit(EXIT_FAILURE);
+    char *mapped_region = mmap(NULL, run->file_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped_region == MAP_FAILED) _exit(EXIT_FAILURE);
+
+    size_t pages = run->file_size / PAGE_SIZE;
+    size_t stride = pages / run->pages_per_writer;
+    char data[BENCH_WRITE_SIZE];
+    memset(data, 'A' + index % 26, sizeof(data));
+    double *faults = run->fault_samples + index * run->pages_per_writer;
+    double *appends = run->append_samples + index * run->pages_per_writer;
+
+    for (size_t i = 0; i < run->pages_per_writer; i++) {
+        // writers start on different pages so that they do not all fault on the same ones
+        size_t page = (i * stride + index) % pages;
+        volatile char *target = mapped_region + page * PAGE_SIZE;
+        double start = bench_now();
+        *target = *target;
+        faults[i] = bench_now() - start;
+
+        start = bench_now();
+        if (!log_and_write_memory_region(mapped_region, page * PAGE_SIZE + 128, data, sizeof(data), run->file_size, BENCH_FILE)) {
+            _exit(EXIT_FAILURE);
+        }
+        appends[i] = bench_now() - start;
+    }
+    delta_snapshot_release(mapped_region, run->file_size);
+    munmap(mapped_region, run->file_size);
+    close(fd);
+    _exit(EXIT_SUCCESS);
+}
+
+static bool run_writers(PipelineRun *run) {
+    pid_t pids[run->processes];
+    for (int i = 0; i < run->processes; i++) {
+        pids[i] = fork();
+        if (pids[i] < 0) return false;
+        if (pids[i] == 0) pipeline_writer(run, i);
+    }
+    bool success = true;
+    for (int i = 0; i < run->processes; i++) {
+        int status;
+        waitpid(pids[i], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) success = false;
+    }
+    return success;
+}
+
+static void pipeline_configuration(BenchConfig *config, size_t file_size, int processes, double fraction) {
+    PipelineRun run = { file_size, processes, fraction, 0, NULL, NULL };
+    run.pages_per_writer = (size_t)(fraction * (file_size / PAGE_SIZE));
+    if (run.pages_per_writer == 0) run.pages_per_writer = 1;
+    size_t slots = (size_t)processes * run.pages_per_writer * config->repetitions;
+    run.fault_samples = mmap(NULL, 2 * slots * sizeof(double), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (run.fault_samples == MAP_FAILED) {
+        perror("Error allocating samples");
+        exit(EXIT_FAILURE);
+    }
+    run.append_samples = run.fault_samples + slots;
+    double *writer_samples = malloc(config->repetitions * sizeof(double));
+    double *merge_samples = malloc(config->repetitions * sizeof(double));
+    size_t log_bytes = 0;
+
+    create_bench_file(file_size);
+    double *fault_base = run.fault_samples, *append_base = run.append_samples;
+    for (int rep = -config->warmup; rep < config->repetitions; rep++) {
+        clear_logs();
+        size_t offset = rep < 0 ? 0 : (size_t)rep * processes * run.pages_per_writer;
+        run.fault_samples = fault_base + offset;
+        run.append_samples = append_base + offset;
+
+        double start = bench_now();
+        if (!run_writers(&run)) {
+            fprintf(stderr, "A writer failed, is PTEditor loaded?\n");
+            exit(EXIT_FAILURE);
+        }
+        double writers = bench_now() - start;
+
+        start = bench_now();
+        merge_all(BENCH_FILE);
+        double merging = bench_now() - start;
+        if (rep >= 0) {
+            writer_samples[rep] = writers;
+            merge_samples[rep] = merging;
+        }
+    }
+    FILE *du = popen("du -sb logs | cut -f1", "r");
+    if (du) {
+        if (fscanf(du, "%zu", &log_bytes) != 1) log_bytes = 0;
+        pclose(du);
+    }
+
+    char params[160];
+    snprintf(params, sizeof(params), "processes=%d,size=%zu,fraction=%g,write=%d", processes, file_size, fraction, BENCH_WRITE_SIZE);
+    BenchStats stats = bench_summarize(fault_base, (int)slots);
+    bench_report(config, "cow_fault", params, PAGE_SIZE, &stats);
+    stats = bench_summarize(append_base, (int)slots);
+    bench_report(config, "log_append", params, BENCH_WRITE_SIZE, &stats);
+    stats = bench_summarize(writer_samples, config->repetitions);
+    bench_report(config, "writers_total", params, log_bytes, &stats);
+    stats = bench_summarize(merge_samples, config->repetitions);
+    bench_report(config, "merge_all", params, file_size, &stats);
+
+    munmap(fault_base, 2 * slots * sizeof(double));
+    free(writer_samples);
+    free(merge_samples);
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    if (!bench_parse_args(&config, argc, argv, NULL)) return 1;
+
+    char directory[] = BENCH_DIRECTORY_TEMPLATE;
+    bench_engine_start(directory, false);
+
+    const int processes[] = { 1, 2, 4 };
+    const size_t sizes[] = { 1 << 20, 16 << 20 };
+    const double fractions[] = { 0.01, 0.1, 0.5 };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (size_t f = 0; f < sizeof(fractions) / sizeof(fractions[0]); f++) {
+            for (size_t p = 0; p < sizeof(processes) / sizeof(processes[0]); p++) {
+                pipeline_configuration(&config, sizes[s], processes[p], fractions[f]);
+            }
+        }
+    }
+
+    bench_engine_stop(directory);
+    bench_finish(&config);
+    return 0;
+}
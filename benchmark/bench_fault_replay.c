@@ -0,0 +1,219 @@
+#include "api.h"
+#include "bench.h"
+
+/*
+Replays fault traces against the copy on write engine: a writer maps a file read
+only and stores into it range after range, every first store into a page taking
+the SIGSEGV path of signal_handler. The engine runs on the simulated page tables
+(PSAR_SIMULATE=0 uses PTEditor), so this works without the kernel module. After a
+replay the mapping must match a shadow copy that received the same stores, and the
+file on disk must be unchanged.
+
+A trace file has one "offset length" line per store, in bytes, '#' starts a
+comment. Without trace files the sequential, random and strided patterns are
+replayed over REPLAY_FILE_SIZE bytes.
+*/
+
+#define REPLAY_FILE "files/replay0"
+#define REPLAY_FILE_SIZE (4 << 20)
+#define REPLAY_EVENTS 1024
+#define REPLAY_STORE_SIZE 64
+
+typedef struct {
+    off_t offset;
+    size_t len;
+} ReplayEvent;
+
+typedef struct {
+    const char *name;
+    ReplayEvent *events;
+    size_t count;
+    size_t file_size;
+} ReplayTrace;
+
+static bool read_trace(const char *path, ReplayTrace *trace) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+    size_t capacity = 256;
+    trace->name = path;
+    trace->events = malloc(capacity * sizeof(ReplayEvent));
+    trace->count = 0;
+    trace->file_size = 0;
+    char line[128];
+    while (trace->events && fgets(line, sizeof(line), file)) {
+        long long offset;
+        size_t len;
+        if (line[0] == '#' || sscanf(line, "%lld %zu", &offset, &len) != 2) continue;
+        if (offset < 0 || len == 0) continue;
+        if (trace->count == capacity) {
+            capacity *= 2;
+            trace->events = realloc(trace->events, capacity * sizeof(ReplayEvent));
+            if (!trace->events) break;
+        }
+        trace->events[trace->count].offset = offset;
+        trace->events[trace->count].len = len;
+        trace->count++;
+        if ((size_t)offset + len > trace->file_size) trace->file_size = offset + len;
+    }
+    fclose(file);
+    trace->file_size = (trace->file_size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    return trace->events && trace->count > 0;
+}
+
+static void synthetic_trace(ReplayTrace *trace, const char *name) {
+    size_t pages = REPLAY_FILE_SIZE / PAGE_SIZE;
+    trace->name = name;
+    trace->events = malloc(REPLAY_EVENTS * sizeof(ReplayEvent));
+    trace->count = REPLAY_EVENTS;
+    trace->file_size = REPLAY_FILE_SIZE;
+    if (!trace->events) {
+        perror("Error allocating the trace");
+        exit(EXIT_FAILURE);
+    }
+    srand(42);
+    for (size_t i = 0; i < REPLAY_EVENTS; i++) {
+        size_t page;
+        if (strcmp(name, "sequential") == 0) page = i % pages;
+        else if (strcmp(name, "strided") == 0) page = (i * 17) % pages;
+        else page = (size_t)rand() % pages;
+        trace->events[i].offset = page * PAGE_SIZE + (i * REPLAY_STORE_SIZE) % PAGE_SIZE;
+        trace->events[i].len = REPLAY_STORE_SIZE;
+    }
+}
+
+static void create_replay_file(size_t size, char *contents) {
+    for (size_t i = 0; i < size; i++) contents[i] = (char)('a' + i % 26);
+    int fd = open(REPLAY_FILE, O_WRONLY | O_CREAT | O_TRUNC, FILE_PERMISSIONS);
+    if (fd == -1 || write(fd, contents, size) != (ssize_t)size) {
+        perror("Error creating replay file");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+typedef struct {
+    ReplayTrace *trace;
+    const char *contents; // of the file before the replay
+} ReplayParams;
+
+// One replay of the trace, the duration of every store goes to samples
+static void replay_writer(BenchConfig *config, double *samples, void *context) {
+    ReplayTrace *trace = ((ReplayParams *)context)->trace;
+    const char *contents = ((ReplayParams *)context)->contents;
+    int fd = open(REPLAY_FILE, O_RDONLY);
+    if (fd == -1) _exit(EXIT_FAILURE);
+    char *mapped_region = mmap(NULL, trace->file_size, PROT_READ, MAP_SHARED, fd, 0);
+    char *shadow = malloc(trace->file_size);
+    if (mapped_region == MAP_FAILED || !shadow) _exit(EXIT_FAILURE);
+    memcpy(shadow, contents, trace->file_size);
+
+    for (size_t i = 0; i < trace->count; i++) {
+        ReplayEvent *event = &trace->events[i];
+        char value = (char)('A' + i % 26);
+        double start = bench_now();
+        memset(mapped_region + event->offset, value, event->len);
+        samples[i] = bench_now() - start;
+        memset(shadow + event->offset, value, event->len);
+    }
+    bool matches = memcmp(mapped_region, shadow, trace->file_size) == 0;
+    if (!matches) fprintf(stderr, "Mapping of %s differs from its shadow after the replay\n", trace->name);
+    delta_snapshot_release(mapped_region, trace->file_size);
+    munmap(mapped_region, trace->file_size);
+    close(fd);
+    if (!matches) _exit(EXIT_FAILURE);
+}
+
+static bool file_unchanged(const char *contents, size_t size) {
+    int fd = open(REPLAY_FILE, O_RDONLY);
+    char *on_disk = malloc(size);
+    bool unchanged = fd != -1 && on_disk && read(fd, on_disk, size) == (ssize_t)size && memcmp(on_disk, contents, size) == 0;
+    free(on_disk);
+    if (fd != -1) close(fd);
+    return unchanged;
+}
+
+static void replay_configuration(BenchConfig *config, ReplayTrace *trace) {
+    char *contents = malloc(trace->file_size);
+    size_t slots = trace->count * config->repetitions;
+    double *samples = malloc(slots * sizeof(double));
+    double *replay_samples = malloc(config->repetitions * sizeof(double));
+    if (!contents || !samples || !replay_samples) {
+        perror("Error allocating samples");
+        exit(EXIT_FAILURE);
+    }
+    create_replay_file(trace->file_size, contents);
+
+    // a writer per replay, every replay starts from an untouched mapping
+    ReplayParams writer_params = { trace, contents };
+    for (int rep = -config->warmup; rep < config->repetitions; rep++) {
+        double start = bench_now();
+        double *replay = bench_run_forked(config, replay_writer, &writer_params, trace->count);
+        double duration = bench_now() - start;
+        if (!replay || !file_unchanged(contents, trace->file_size)) {
+            fprintf(stderr, "Replay of %s failed\n", trace->name);
+            exit(EXIT_FAILURE);
+        }
+        if (rep >= 0) {
+            memcpy(samples + rep * trace->count, replay, trace->count * sizeof(double));
+            replay_samples[rep] = duration;
+        }
+        bench_release_samples(replay, trace->count);
+    }
+
+    size_t pages = 0;
+    bool *touched = calloc(trace->file_size / PAGE_SIZE, sizeof(bool));
+    for (size_t i = 0; touched && i < trace->count; i++) {
+        for (size_t page = trace->events[i].offset / PAGE_SIZE; page * PAGE_SIZE < trace->events[i].offset + trace->events[i].len; page++) {
+            if (!touched[page]) pages++;
+            touched[page] = true;
+        }
+    }
+    free(touched);
+
+    char params[160];
+    snprintf(params, sizeof(params), "trace=%s,events=%zu,pages=%zu,size=%zu,simulated=%d", trace->name, trace->count, pages, trace->file_size, psar_config.simulate);
+    BenchStats stats = bench_summarize(samples, (int)slots);
+    bench_report(config, "replay_store", params, REPLAY_STORE_SIZE, &stats);
+    stats = bench_summarize(replay_samples, config->repetitions);
+    bench_report(config, "replay_total", params, trace->file_size, &stats);
+
+    free(samples);
+    free(replay_samples);
+    free(contents);
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    int next;
+    if (!bench_parse_args(&config, argc, argv, &next)) return 1;
+
+    // trace files are read before leaving the current directory
+    int trace_count = argc - next;
+    const char *patterns[] = { "sequential", "random", "strided" };
+    if (trace_count == 0) trace_count = sizeof(patterns) / sizeof(patterns[0]);
+    ReplayTrace *traces = calloc(trace_count, sizeof(ReplayTrace));
+    if (!traces) return 1;
+    for (int i = 0; i < trace_count; i++) {
+        if (next == argc) synthetic_trace(&traces[i], patterns[i]);
+        else if (!read_trace(argv[next + i], &traces[i])) {
+            fprintf(stderr, "No store in trace %s\n", argv[next + i]);
+            return 1;
+        }
+    }
+
+    char directory[] = BENCH_DIRECTORY_TEMPLATE;
+    bench_engine_start(directory, true);
+
+    for (int i = 0; i < trace_count; i++) {
+        replay_configuration(&config, &traces[i]);
+        free(traces[i].events);
+    }
+    free(traces);
+
+    bench_engine_stop(directory);
+    bench_finish(&config);
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include "api.h"
+#include "bench.h"
+
+/*
+Files past 4 GB: a sparse LARGE_FILE_SIZE file is mapped read only and written
+with log_and_write_memory_region at offsets straddling the 4 GB boundary, with
+writes from a page up to LARGE_WRITE_MAX bytes (larger than the log reader
+buffer, so merge_all streams their records). merge_all is timed afterwards and
+the merged file must hold every write at its offset, with the holes of the
+source kept.
+*/
+
+#define LARGE_FILE "files/large0"
+#define LARGE_FILE_SIZE (5ull << 30)
+#define LARGE_BOUNDARY (4ull << 30)
+#define LARGE_WRITE_MAX (4 << 20)
+
+static const size_t large_write_sizes[] = { 4096, 64 << 10, LARGE_WRITE_MAX };
+#define LARGE_WRITE_SIZES (sizeof(large_write_sizes) / sizeof(large_write_sizes[0]))
+
+// Offset of write rep of the given size, the sizes are laid out one after the other
+static off_t large_write_offset(size_t size_index, int rep, int repetitions) {
+    off_t offset = LARGE_BOUNDARY - large_write_sizes[0] / 2;
+    for (size_t i = 0; i < size_index; i++) offset += (off_t)large_write_sizes[i] * repetitions;
+    return offset + (off_t)large_write_sizes[size_index] * rep;
+}
+
+static char large_write_value(size_t size_index, int rep) {
+    return (char)('A' + (size_index * 7 + rep) % 26);
+}
+
+static void create_large_file() {
+    int fd = open(LARGE_FILE, O_WRONLY | O_CREAT | O_TRUNC, FILE_PERMISSIONS);
+    char block[PAGE_SIZE];
+    memset(block, 'l', sizeof(block));
+    if (fd == -1 || ftruncate(fd, LARGE_FILE_SIZE) == -1 ||
+        pwrite(fd, block, sizeof(block), LARGE_BOUNDARY - 2 * PAGE_SIZE) != (ssize_t)sizeof(block) ||
+        pwrite(fd, block, sizeof(block), LARGE_FILE_SIZE - PAGE_SIZE) != (ssize_t)sizeof(block)) {
+        perror("Error creating benchmark file");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+// Every write from one mapping, like a writer of psar test; durations[size][rep]
+static void large_writer(BenchConfig *config, double *durations, void *context) {
+    int repetitions = config->repetitions;
+    int fd = open(LARGE_FILE, O_RDONLY);
+    char *mapped_region = mmap(NULL, LARGE_FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    char *data = malloc(LARGE_WRITE_MAX);
+    if (fd == -1 || mapped_region == MAP_FAILED || !data) _exit(EXIT_FAILURE);
+    for (size_t i = 0; i < LARGE_WRITE_SIZES; i++) {
+        for (int rep = 0; rep < repetitions; rep++) {
+            off_t offset = large_write_offset(i, rep, repetitions);
+            memset(data, large_write_value(i, rep), large_write_sizes[i]);
+            double start = bench_now();
+            if (!log_and_write_memory_region(mapped_region, offset, data, large_write_sizes[i], LARGE_FILE_SIZE, LARGE_FILE)) {
+                _exit(EXIT_FAILURE);
+            }
+            durations[i * repetitions + rep] = bench_now() - start;
+            if (memcmp(mapped_region + offset, data, large_write_sizes[i]) != 0) _exit(EXIT_FAILURE);
+        }
+    }
+    // a write ending past the file must be refused
+    if (log_and_write_memory_region(mapped_region, LARGE_FILE_SIZE - 1, data, 2, LARGE_FILE_SIZE, LARGE_FILE)) _exit(EXIT_FAILURE);
+    zero_copy_flush(mapped_region);
+    delta_snapshot_release(mapped_region, LARGE_FILE_SIZE);
+    unmap_file_region(mapped_region, LARGE_FILE_SIZE);
+    close(fd);
+}
+
+static bool merged_file_matches(int repetitions) {
+    char merged_path[FILE_NAME_SIZE];
+    snprintf(merged_path, sizeof(merged_path), "merge/merge_all_%s", strrchr(LARGE_FILE, '/') + 1);
+    int fd = open(merged_path, O_RDONLY);
+    char *expected = malloc(LARGE_WRITE_MAX), *actual = malloc(LARGE_WRITE_MAX);
+    struct stat st;
+    bool matches = fd != -1 && expected && actual && fstat(fd, &st) == 0 && (uint64_t)st.st_size == LARGE_FILE_SIZE;
+    // much less than the file is allocated when the holes were kept
+    if (matches) fprintf(stderr, "# merged file: %llu MB allocated of %llu MB\n", (unsigned long long)st.st_blocks * 512 >> 20, LARGE_FILE_SIZE >> 20);
+    for (size_t i = 0; matches && i < LARGE_WRITE_SIZES; i++) {
+        for (int rep = 0; matches && rep < repetitions; rep++) {
+            memset(expected, large_write_value(i, rep), large_write_sizes[i]);
+            matches = pread(fd, actual, large_write_sizes[i], large_write_offset(i, rep, repetitions)) == (ssize_t)large_write_sizes[i] &&
+                      memcmp(actual, expected, large_write_sizes[i]) == 0;
+        }
+    }
+    free(expected);
+    free(actual);
+    if (fd != -1) close(fd);
+    return matches;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    if (!bench_parse_args(&config, argc, argv, NULL)) return 1;
+    int repetitions = config.repetitions;
+
+    char directory[] = BENCH_DIRECTORY_TEMPLATE;
+    bench_engine_start(directory, true);
+    create_large_file();
+
+    size_t slots = LARGE_WRITE_SIZES * repetitions;
+    double *durations = bench_run_forked(&config, large_writer, NULL, slots);
+    if (!durations) {
+        fprintf(stderr, "The writer failed\n");
+        return 1;
+    }
+    char params[128];
+    for (size_t i = 0; i < LARGE_WRITE_SIZES; i++) {
+        snprintf(params, sizeof(params), "file_gb=%llu,write=%zu,simulated=%d", LARGE_FILE_SIZE >> 30, large_write_sizes[i], psar_config.simulate);
+        BenchStats stats = bench_summarize(durations + i * repetitions, repetitions);
+        bench_report(&config, "large_write", params, large_write_sizes[i], &stats);
+    }
+
+    double start = bench_now();
+    bool merged = merge_all(LARGE_FILE);
+    double merge_duration = bench_now() - start;
+    if (!merged || !merged_file_matches(repetitions)) {
+        fprintf(stderr, "The merged file does not hold the writes\n");
+        return 1;
+    }
+    size_t written = 0;
+    for (size_t i = 0; i < LARGE_WRITE_SIZES; i++) written += large_write_sizes[i] * repetitions;
+    snprintf(params, sizeof(params), "file_gb=%llu,records=%zu", LARGE_FILE_SIZE >> 30, slots);
+    BenchStats stats = bench_summarize(&merge_duration, 1);
+    bench_report(&config, "large_merge_all", params, written, &stats);
+
+    bench_release_samples(durations, slots);
+    bench_engine_stop(directory);
+    bench_finish(&config);
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include "api.h"
+#include "bench.h"
+
+#define PAGES 128
+#define MIN_GAP 8
+#define MAX_RUNS (PAGE_SIZE / 2)
+
+/*
+Reference scanner: memcmp 64 byte chunks and walk bytes only in chunks that differ,
+which is what a page capture would do without a dedicated kernel.
+*/
+static size_t memcmp_diff(const char *a, const char *b, size_t len, size_t min_gap, DiffRun *runs, size_t max_runs) {
+    size_t count = 0;
+    bool open = false;
+    size_t start = 0, end = 0;
+    for (size_t chunk = 0; chunk < len; chunk += 64) {
+        size_t chunk_len = len - chunk < 64 ? len - chunk : 64;
+        if (memcmp(a + chunk, b + chunk, chunk_len) == 0) continue;
+        for (size_t i = chunk; i < chunk + chunk_len; i++) {
+            if (a[i] == b[i]) continue;
+            if (open && (i == end || i - end < min_gap)) {
+                end = i + 1;
+                continue;
+            }
+            if (open) {
+                runs[count].offset = start;
+                runs[count].length = end - start;
+                if (++count == max_runs) return count;
+            }
+            open = true;
+            start = i;
+            end = i + 1;
+        }
+    }
+    if (open) {
+        runs[count].offset = start;
+        runs[count].length = end - start;
+        count++;
+    }
+    return count;
+}
+
+static void make_pages(char *original, char *modified, double density) {
+    for (size_t i = 0; i < (size_t)PAGES * PAGE_SIZE; i++) {
+        original[i] = (char)(rand() & 0xff);
+    }
+    memcpy(modified, original, (size_t)PAGES * PAGE_SIZE);
+    size_t changes = (size_t)(density * PAGES * PAGE_SIZE);
+    for (size_t i = 0; i < changes; i++) {
+        size_t at = ((size_t)rand() * RAND_MAX + rand()) % ((size_t)PAGES * PAGE_SIZE);
+        modified[at] = ~original[at];
+    }
+}
+
+static bool same_runs(PageDiffFn kernel, const char *original, const char *modified, DiffRun *runs, DiffRun *expected) {
+    for (size_t page = 0; page < PAGES; page++) {
+        size_t offset = page * PAGE_SIZE;
+        size_t n = kernel(original + offset, modified + offset, PAGE_SIZE, MIN_GAP, runs, MAX_RUNS);
+        size_t m = memcmp_diff(original + offset, modified + offset, PAGE_SIZE, MIN_GAP, expected, MAX_RUNS);
+        if (n != m || memcmp(runs, expected, n * sizeof(DiffRun)) != 0) return false;
+    }
+    return true;
+}
+
+typedef struct {
+    PageDiffFn kernel;
+    const char *original;
+    const char *modified;
+    DiffRun *runs;
+} PageDiffBench;
+
+static void diff_all_pages(void *context) {
+    PageDiffBench *bench = context;
+    for (size_t page = 0; page < PAGES; page++) {
+        bench->kernel(bench->original + page * PAGE_SIZE, bench->modified + page * PAGE_SIZE, PAGE_SIZE, MIN_GAP, bench->runs, MAX_RUNS);
+    }
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    if (!bench_parse_args(&config, argc, argv, NULL)) return 1;
+    const double densities[] = { 0.0, 0.0001, 0.001, 0.01, 0.1, 0.5 };
+    const char *isas[] = { "scalar", "sse2", "avx2", "avx512" };
+    char *original = malloc((size_t)PAGES * PAGE_SIZE);
+    char *modified = malloc((size_t)PAGES * PAGE_SIZE);
+    DiffRun *runs = malloc(MAX_RUNS * sizeof(DiffRun));
+    DiffRun *expected = malloc(MAX_RUNS * sizeof(DiffRun));
+    if (!original || !modified || !runs || !expected) {
+        perror("Error allocating buffers");
+        return EXIT_FAILURE;
+    }
+    srand(42);
+
+    for (size_t d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+        make_pages(original, modified, densities[d]);
+        PageDiffBench bench = { memcmp_diff, original, modified, runs };
+        char params[128];
+        snprintf(params, sizeof(params), "kernel=memcmp,density=%g,pages=%d", densities[d], PAGES);
+        BenchStats stats = bench_run(&config, diff_all_pages, &bench);
+        bench_report(&config, "page_diff", params, (size_t)PAGES * PAGE_SIZE, &stats);
+        for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); k++) {
+            bench.kernel = page_diff_kernel(isas[k]);
+            if (!bench.kernel) continue;
+            if (!same_runs(bench.kernel, original, modified, runs, expected)) {
+                fprintf(stderr, "%s kernel disagrees with memcmp scan\n", isas[k]);
+                return EXIT_FAILURE;
+            }
+            snprintf(params, sizeof(params), "kernel=%s,density=%g,pages=%d", isas[k], densities[d], PAGES);
+            stats = bench_run(&config, diff_all_pages, &bench);
+            bench_report(&config, "page_diff", params, (size_t)PAGES * PAGE_SIZE, &stats);
+        }
+    }
+
+    free(original);
+    free(modified);
+    free(runs);
+    free(expected);
+    bench_finish(&config);
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "api.h"
+#include "bench.h"
+
+/*
+Memory of a long lived writer: every round maps a file read only, modifies every
+page with log_and_write_memory_region (one fault and one private copy per page)
+and unmaps it. With unmap_file_region the privatized pages get their original
+PTE back and the copies are reused by the next round, so the resident set stays
+flat; with a plain munmap (release=0, the former behaviour) it grows by a page
+per privatized page and round. The resident set is sampled after every round,
+warmup included.
+*/
+
+#define RECYCLE_FILE "files/recycle0"
+#define RECYCLE_FILE_SIZE (1 << 20)
+#define RECYCLE_WRITE_SIZE 16
+
+static size_t resident_bytes() {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    size_t size = 0, resident = 0;
+    if (statm) {
+        if (fscanf(statm, "%zu %zu", &size, &resident) != 2) resident = 0;
+        fclose(statm);
+    }
+    return resident * PAGE_SIZE;
+}
+
+/*
+Every round of a configuration, context pointing to its release setting. samples
+holds a duration per timed round followed by the resident bytes after every round.
+*/
+static void recycle_writer(BenchConfig *config, double *samples, void *context) {
+    bool release = *(bool *)context;
+    double *resident = samples + config->repetitions;
+    char data[RECYCLE_WRITE_SIZE];
+    memset(data, 'W', sizeof(data));
+    for (int round = 0; round < config->warmup + config->repetitions; round++) {
+        double start = bench_now();
+        int fd = open(RECYCLE_FILE, O_RDONLY);
+        char *mapped_region = mmap(NULL, RECYCLE_FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+        if (fd == -1 || mapped_region == MAP_FAILED) _exit(EXIT_FAILURE);
+        for (size_t offset = 0; offset < RECYCLE_FILE_SIZE; offset += PAGE_SIZE) {
+            if (!log_and_write_memory_region(mapped_region, offset, data, sizeof(data), RECYCLE_FILE_SIZE, RECYCLE_FILE)) {
+                _exit(EXIT_FAILURE);
+            }
+        }
+        zero_copy_flush(mapped_region);
+        delta_snapshot_release(mapped_region, RECYCLE_FILE_SIZE);
+        if (release) unmap_file_region(mapped_region, RECYCLE_FILE_SIZE);
+        else munmap(mapped_region, RECYCLE_FILE_SIZE);
+        close(fd);
+        if (round >= config->warmup) samples[round - config->warmup] = bench_now() - start;
+        resident[round] = resident_bytes();
+    }
+}
+
+static void recycle_configuration(BenchConfig *config, bool release) {
+    int rounds = config->warmup + config->repetitions;
+    size_t slots = config->repetitions + rounds;
+    if (system("rm -rf logs/*") != 0) fprintf(stderr, "Failed to clear logs\n");
+    double *samples = bench_run_forked(config, recycle_writer, &release, slots);
+    if (!samples) {
+        fprintf(stderr, "The writer failed, is PTEditor loaded?\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // the first round allocates the copies, the resident set should not grow after it
+    const double *resident = samples + config->repetitions;
+    size_t first = resident[0], last = resident[rounds - 1], peak = 0;
+    for (int round = 0; round < rounds; round++) {
+        if (resident[round] > peak) peak = resident[round];
+    }
+    char params[192];
+    snprintf(params, sizeof(params), "release=%d,rounds=%d,size=%d,rss_first_kb=%zu,rss_last_kb=%zu,rss_peak_kb=%zu",
+             release, rounds, RECYCLE_FILE_SIZE, first / 1024, last / 1024, peak / 1024);
+    BenchStats stats = bench_summarize(samples, config->repetitions);
+    bench_report(config, "recycle_round", params, RECYCLE_FILE_SIZE, &stats);
+    if (release && last > first + RECYCLE_FILE_SIZE / 4) {
+        fprintf(stderr, "Resident set grew from %zu to %zu kB with page recycling\n", first / 1024, last / 1024);
+    }
+    bench_release_samples(samples, slots);
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    if (!bench_parse_args(&config, argc, argv, NULL)) return 1;
+
+    char directory[] = BENCH_DIRECTORY_TEMPLATE;
+    bench_engine_start(directory, true);
+    bench_create_file(RECYCLE_FILE, RECYCLE_FILE_SIZE, 'r');
+    recycle_configuration(&config, true);
+    recycle_configuration(&config, false);
+
+    bench_engine_stop(directory);
+    bench_finish(&config);
+    return 0;
+}
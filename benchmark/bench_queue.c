@@ -0,0 +1,115 @@
+#include "api.h"
+#include "bench.h"
+
+/*
+Throughput of the shared memory MPMC queue between processes: producers push a
+fixed number of elements, consumers pop them with the blocking calls (futex
+waits included). Swept over the number of producers and consumers.
+*/
+
+#define QUEUE_ITEMS (1 << 18)
+#define QUEUE_CAPACITY 1024
+
+typedef struct {
+    uint64_t sequence;
+    char payload[48];
+} QueueItem; // with the cell sequence number, one cache line per cell
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) uint32_t start; // released by the parent once every process is ready
+    uint32_t ready;
+    _Alignas(CACHE_LINE_SIZE) uint64_t consumed;
+    uint64_t checksum;
+    double finished[64];
+} QueueRun;
+
+static void queue_producer(MpmcQueue *queue, QueueRun *run, int index, int producers) {
+    __atomic_fetch_add(&run->ready, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&run->start, __ATOMIC_ACQUIRE));
+    QueueItem item;
+    memset(&item, 0, sizeof(item));
+    for (uint64_t i = index; i < QUEUE_ITEMS; i += producers) {
+        item.sequence = i;
+        mpmc_queue_push(queue, &item);
+    }
+    run->finished[index] = bench_now();
+    _exit(EXIT_SUCCESS);
+}
+
+static void queue_consumer(MpmcQueue *queue, QueueRun *run, int index) {
+    __atomic_fetch_add(&run->ready, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&run->start, __ATOMIC_ACQUIRE));
+    QueueItem item;
+    uint64_t checksum = 0;
+    while (mpmc_queue_pop(queue, &item)) {
+        checksum += item.sequence;
+        if (__atomic_add_fetch(&run->consumed, 1, __ATOMIC_RELAXED) == QUEUE_ITEMS) {
+            mpmc_queue_close(queue); // wakes the other consumers
+        }
+    }
+    __atomic_fetch_add(&run->checksum, checksum, __ATOMIC_RELAXED);
+    run->finished[index] = bench_now();
+    _exit(EXIT_SUCCESS);
+}
+
+// One transfer of QUEUE_ITEMS elements, returns its duration
+static double queue_transfer(int producers, int consumers) {
+    MpmcQueue *queue = mpmc_queue_create(QUEUE_CAPACITY, sizeof(QueueItem));
+    QueueRun *run = mmap(NULL, sizeof(QueueRun), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (!queue || run == MAP_FAILED) {
+        perror("Error allocating the queue");
+        exit(EXIT_FAILURE);
+    }
+    int processes = producers + consumers;
+    for (int i = 0; i < processes; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            if (i < producers) queue_producer(queue, run, i, producers);
+            queue_consumer(queue, run, i);
+        }
+    }
+    while (__atomic_load_n(&run->ready, __ATOMIC_SEQ_CST) < (uint32_t)processes);
+    double start = bench_now();
+    __atomic_store_n(&run->start, 1, __ATOMIC_RELEASE);
+    while (wait(NULL) > 0);
+
+    double end = start;
+    for (int i = 0; i < processes; i++) {
+        if (run->finished[i] > end) end = run->finished[i];
+    }
+    uint64_t expected = (uint64_t)QUEUE_ITEMS * (QUEUE_ITEMS - 1) / 2;
+    if (run->consumed != QUEUE_ITEMS || run->checksum != expected) {
+        fprintf(stderr, "Queue lost or duplicated elements: %llu consumed\n", (unsigned long long)run->consumed);
+        exit(EXIT_FAILURE);
+    }
+    mpmc_queue_destroy(queue);
+    munmap(run, sizeof(QueueRun));
+    return end - start;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    if (!bench_parse_args(&config, argc, argv, NULL)) return 1;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    const int shapes[][2] = { { 1, 1 }, { 1, 4 }, { 4, 1 }, { 2, 2 }, { 4, 4 }, { 8, 8 } };
+    double *samples = malloc(config.repetitions * sizeof(double));
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        int producers = shapes[s][0], consumers = shapes[s][1];
+        if (producers + consumers > 2 * cores || producers + consumers > 64) continue;
+        for (int i = 0; i < config.warmup; i++) queue_transfer(producers, consumers);
+        for (int i = 0; i < config.repetitions; i++) samples[i] = queue_transfer(producers, consumers);
+
+        char params[128];
+        snprintf(params, sizeof(params), "producers=%d,consumers=%d,items=%d,capacity=%d,cores=%ld", producers, consumers, QUEUE_ITEMS, QUEUE_CAPACITY, cores);
+        BenchStats stats = bench_summarize(samples, config.repetitions);
+        bench_report(&config, "mpmc_queue", params, (size_t)QUEUE_ITEMS * sizeof(QueueItem), &stats);
+    }
+    free(samples);
+    bench_finish(&config);
+    return 0;
+}
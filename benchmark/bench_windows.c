@@ -0,0 +1,142 @@
+#include "api.h"
+#include "bench.h"
+
+/*
+Write throughput of windowed mappings against the window size, the window budget
+staying WINDOWS_BUDGET: a writer stores WINDOWS_WRITES records of WINDOWS_WRITE_SIZE
+bytes sequentially or randomly over a WINDOWS_FILE_SIZE file through
+windowed_write, or through one whole file mapping (window=0). Every pass of the
+writes starts with nothing mapped and the latency of every timed write is sampled.
+The windows mapped and evicted per pass are reported with every configuration, and
+merge_all of the logs must give the file with every write applied.
+*/
+
+#define WINDOWS_FILE "files/windows0"
+#define WINDOWS_FILE_SIZE (64 << 20)
+#define WINDOWS_BUDGET (8 << 20)
+#define WINDOWS_WRITES 1024
+#define WINDOWS_WRITE_SIZE 256
+
+typedef struct {
+    size_t window;
+    bool random;
+} WindowsParams;
+
+// Totals of the timed passes, in the sample slots following the write durations
+enum { WINDOWS_MAPPED, WINDOWS_EVICTED, WINDOWS_ELAPSED, WINDOWS_TOTALS };
+
+// Offset of write i, the random pattern is the same for every configuration
+static off_t windows_write_offset(bool random, size_t i) {
+    size_t slots = WINDOWS_FILE_SIZE / WINDOWS_WRITE_SIZE;
+    size_t slot = random ? (size_t)((i * 2654435761u) % slots) : i * (slots / WINDOWS_WRITES);
+    return (off_t)slot * WINDOWS_WRITE_SIZE;
+}
+
+/*
+Every pass of a configuration. A pass stores the same data and releases what it
+mapped; timed pass number rep samples its writes into samples + rep * WINDOWS_WRITES.
+*/
+static void windows_writer(BenchConfig *config, double *samples, void *context) {
+    WindowsParams *params = context;
+    size_t window = params->window;
+    bool random = params->random;
+    double *totals = samples + (size_t)config->repetitions * WINDOWS_WRITES;
+    char data[WINDOWS_WRITE_SIZE];
+    uint64_t mapped = 0, evicted = 0;
+    psar_config.window_size = window;
+    psar_config.window_budget = WINDOWS_BUDGET;
+    for (int pass = 0; pass < config->warmup + config->repetitions; pass++) {
+        double *durations = pass >= config->warmup ? samples + (size_t)(pass - config->warmup) * WINDOWS_WRITES : NULL;
+        char *mapped_region = NULL;
+        int fd = -1;
+        if (!window) {
+            fd = open(WINDOWS_FILE, O_RDONLY);
+            mapped_region = mmap(NULL, WINDOWS_FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+            if (fd == -1 || mapped_region == MAP_FAILED) _exit(EXIT_FAILURE);
+        }
+        if (pass == config->warmup) window_stats(&mapped, &evicted);
+        for (size_t i = 0; i < WINDOWS_WRITES; i++) {
+            memset(data, 'A' + i % 26, sizeof(data));
+            off_t offset = windows_write_offset(random, i);
+            double start = bench_now();
+            bool written = window ? windowed_write(WINDOWS_FILE, offset, data, sizeof(data))
+                                  : log_and_write_memory_region(mapped_region, offset, data, sizeof(data), WINDOWS_FILE_SIZE, WINDOWS_FILE);
+            double duration = bench_now() - start;
+            if (!written) _exit(EXIT_FAILURE);
+            if (durations) {
+                durations[i] = duration;
+                totals[WINDOWS_ELAPSED] += duration;
+            }
+        }
+        if (window) {
+            windows_release();
+        } else {
+            zero_copy_flush(mapped_region);
+            delta_snapshot_release(mapped_region, WINDOWS_FILE_SIZE);
+            unmap_file_region(mapped_region, WINDOWS_FILE_SIZE);
+            close(fd);
+        }
+    }
+    uint64_t all_mapped, all_evicted;
+    window_stats(&all_mapped, &all_evicted);
+    totals[WINDOWS_MAPPED] = all_mapped - mapped;
+    totals[WINDOWS_EVICTED] = all_evicted - evicted;
+}
+
+// merge_all of the writer's logs must hold the last write to every offset
+static bool windows_merge_matches(bool random) {
+    if (!merge_all(WINDOWS_FILE)) return false;
+    int fd = open("merge/merge_all_windows0", O_RDONLY);
+    char *merged = malloc(WINDOWS_FILE_SIZE), *expected = malloc(WINDOWS_FILE_SIZE);
+    bool matches = fd != -1 && merged && expected && read_fully(fd, merged, WINDOWS_FILE_SIZE) == WINDOWS_FILE_SIZE;
+    if (matches) {
+        memset(expected, 'w', WINDOWS_FILE_SIZE);
+        for (size_t i = 0; i < WINDOWS_WRITES; i++) {
+            memset(expected + windows_write_offset(random, i), 'A' + i % 26, WINDOWS_WRITE_SIZE);
+        }
+        matches = memcmp(merged, expected, WINDOWS_FILE_SIZE) == 0;
+    }
+    free(merged);
+    free(expected);
+    if (fd != -1) close(fd);
+    return matches;
+}
+
+static void windows_configuration(BenchConfig *config, size_t window, bool random) {
+    size_t writes = (size_t)config->repetitions * WINDOWS_WRITES;
+    if (system("rm -rf logs/* merge/*") != 0) fprintf(stderr, "Failed to clear logs\n");
+    WindowsParams writer_params = { window, random };
+    double *samples = bench_run_forked(config, windows_writer, &writer_params, writes + WINDOWS_TOTALS);
+    if (!samples || !windows_merge_matches(random)) {
+        fprintf(stderr, "Windowed writes of %zu bytes failed\n", window);
+        exit(EXIT_FAILURE);
+    }
+    const double *totals = samples + writes;
+
+    char params[192];
+    snprintf(params, sizeof(params), "pattern=%s,window=%zu,budget=%d,mapped=%llu,evicted=%llu,writes_per_s=%.0f,simulated=%d",
+             random ? "random" : "sequential", window, WINDOWS_BUDGET, (unsigned long long)totals[WINDOWS_MAPPED] / config->repetitions,
+             (unsigned long long)totals[WINDOWS_EVICTED] / config->repetitions, totals[WINDOWS_ELAPSED] > 0 ? writes / totals[WINDOWS_ELAPSED] : 0, psar_config.simulate);
+    BenchStats stats = bench_summarize(samples, writes);
+    bench_report(config, "windowed_write", params, WINDOWS_WRITE_SIZE, &stats);
+    bench_release_samples(samples, writes + WINDOWS_TOTALS);
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    if (!bench_parse_args(&config, argc, argv, NULL)) return 1;
+
+    char directory[] = BENCH_DIRECTORY_TEMPLATE;
+    bench_engine_start(directory, true);
+    bench_create_file(WINDOWS_FILE, WINDOWS_FILE_SIZE, 'w');
+    const size_t windows[] = { 64 << 10, 256 << 10, 1 << 20, 4 << 20, WINDOWS_BUDGET, 0 };
+    for (int random = 0; random <= 1; random++) {
+        for (size_t i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+            windows_configuration(&config, windows[i], random);
+        }
+    }
+
+    bench_engine_stop(directory);
+    bench_finish(&config);
+    return 0;
+}
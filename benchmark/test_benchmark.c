@@ -4,11 +4,27 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <time.h>
+#include "bench.h"
+
+/*
+Compares read-modify-write of a file through read/write system calls and through
+a shared memory mapping, for several file sizes and page access patterns.
+*/
 
-#define FILE_SIZE 10485700
 #define FILE_NAME "testfile.dat"
-#define NUM_ITERATIONS 10
+#define BLOCK_SIZE 4096
+
+typedef enum { PATTERN_SEQUENTIAL, PATTERN_RANDOM, PATTERN_STRIDED } AccessPattern;
+
+static const char *pattern_names[] = { "sequential", "random", "strided" };
+
+typedef struct {
+    const char *filename;
+    size_t size;
+    size_t *blocks; // block indexes in access order
+    size_t block_count;
+    char *buffer;
+} BenchFile;
 
 void generate_test_file(const char *filename, size_t size) {
     FILE *file = fopen(filename, "wb");
@@ -30,90 +46,115 @@ void generate_test_file(const char *filename, size_t size) {
     fclose(file);
 }
 
-double timed_io_operations(const char *filename) {
-    clock_t start, end;
-    char *buffer = malloc(FILE_SIZE);
-    if (buffer == NULL) {
-        perror("Error allocating buffer");
-        exit(EXIT_FAILURE);
+static void build_access_order(BenchFile *file, AccessPattern pattern) {
+    size_t count = file->size / BLOCK_SIZE;
+    file->block_count = count;
+    for (size_t i = 0; i < count; i++) {
+        file->blocks[i] = i;
+    }
+    if (pattern == PATTERN_RANDOM) {
+        for (size_t i = count - 1; i > 0; i--) {
+            size_t j = (size_t)rand() % (i + 1);
+            size_t swap = file->blocks[i];
+            file->blocks[i] = file->blocks[j];
+            file->blocks[j] = swap;
+        }
+    } else if (pattern == PATTERN_STRIDED) {
+        // every 16th block, then the next column, so consecutive accesses are 64 KB apart
+        size_t k = 0;
+        for (size_t column = 0; column < 16; column++) {
+            for (size_t i = column; i < count; i += 16) {
+                file->blocks[k++] = i;
+            }
+        }
     }
+}
 
-    start = clock();
-    // Reading
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        perror("Error opening file for reading");
-        free(buffer);
-        exit(EXIT_FAILURE);
+static void modify_block(char *block) {
+    for (size_t i = 0; i < BLOCK_SIZE; i += 64) {
+        block[i]++;
     }
-    fread(buffer, 1, FILE_SIZE, file);
-    fclose(file);
+}
 
-    // Writing
-    file = fopen(filename, "wb");
-    if (file == NULL) {
-        perror("Error opening file for writing");
-        free(buffer);
+void timed_io_operations(void *context) {
+    BenchFile *file = context;
+    int fd = open(file->filename, O_RDWR);
+    if (fd == -1) {
+        perror("Error opening file");
         exit(EXIT_FAILURE);
     }
-    fwrite(buffer, 1, FILE_SIZE, file);
-    fclose(file);
-    end = clock();
-
-    free(buffer);
-    return (double)(end - start) / CLOCKS_PER_SEC;
+    for (size_t i = 0; i < file->block_count; i++) {
+        off_t offset = (off_t)file->blocks[i] * BLOCK_SIZE;
+        if (pread(fd, file->buffer, BLOCK_SIZE, offset) != BLOCK_SIZE) {
+            perror("Error reading file");
+            exit(EXIT_FAILURE);
+        }
+        modify_block(file->buffer);
+        if (pwrite(fd, file->buffer, BLOCK_SIZE, offset) != BLOCK_SIZE) {
+            perror("Error writing file");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
 }
 
-double timed_mmap_operations(const char *filename) {
-    clock_t start, end;
-
-    int fd = open(filename, O_RDWR);
+void timed_mmap_operations(void *context) {
+    BenchFile *file = context;
+    int fd = open(file->filename, O_RDWR);
     if (fd == -1) {
         perror("Error opening file");
         exit(EXIT_FAILURE);
     }
-
-    start = clock();
-    // Memory mapping
-    char *map = mmap(NULL, FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    char *map = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (map == MAP_FAILED) {
         perror("Error mapping file");
         close(fd);
         exit(EXIT_FAILURE);
     }
-
-    // Simulate read and write
-    for (size_t i = 0; i < FILE_SIZE; ++i) {
-        char c = map[i]; // Read
-        map[i] = c;      // Write
+    for (size_t i = 0; i < file->block_count; i++) {
+        modify_block(map + file->blocks[i] * BLOCK_SIZE);
     }
-
-    // Unmap and close
-    if (munmap(map, FILE_SIZE) == -1) {
+    if (munmap(map, file->size) == -1) {
         perror("Error unmapping file");
     }
     close(fd);
-    end = clock();
-
-    return (double)(end - start) / CLOCKS_PER_SEC;
 }
 
-int main() {
-    generate_test_file(FILE_NAME, FILE_SIZE);
-
-    double io_total_time = 0.0;
-    double mmap_total_time = 0.0;
-
-    for (int i = 0; i < NUM_ITERATIONS; ++i) {
-        io_total_time += timed_io_operations(FILE_NAME);
-        mmap_total_time += timed_mmap_operations(FILE_NAME);
+int main(int argc, char **argv) {
+    BenchConfig config;
+    int next;
+    if (!bench_parse_args(&config, argc, argv, &next)) return 1;
+
+    // remaining arguments are file sizes in MB
+    size_t default_sizes[] = { 1, 10, 64 };
+    size_t size_count = argc > next ? (size_t)(argc - next) : sizeof(default_sizes) / sizeof(default_sizes[0]);
+    size_t *sizes = malloc(size_count * sizeof(size_t));
+    for (size_t i = 0; i < size_count; i++) {
+        sizes[i] = (argc > next ? strtoull(argv[next + i], NULL, 10) : default_sizes[i]) << 20;
     }
-
-    double io_avg_time = io_total_time / NUM_ITERATIONS;
-    double mmap_avg_time = mmap_total_time / NUM_ITERATIONS;
-
-    printf("Average I/O Operations Time: %f seconds\n", io_avg_time);
-    printf("Average Memory Mapped File Operations Time: %f seconds\n", mmap_avg_time);
-
+    srand(42);
+
+    for (size_t s = 0; s < size_count; s++) {
+        BenchFile file = { FILE_NAME, sizes[s], malloc(sizes[s] / BLOCK_SIZE * sizeof(size_t)), 0, malloc(BLOCK_SIZE) };
+        if (!file.blocks || !file.buffer || sizes[s] < BLOCK_SIZE) {
+            fprintf(stderr, "Invalid size %zu\n", sizes[s]);
+            return 1;
+        }
+        generate_test_file(FILE_NAME, file.size);
+        for (int p = PATTERN_SEQUENTIAL; p <= PATTERN_STRIDED; p++) {
+            build_access_order(&file, p);
+            char params[128];
+            snprintf(params, sizeof(params), "size=%zu,pattern=%s,block=%d", file.size, pattern_names[p], BLOCK_SIZE);
+            BenchStats stats = bench_run(&config, timed_io_operations, &file);
+            bench_report(&config, "pread_pwrite", params, file.size, &stats);
+            stats = bench_run(&config, timed_mmap_operations, &file);
+            bench_report(&config, "mmap_shared", params, file.size, &stats);
+        }
+        free(file.blocks);
+        free(file.buffer);
+    }
+    unlink(FILE_NAME);
+    free(sizes);
+    bench_finish(&config);
     return 0;
 }
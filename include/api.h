@@ -14,42 +14,481 @@
 #include <signal.h>
 #include <ucontext.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <time.h>
 #include <stdarg.h>
 #include <dirent.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include "ptedit_header.h"
 
 
 #define FILE_NAME_SIZE 128
 #define FILE_PERMISSIONS 0644
-#define TEST_FILE_FOLDER "files"
-#define NUMBER_OF_FILES 1
-#define NUMBER_OF_PROCESSES 1
-#define PAGE_SIZE 4096
+#define DEFAULT_TEST_FILE_FOLDER "files"
+#define DEFAULT_LOG_FOLDER "logs"
+#define DEFAULT_NUMBER_OF_FILES 1
+#define DEFAULT_NUMBER_OF_PROCESSES 1
+#define DEFAULT_FILE_SIZE (sizeof(DATA_DEMO) - 1) // one DATA_DEMO per test file
+#define DEFAULT_WINDOW_SIZE 0 // whole file mappings
+#define DEFAULT_WINDOW_BUDGET (256 << 20)
+#define CONFIG_FILE "psar.conf" // read from the working directory unless PSAR_CONFIG or --config names another
+#define CONFIG_PATH_SIZE 64
+#define NUMBER_OF_FILES (psar_config.files)
+#define NUMBER_OF_PROCESSES (psar_config.processes)
+#define TEST_FILE_FOLDER (psar_config.file_folder)
+#define LOG_FOLDER (psar_config.log_folder)
+#define PAGE_SIZE (psar_config.page_size) // base page size of the machine
 #define DATA_DEMO "------------ Hello World! ------------"
 #define WRITE_DEMO "xxx"
 #define WRITE_OFFSET 15
+#define LOG_RECORD_MAGIC 0x52415350 // "PSAR"
+#define LOG_SEGMENT_MAGIC 0x474c5350 // "PSLG"
+#define LOG_FORMAT_VERSION 2
+#define LOG_READER_BUFFER_SIZE (1 << 20)
+#define LOG_SEGMENT_MAX_SIZE (64 << 20) // a new segment is started past this size
+#define LOG_SEGMENT_MAX_AGE 60 // or after this many seconds
+#define LOG_SEGMENTS_OPEN 16 // segments a process keeps open at once
+#define LOG_DELTA_ENCODING 1
+#define LOG_DELTA_MAX_LEN (1 << 20) // larger writes are logged raw, their records streamed by the merge
+#define DELTA_SNAPSHOT_CAPACITY 1024
+#define DELTA_DIFF_RUNS 64
+#ifndef PSAR_STATS
+#define PSAR_STATS 1 // fault latency histograms, build with -DPSAR_STATS=0 to compile them out
+#endif
+#define STATS_FOLDER "stats"
+#define STATS_MAGIC 0x54535350 // "PSST"
+#define STATS_VERSION 1 // of the FaultStats layout, the file must also have its size
+#define STATS_SUB_BUCKET_BITS 6
+#define STATS_HISTOGRAM_BUCKETS ((66 - STATS_SUB_BUCKET_BITS) << (STATS_SUB_BUCKET_BITS - 1))
+#define METRICS_FILE STATS_FOLDER "/metrics.bin"
+#define METRICS_TEXT_FILE STATS_FOLDER "/metrics.prom"
+#define METRICS_MAGIC 0x544d5350 // "PSMT"
+#define METRICS_VERSION 1 // of the MetricsRegistry layout, its size is checked too
+#define METRICS_WRITER_SLOTS 1024 // writer processes the psar_writers_active gauge can count
+#ifndef PSAR_LOG_MIN_LEVEL
+#define PSAR_LOG_MIN_LEVEL LOG_DEBUG // messages below are compiled out, e.g. -DPSAR_LOG_MIN_LEVEL=LOG_ERROR
+#endif
+#define LOG_MESSAGE_SIZE 224
+#define LOG_RING_SLOTS 256
+#define LOG_SIGNAL_DRAIN_WAIT_MS 100 // an error logged by a signal handler waits this long to be written
+#define LOG_WRITER_BUFFER_SIZE (64 * 1024)
+#define LOG_BATCH_IOVECS 1024 // iovecs per writev, the Linux IOV_MAX
+#define POOL_QUEUE_CAPACITY 256 // power of two
+#define CACHE_LINE_SIZE 64
+#define POOL_TASK_DATA_SIZE 256
+#define POOL_LIVENESS_CHECK_MS 100 // a coordinator waiting on completions checks its workers this often
+#define POOL_MAPPINGS 16
+#define PRIVATIZE_BATCH_MIN 2 // fewer read only pages touched by a batch are left to the fault handler
+#define PRIVATIZED_PAGES_MAX (1 << 16) // privatized pages tracked per process until their mapping is released
+#define FREE_COPIES_MAX 1024 // private copies kept for reuse once their mapping is released
+#define MERGE_DROP_CHUNK (8 << 20) // bytes the merge copies between two page cache drops
+#define DATASET_CHUNK_SIZE (4 << 20) // bytes of a test file filled by one write of init
+#define DATASET_MAX_THREADS 64
+#define DIRTY_PAGEMAP_BATCH (1 << 15) // pagemap entries read per pread by dirty tracking, 128 MB of pages
 
-typedef enum { LOG_INFO, LOG_ERROR, LOG_DEBUG, LOG_UPDATE } LogLevel;
+// Bits of the /proc/self/pagemap entries
+#define PAGEMAP_SOFT_DIRTY (1ull << 55)
+#define PAGEMAP_FILE (1ull << 61) // file page or shared anonymous page
+#define PAGEMAP_SWAPPED (1ull << 62)
+#define PAGEMAP_PRESENT (1ull << 63)
+
+// Content of the test files created by init, see dataset_fill
+typedef enum { DATASET_PATTERN_DEMO, DATASET_PATTERN_CONSTANT, DATASET_PATTERN_RANDOM, DATASET_PATTERN_COMPRESSIBLE } DatasetPattern;
+// Access hint given to the writers' mappings, see advise_mapping
+typedef enum { ACCESS_NORMAL, ACCESS_SEQUENTIAL, ACCESS_RANDOM, ACCESS_WILLNEED, ACCESS_HUGEPAGE } AccessPolicy;
+typedef enum { LOG_DEBUG, LOG_INFO, LOG_UPDATE, LOG_ERROR, LOG_OFF } LogLevel; // by increasing severity
+typedef enum { LOG_FORMAT_TEXT, LOG_FORMAT_JSON, LOG_FORMAT_BINARY } LogFormat;
+typedef enum { LOG_ENCODING_RAW, LOG_ENCODING_DELTA } LogEncoding;
+typedef enum { LOG_READ_OK, LOG_READ_END, LOG_READ_TRUNCATED, LOG_READ_CORRUPT } LogReadStatus;
+typedef enum {
+    FAULT_PHASE_MMAP,
+    FAULT_PHASE_MEMCPY,
+    FAULT_PHASE_RESOLVE,
+    FAULT_PHASE_PMAP,
+    FAULT_PHASE_UPDATE,
+    FAULT_PHASE_TLB,
+    FAULT_PHASE_TOTAL,
+    FAULT_PHASE_COUNT
+} FaultPhase;
+typedef enum {
+    METRIC_FAULTS_HANDLED,
+    METRIC_PAGES_PRIVATIZED,
+    METRIC_LOG_RECORDS_WRITTEN,
+    METRIC_LOG_BYTES_WRITTEN,
+    METRIC_RECORDS_MERGED,
+    METRIC_MERGE_CONFLICTS,
+    METRIC_WRITERS_ACTIVE,
+    METRIC_RESOLVE_CACHE_HITS,
+    METRIC_RESOLVE_CACHE_MISSES,
+    METRIC_PAGES_RELEASED,
+    METRIC_DIRTY_PAGES_LOGGED,
+    METRIC_WINDOWS_MAPPED,
+    METRIC_WINDOW_EVICTIONS,
+    METRIC_PAGES_RELEASE_SKIPPED,
+    METRIC_COUNT
+} Metric;
+typedef enum { METRIC_MERGE_DURATION, METRIC_HISTOGRAM_COUNT } MetricHistogram;
+
+// Where dirty_region_scan found the written pages
+typedef enum { DIRTY_SOURCE_PTE, DIRTY_SOURCE_SOFT_DIRTY, DIRTY_SOURCE_PRIVATE_COPY } DirtySource;
+
+// A file mapped writable and private, its written pages found by scanning
+typedef struct {
+    char *region;
+    size_t size;
+    int fd;
+    char file_name[FILE_NAME_SIZE];
+    uint64_t *bitmap; // one bit per page, set by dirty_region_scan
+    uint64_t *logged; // pages whose content at the last checkpoint is in baseline
+    char *baseline; // content of the logged pages at the last checkpoint
+    size_t dirty_pages;
+    DirtySource source; // of the last scan
+    uint64_t soft_dirty_epoch; // clear_refs the soft-dirty bits of the region count from, see dirty_region_scan
+} DirtyRegion;
+
+// A page of a read only mapping remapped to its private copy
+typedef struct {
+    void *page;
+    void *copy; // where the copy is mapped in this process too
+    size_t original_pte;
+} PrivatizedPage;
+
+// Record of the binary log output, followed by length bytes of message
+typedef struct {
+    uint64_t timestamp; // CLOCK_REALTIME in nanoseconds
+    uint32_t pid;
+    uint32_t tid;
+    uint16_t level;
+    uint16_t length;
+    uint32_t reserved;
+} LogEvent;
+
+/*
+log_message only evaluates its arguments for levels enabled both at compile time
+(PSAR_LOG_MIN_LEVEL) and at run time (PSAR_LOG_LEVEL environment variable)
+*/
+#define log_message(level, ...) do { \
+    if ((level) >= PSAR_LOG_MIN_LEVEL && (level) >= log_threshold) log_emit((level), __VA_ARGS__); \
+} while (0)
+
+// log_message for signal handlers, see log_emit_signal for the formats it takes
+#define log_signal_message(level, ...) do { \
+    if ((level) >= PSAR_LOG_MIN_LEVEL && (level) >= log_threshold) log_emit_signal((level), __VA_ARGS__); \
+} while (0)
+
+extern LogLevel log_threshold;
+
+/*
+Settings that can change without recompiling. Defaults come from the DEFAULT_
+macros, then CONFIG_FILE, the environment and the command line override them in
+that order, see config_load. page_size is always the one of the machine.
+*/
+typedef struct {
+    int files;
+    int processes;
+    size_t page_size;
+    char file_folder[CONFIG_PATH_SIZE];
+    char log_folder[CONFIG_PATH_SIZE];
+    bool zero_copy;
+    bool simulate; // simulated page tables instead of PTEditor
+    bool dirty_tracking; // private writable mappings scanned for dirty pages instead of faults
+    size_t file_size; // of the test files created by init
+    DatasetPattern file_pattern;
+    bool direct_io; // init writes the test files with O_DIRECT
+    size_t window_size; // writers map windows of this many bytes instead of whole files, 0 for whole files
+    size_t window_budget; // bytes of windows mapped at once by a process
+    AccessPolicy access_policy;
+} PsarConfig;
+
+extern PsarConfig psar_config;
+
+// First bytes of every log file
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t pid;
+    uint64_t created; // CLOCK_REALTIME nanoseconds
+    uint32_t sequence; // position of the segment among those of its process
+    uint32_t crc; // CRC32C of the fields above
+} LogSegmentHeader;
+
+/*
+Every log record starts with this header. length is the number of bytes the
+record covers in the file, payload_size the number of bytes following the header
+(equal to length for raw records, the delta_encode output size otherwise).
+timestamp is the CLOCK_REALTIME time of the write in nanoseconds.
+*/
+typedef struct {
+    uint32_t magic;
+    uint32_t encoding;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t payload_size;
+    uint64_t timestamp;
+    uint32_t payload_crc; // CRC32C of the payload
+    uint32_t header_crc;  // CRC32C of the fields above
+} LogRecordHeader;
+
+// Segment a process currently appends to for one source file, kept open between writes
+typedef struct {
+    char file_name[FILE_NAME_SIZE];
+    int fd;
+    off_t size; // records are written at this offset
+    uint64_t opened; // stats_clock() at creation
+} LogSegment;
+
+// Position up to which a log segment was last found valid, stored next to it
+typedef struct {
+    uint64_t position;
+    uint32_t segment_crc;
+    uint32_t crc; // CRC32C of the fields above
+} LogCheckpoint;
+
+// Buffered sequential reader over the records of one log file
+typedef struct {
+    int fd;
+    char *buffer;
+    size_t capacity;
+    size_t start, end;
+    off_t position;
+    off_t file_size;
+    size_t records;
+    off_t payload_position; // of the last record returned without its payload, see log_reader_payload
+    off_t dropped; // bytes before it are dropped from the page cache
+    LogSegmentHeader segment;
+} LogReader;
+
+// Range of a file written once whose writeback is under way, see write_behind
+typedef struct {
+    int fd;
+    off_t offset;
+    off_t len;
+} WriteBehind;
+
+typedef bool (*LogFileVisitor)(const char *log_path, void *context);
+
+// A run of bytes that differ between two buffers, as found by page_diff
+typedef struct {
+    size_t offset;
+    size_t length;
+} DiffRun;
+
+/*
+Log-linear latency histogram in nanoseconds: exact below 2^STATS_SUB_BUCKET_BITS,
+then 2^(STATS_SUB_BUCKET_BITS - 1) buckets per power of two (about 3% precision).
+Updated with atomics only, so it can be recorded into from a signal handler.
+*/
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+} StatsHistogram;
+
+// Per process fault statistics, written to STATS_FOLDER/stats_<pid>.bin at exit
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t pid;
+    StatsHistogram phases[FAULT_PHASE_COUNT];
+} FaultStats;
+
+/*
+Counters, gauges and histograms shared by every psar process. The registry is a
+MAP_SHARED mapping of METRICS_FILE, so forked writers report into the same memory
+as their parent and the values accumulate across runs like Prometheus counters.
+*/
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size; // sizeof(MetricsRegistry) of the build that created it
+    int64_t values[METRIC_COUNT];
+    StatsHistogram histograms[METRIC_HISTOGRAM_COUNT]; // nanoseconds
+    int32_t writers[METRICS_WRITER_SLOTS]; // pids of the running writers, 0 for a free slot
+} MetricsRegistry;
+
+// Pages written by the logs already merged by merge_all, to count conflicting writes
+typedef struct {
+    uint32_t *page_writer; // number of the last log that wrote each page, 0 for none
+    size_t pages;
+    uint32_t writer;
+    uint64_t conflicts;
+} MergeConflicts;
+
+/*
+Bounded lock-free multi producer, multi consumer queue of fixed size elements
+(Vyukov's sequence numbered ring). Lives in a MAP_SHARED region so that processes
+forked after mpmc_queue_create share it; the blocking calls sleep on futexes.
+*/
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) uint64_t enqueue_position;
+    _Alignas(CACHE_LINE_SIZE) uint64_t dequeue_position;
+    _Alignas(CACHE_LINE_SIZE) uint32_t pushed; // futex, bumped by every push
+    uint32_t consumers_waiting;
+    _Alignas(CACHE_LINE_SIZE) uint32_t popped; // futex, bumped by every pop
+    uint32_t producers_waiting;
+    _Alignas(CACHE_LINE_SIZE) uint32_t closed;
+    size_t capacity;
+    size_t element_size;
+    size_t cell_size;
+    size_t mapping_size;
+    _Alignas(CACHE_LINE_SIZE) char cells[];
+} MpmcQueue;
+
+// One modification of a batch, see log_and_write_memory_regions
+typedef struct {
+    off_t offset;
+    const char *data;
+    size_t len;
+} WriteEntry;
+
+// One modification handed to a pool worker
+typedef struct {
+    uint64_t id;
+    char file_name[FILE_NAME_SIZE];
+    uint64_t offset;
+    uint32_t len;
+    char data[POOL_TASK_DATA_SIZE];
+} WriteTask;
+
+// Sent back by a worker for every task it ran
+typedef struct {
+    uint64_t id;
+    int32_t pid;
+    int32_t success;
+} TaskCompletion;
+
+// Long lived writer processes fed by a coordinator, see src/pool.c
+typedef struct {
+    MpmcQueue *tasks;
+    MpmcQueue *completions;
+    int workers;
+    pid_t *pids; // 0 once reaped
+    uint64_t *running; // shared with the workers: id + 1 of the task each one took last
+    uint64_t *last_completed; // id + 1 of the last completion collected from each worker
+    int alive;
+    uint64_t next_id;
+    uint64_t outstanding; // submitted tasks whose completion was not collected yet
+    uint64_t failed;
+} WriterPool;
+
+#if PSAR_STATS
+#define FAULT_TIMER_START() uint64_t fault_start = stats_clock(), fault_clock = fault_start
+#define FAULT_TIMER_PHASE(phase) fault_clock = stats_fault_phase(phase, fault_clock)
+#define FAULT_TIMER_END() stats_fault_phase(FAULT_PHASE_TOTAL, fault_start)
+#else
+#define FAULT_TIMER_START() do {} while (0)
+#define FAULT_TIMER_PHASE(phase) do {} while (0)
+#define FAULT_TIMER_END() do {} while (0)
+#endif
+
+typedef size_t (*PageDiffFn)(const char *a, const char *b, size_t len, size_t min_gap, DiffRun *runs, size_t max_runs);
 
 
-bool create_initial_project_files();
 bool start_file_write_processes();
-bool write_initial_data_to_files();
+bool start_file_write_pool(int rounds);
+MpmcQueue *mpmc_queue_create(size_t capacity, size_t element_size);
+void mpmc_queue_destroy(MpmcQueue *queue);
+bool mpmc_queue_try_push(MpmcQueue *queue, const void *element);
+bool mpmc_queue_try_pop(MpmcQueue *queue, void *element);
+bool mpmc_queue_push(MpmcQueue *queue, const void *element);
+bool mpmc_queue_pop(MpmcQueue *queue, void *element);
+bool mpmc_queue_pop_timed(MpmcQueue *queue, void *element, int timeout_ms);
+void mpmc_queue_close(MpmcQueue *queue);
+bool writer_pool_start(WriterPool *pool, int workers);
+bool writer_pool_submit(WriterPool *pool, const char *file_name, off_t offset, const char *data, size_t len);
+bool writer_pool_wait(WriterPool *pool);
+bool writer_pool_stop(WriterPool *pool);
+bool initialize_cow_engine();
+void cleanup_cow_engine();
+bool create_test_files(int threads);
+const char *dataset_pattern_name(DatasetPattern pattern);
 bool perform_file_modifications();
 void signal_handler(int sig, siginfo_t * si, void * unused);
 bool configure_signal_handlers();
-void log_message(LogLevel level, const char* format, ...);
+void log_init();
+void log_emit(LogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void log_flush();
+void log_prepare();
+void log_emit_signal(LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
 void log_virtual_to_physical(void* address);
 void* align_to_page_boundary(void* address);
+bool region_range_valid(off_t offset, size_t len, size_t region_size);
 bool log_and_write_memory_region(char *mapped_region, off_t offset, const char *data, size_t len, size_t region_size, char * file_name);
+bool log_and_write_memory_regions(char *mapped_region, const WriteEntry *entries, size_t count, size_t region_size, char * file_name);
+bool log_and_write_window(char *mapped_region, off_t region_offset, const WriteEntry *entries, size_t count, size_t region_size, char * file_name);
+size_t privatize_pages(void **pages, size_t count);
+void unmap_file_region(char *mapped_region, size_t region_size);
+bool append_log_records(const char *file_name, struct iovec *record, size_t records, size_t record_bytes);
+bool collect_dirty_ptes(char *region, size_t pages, uint64_t *bitmap, size_t *dirty);
+bool dirty_region_open(DirtyRegion *region, const char *file_name);
+size_t dirty_region_scan(DirtyRegion *region);
+bool dirty_region_checkpoint(DirtyRegion *region);
+bool dirty_regions_checkpoint(DirtyRegion *regions, int count);
+void dirty_region_close(DirtyRegion *region);
+bool windowed_write(const char *file_name, off_t offset, const char *data, size_t len);
+void windows_release();
+void window_stats(uint64_t *mapped, uint64_t *evicted);
+const char *access_policy_name(AccessPolicy policy);
+void advise_mapping(void *region, size_t len, int fd, off_t offset);
+void advise_read_done(int fd, off_t offset, off_t len);
+void write_behind(WriteBehind *behind, off_t offset, off_t len);
+void write_behind_finish(WriteBehind *behind);
+bool zero_copy_enabled();
+bool config_load(int *argc, char **argv);
+void config_print(FILE *out);
+bool zero_copy_prepare(char *mapped_region, off_t region_offset, size_t region_size, char *file_name);
+bool zero_copy_write(char *mapped_region, off_t region_offset, off_t offset, const char *data, size_t len, size_t region_size, char *file_name);
+bool zero_copy_flush(char *mapped_region);
 bool ensure_directory_exists(const char* dir_path);
 bool merge(const char* original_file_path, const char* log_file_path);
-void initialize_project_environment();
+void initialize_project_environment(int threads);
 void create_required_directories();
 void show_diff(const char *file1, const char *file2);
 bool merge_all(char * source_file_path);
 bool is_log_file(const char *filename, const char *target);
-void apply_merge(int to_fd, int from_fd);
+bool apply_merge(int to_fd, int from_fd, int source_fd, MergeConflicts *conflicts);
+bool for_each_log_file(const char *target, LogFileVisitor visit, void *context);
+ssize_t read_fully(int fd, void *buffer, size_t len);
+void delta_snapshot_store(void *page, const void *contents);
+const char *delta_snapshot_lookup(const void *page);
+void delta_snapshot_release(void *region, size_t len);
+bool delta_load_original(const char *mapped_region, off_t offset, size_t len, char *out);
+size_t delta_encode(const char *original, const char *data, size_t len, char *out);
+bool delta_apply(char *target, size_t len, const char *payload, size_t payload_size);
+size_t page_diff(const char *a, const char *b, size_t len, size_t min_gap, DiffRun *runs, size_t max_runs);
+PageDiffFn page_diff_kernel(const char *isa);
+const char *page_diff_isa();
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+int log_segment_open(const char *path, uint32_t sequence);
+LogSegment *log_segment_for_file(const char *file_name, size_t record_bytes);
+uint64_t log_record_clock();
+void log_record_seal(LogRecordHeader *header, const void *payload);
+bool log_reader_open(LogReader *reader, int fd);
+LogReadStatus log_reader_next(LogReader *reader, LogRecordHeader *header, const char **payload);
+bool log_reader_seek(LogReader *reader, off_t position);
+ssize_t log_reader_payload(LogReader *reader, uint64_t offset, void *buffer, size_t len);
+void log_reader_close(LogReader *reader);
+bool recover_log(const char *log_path);
+const char *log_read_status_string(LogReadStatus status);
+bool verify_log(const char *log_path);
+bool verify_all_logs();
+uint64_t stats_clock();
+void stats_histogram_record(StatsHistogram *histogram, uint64_t value);
+void stats_histogram_merge(StatsHistogram *into, const StatsHistogram *from);
+uint64_t stats_histogram_percentile(const StatsHistogram *histogram, double percentile);
+uint64_t stats_histogram_count_below(const StatsHistogram *histogram, uint64_t value);
+uint64_t stats_fault_phase(FaultPhase phase, uint64_t since);
+bool stats_dump();
+bool stats_report(const char *stats_path);
+bool metrics_init();
+void metrics_add(Metric metric, int64_t delta);
+void metrics_observe(MetricHistogram histogram, uint64_t nanoseconds);
+void metrics_writer_started(pid_t pid);
+void metrics_writer_stopped(pid_t pid);
+void metrics_render(FILE *out);
+bool metrics_export(const char *target);
 
 #endif
\ No newline at end of file
@@ -187,6 +187,8 @@ typedef size_t pid_t;
 #define PTEDIT_IMPL_USER_PREAD   1
 /** Use the user-space implemenation that maps the physical memory into user space to resolve and update paging structures */
 #define PTEDIT_IMPL_USER         2
+/** Use page tables simulated in user space, see ptedit_init_simulation */
+#define PTEDIT_IMPL_SIMULATED    3
 
 /**
  * The bits in a page-table entry
@@ -359,6 +361,21 @@ ptedit_fnc void ptedit_cleanup();
  */
 ptedit_fnc void ptedit_use_implementation(int implementation);
 
+/**
+ * Initializes a simulated 4-level page table instead of the kernel module, and
+ * selects PTEDIT_IMPL_SIMULATED. The tables live in a simulated physical memory
+ * and are resolved and updated like the real ones; their leaf entries point to
+ * frames standing for the pages of the process, created on first resolve with
+ * the RW bit clear. Invalidating the TLB for an address whose PTE was pointed to
+ * the frame of another page swaps the two pages (mremap), so the remap takes
+ * effect for the process; the page that was replaced shows at the other address,
+ * and pointing the PTE back to its frame swaps them again. x86-64 only.
+ *
+ * @return 0 Initialization was successful
+ * @return -1 Initialization failed
+ */
+ptedit_fnc int ptedit_init_simulation();
+
 /** @} */
 
 
@@ -450,6 +467,81 @@ ptedit_fnc size_t ptedit_pte_get_pfn(void* address, pid_t pid);
  */
 ptedit_fnc void ptedit_pte_set_pfn(void* address, pid_t pid, size_t pfn);
 
+/**
+ * A page to remap with ptedit_remap_batch
+ */
+typedef struct {
+    /** Virtual address of the page */
+    void* address;
+    /** Page-frame number (PFN) the page is pointed to */
+    size_t pfn;
+} ptedit_remap_t;
+
+/**
+ * Reads the PTEs of several pages. Consecutive addresses covered by the same page
+ * table share one resolve of the upper levels and one mapping of the page table.
+ *
+ * @param[in] addresses The virtual addresses
+ * @param[in] count The number of addresses
+ * @param[in] pid The pid of the process (0 for own process)
+ * @param[out] ptes The PTE of every address, 0 for addresses without a PTE (unmapped or huge pages)
+ *
+ * @return The number of PTEs read
+ *
+ */
+ptedit_fnc size_t ptedit_pte_get_batch(void** addresses, size_t count, pid_t pid, size_t* ptes);
+
+/**
+ * Points the PTEs of several pages to new page frames, setting set_bits in them.
+ * Upper levels are resolved once per page table and the entries are written
+ * through a mapping of the page table; the TLB is invalidated once every entry
+ * is written, with a single flush of the whole TLB for batches of more than
+ * PTEDIT_TLB_FLUSH_CEILING pages of the own process and page by page otherwise.
+ * Falls back to ptedit_update per page when physical memory cannot be mapped.
+ *
+ * @param[in] remaps The pages and their new PFNs
+ * @param[in] count The number of pages
+ * @param[in] pid The pid of the process (0 for own process)
+ * @param[in] set_bits Bits to set in every updated PTE, e.g. (1ull << PTEDIT_PAGE_BIT_RW)
+ *
+ * @return The number of PTEs updated
+ *
+ */
+ptedit_fnc size_t ptedit_remap_batch(ptedit_remap_t* remaps, size_t count, pid_t pid, size_t set_bits);
+
+/**
+ * Drops the cached upper levels of the paging structures covering a range. The
+ * user-space implementations cache the entries read above the page table, per
+ * 2 MB and per 1 GB region, so that resolving an address next to one already
+ * resolved only reads its PTE and the entry above it, which checks that the
+ * cached tables are still in use. Updates of upper levels through ptedit_update
+ * clear the cache; calling this when the kernel may have freed or replaced page
+ * tables of the range, e.g. after unmapping it, saves the failed checks.
+ *
+ * @param[in] address The start of the range
+ * @param[in] length The length of the range in bytes, 0 clears the whole cache
+ *
+ */
+ptedit_fnc void ptedit_resolve_cache_invalidate(void* address, size_t length);
+
+/**
+ * Returns the resolves of this process that reused cached upper levels, and those
+ * that walked every level
+ *
+ * @param[out] hits The number of resolves served from the cache
+ * @param[out] misses The number of resolves reading every level
+ *
+ */
+ptedit_fnc void ptedit_resolve_cache_stats(size_t* hits, size_t* misses);
+
+/**
+ * Prepares a forked child: its page tables are copies, the cache of upper levels
+ * is cleared and the user space implementations walk the child's own tables
+ * from now on. Call it in the child right after fork, e.g. from pthread_atfork.
+ *
+ */
+ptedit_fnc void ptedit_after_fork(void);
+
 
 #if defined(__i386__) || defined(__x86_64__) || defined(_WIN64)
 #define PTEDIT_PAGE_PRESENT 1
@@ -988,6 +1080,13 @@ ptedit_fnc void ptedit_print_entry_line(size_t entry, int line);
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#ifndef MREMAP_MAYMOVE
+#define MREMAP_MAYMOVE 1
+#endif
+#ifndef MREMAP_FIXED
+#define MREMAP_FIXED 2
+#endif
 #else
 #include <Windows.h>
 #endif
@@ -1017,6 +1116,55 @@ static size_t ptedit_pfn_multiply = 4096;
 static size_t ptedit_entry_size = sizeof(size_t);
 static size_t ptedit_paging_root;
 static unsigned char* ptedit_vmem;
+static char* ptedit_tlb_flush_region; /* see ptedit_invalidate_tlb_all */
+
+/** Batches remapping more pages than the kernel's single page flush ceiling flush the whole TLB */
+#if defined(__i386__) || defined(__x86_64__)
+#define PTEDIT_TLB_FLUSH_CEILING 33
+#elif defined(__aarch64__)
+#define PTEDIT_TLB_FLUSH_CEILING 512
+#endif
+/** Pages of ptedit_tlb_flush_region, twice the ceiling so that its protection change is a full flush */
+#define PTEDIT_TLB_FLUSH_PAGES (2 * PTEDIT_TLB_FLUSH_CEILING)
+
+/** Simulated page tables, see ptedit_init_simulation */
+#define PTEDIT_SIM_TABLE_FRAMES (1ull << 14)
+/** Simulated frames standing for pages of the process, numbered after the table frames */
+#define PTEDIT_SIM_DATA_FRAMES (1ull << 20)
+#define PTEDIT_SIM_HASH_SLOTS (2 * PTEDIT_SIM_DATA_FRAMES)
+/** Present, writeable and user bits of simulated table entries */
+#define PTEDIT_SIM_TABLE_BITS 0x7ull
+/** Present, user and accessed bits of simulated page entries */
+#define PTEDIT_SIM_PAGE_BITS 0x25ull
+
+typedef struct {
+    size_t page;
+    size_t pfn; /* 0 once the page is mapped to no frame */
+} ptedit_sim_slot_t;
+
+/** Entries of each resolve cache, direct mapped by region number */
+#define PTEDIT_RESOLVE_CACHE_ENTRIES 64
+
+typedef struct {
+    size_t root;
+    size_t region; /* address >> region shift, +1 so that 0 is an empty entry */
+    size_t pgd, p4d, pud, pmd;
+    size_t valid;
+} ptedit_resolve_cache_t;
+
+static ptedit_resolve_cache_t ptedit_resolve_cache_pmd[PTEDIT_RESOLVE_CACHE_ENTRIES]; /* 2 MB regions, up to the PMD */
+static ptedit_resolve_cache_t ptedit_resolve_cache_pud[PTEDIT_RESOLVE_CACHE_ENTRIES]; /* 1 GB regions, up to the PUD */
+static size_t ptedit_resolve_cache_hits;
+static size_t ptedit_resolve_cache_misses;
+
+static int ptedit_simulated;
+static unsigned char* ptedit_sim_tables;
+static size_t ptedit_sim_root;
+static size_t ptedit_sim_tables_used;
+static size_t ptedit_sim_data_used;
+static size_t* ptedit_sim_frame_page; /* page of every data frame */
+static void* ptedit_sim_spare; /* reserved page used to swap two pages */
+static ptedit_sim_slot_t* ptedit_sim_slots; /* page -> data frame, open addressing */
 
 typedef struct {
     int has_pgd, has_p4d, has_pud, has_pmd, has_pt;
@@ -1089,6 +1237,48 @@ static inline void ptedit_phys_write_pwrite(size_t address, size_t value) {
 #endif
 }
 
+// ---------------------------------------------------------------------------
+static ptedit_resolve_cache_t* ptedit_resolve_cache_find(ptedit_resolve_cache_t* cache, size_t root, size_t region) {
+    ptedit_resolve_cache_t* entry = &cache[region % PTEDIT_RESOLVE_CACHE_ENTRIES];
+    return (entry->region == region + 1 && entry->root == root) ? entry : NULL;
+}
+
+// ---------------------------------------------------------------------------
+static void ptedit_resolve_cache_store(ptedit_resolve_cache_t* cache, size_t root, size_t region, ptedit_entry_t* resolved) {
+    ptedit_resolve_cache_t* entry = &cache[region % PTEDIT_RESOLVE_CACHE_ENTRIES];
+    entry->root = root;
+    entry->region = region + 1;
+    entry->pgd = resolved->pgd;
+    entry->p4d = resolved->p4d;
+    entry->pud = resolved->pud;
+    entry->pmd = resolved->pmd;
+    entry->valid = resolved->valid;
+}
+
+// ---------------------------------------------------------------------------
+ptedit_fnc void ptedit_resolve_cache_invalidate(void* address, size_t length) {
+    if (length == 0) {
+        memset(ptedit_resolve_cache_pmd, 0, sizeof(ptedit_resolve_cache_pmd));
+        memset(ptedit_resolve_cache_pud, 0, sizeof(ptedit_resolve_cache_pud));
+        return;
+    }
+    size_t pmd_shift = ptedit_paging_definition.page_offset + ptedit_paging_definition.pt_entries;
+    size_t pud_shift = pmd_shift + ptedit_paging_definition.pmd_entries;
+    size_t first = (size_t)address, last = (size_t)address + length - 1;
+    for (size_t i = 0; i < PTEDIT_RESOLVE_CACHE_ENTRIES; i++) {
+        size_t region = ptedit_resolve_cache_pmd[i].region;
+        if (region && region - 1 >= first >> pmd_shift && region - 1 <= last >> pmd_shift) ptedit_resolve_cache_pmd[i].region = 0;
+        region = ptedit_resolve_cache_pud[i].region;
+        if (region && region - 1 >= first >> pud_shift && region - 1 <= last >> pud_shift) ptedit_resolve_cache_pud[i].region = 0;
+    }
+}
+
+// ---------------------------------------------------------------------------
+ptedit_fnc void ptedit_resolve_cache_stats(size_t* hits, size_t* misses) {
+    *hits = ptedit_resolve_cache_hits;
+    *misses = ptedit_resolve_cache_misses;
+}
+
 // ---------------------------------------------------------------------------
 static ptedit_entry_t ptedit_resolve_user_ext(void* address, pid_t pid, ptedit_phys_read_t deref) {
     size_t root = (pid == 0) ? ptedit_paging_root : ptedit_get_paging_root(pid);
@@ -1122,54 +1312,91 @@ static ptedit_entry_t ptedit_resolve_user_ext(void* address, pid_t pid, ptedit_p
 
     size_t pgd_entry, p4d_entry, pud_entry, pmd_entry, pt_entry;
 
-    //     printf("%zx + CR3(%zx) + PGDI(%zx) * 8 = %zx\n", ptedit_vmem, root, pgdi, ptedit_vmem + root + pgdi * ptedit_entry_size);
-    pgd_entry = deref(root + pgdi * ptedit_entry_size);
-    if (ptedit_cast(pgd_entry, ptedit_pgd_t).present != PTEDIT_PAGE_PRESENT) {
-        return resolved;
-    }
-    resolved.pgd = pgd_entry;
-    resolved.valid |= PTEDIT_VALID_MASK_PGD;
-    if (ptedit_paging_definition.has_p4d) {
-        size_t pfn = (size_t)(ptedit_cast(pgd_entry, ptedit_pgd_t).pfn);
-        p4d_entry = deref(pfn * ptedit_pfn_multiply + p4di * ptedit_entry_size);
-        resolved.valid |= PTEDIT_VALID_MASK_P4D;
+    size_t pmd_shift = ptedit_paging_definition.page_offset + ptedit_paging_definition.pt_entries;
+    size_t pud_shift = pmd_shift + ptedit_paging_definition.pmd_entries;
+    /* The kernel may have freed and reused the tables below a cached entry since (munmap, fork): an entry is
+     * only used when the table above it still holds it, one read instead of the walk down to it */
+    ptedit_resolve_cache_t* pmd_cached = ptedit_resolve_cache_find(ptedit_resolve_cache_pmd, root, addr >> pmd_shift);
+    if (pmd_cached && ptedit_paging_definition.has_pmd &&
+        deref((size_t)(ptedit_cast(pmd_cached->pud, ptedit_pud_t).pfn) * ptedit_pfn_multiply + pmdi * ptedit_entry_size) != pmd_cached->pmd) {
+        pmd_cached->region = 0;
+        pmd_cached = NULL;
     }
-    else {
-        p4d_entry = pgd_entry;
+    ptedit_resolve_cache_t* pud_cached = pmd_cached ? NULL : ptedit_resolve_cache_find(ptedit_resolve_cache_pud, root, addr >> pud_shift);
+    if (pud_cached && ptedit_paging_definition.has_pud &&
+        deref((size_t)(ptedit_cast(pud_cached->p4d, ptedit_p4d_t).pfn) * ptedit_pfn_multiply + pudi * ptedit_entry_size) != pud_cached->pud) {
+        pud_cached->region = 0;
+        pud_cached = NULL;
     }
-    resolved.p4d = p4d_entry;
+    ptedit_resolve_cache_t* cached = pmd_cached ? pmd_cached : pud_cached;
+    if (cached) {
+        ptedit_resolve_cache_hits++;
+        resolved.pgd = pgd_entry = cached->pgd;
+        resolved.p4d = p4d_entry = cached->p4d;
+        resolved.pud = pud_entry = cached->pud;
+        resolved.pmd = pmd_entry = cached->pmd;
+        resolved.valid = cached->valid;
+    } else {
+        ptedit_resolve_cache_misses++;
 
-    if (ptedit_cast(p4d_entry, ptedit_p4d_t).present != PTEDIT_PAGE_PRESENT) {
-        return resolved;
-    }
+        //     printf("%zx + CR3(%zx) + PGDI(%zx) * 8 = %zx\n", ptedit_vmem, root, pgdi, ptedit_vmem + root + pgdi * ptedit_entry_size);
+        pgd_entry = deref(root + pgdi * ptedit_entry_size);
+        if (ptedit_cast(pgd_entry, ptedit_pgd_t).present != PTEDIT_PAGE_PRESENT) {
+            return resolved;
+        }
+        resolved.pgd = pgd_entry;
+        resolved.valid |= PTEDIT_VALID_MASK_PGD;
+        if (ptedit_paging_definition.has_p4d) {
+            size_t pfn = (size_t)(ptedit_cast(pgd_entry, ptedit_pgd_t).pfn);
+            p4d_entry = deref(pfn * ptedit_pfn_multiply + p4di * ptedit_entry_size);
+            resolved.valid |= PTEDIT_VALID_MASK_P4D;
+        }
+        else {
+            p4d_entry = pgd_entry;
+        }
+        resolved.p4d = p4d_entry;
 
+        if (ptedit_cast(p4d_entry, ptedit_p4d_t).present != PTEDIT_PAGE_PRESENT) {
+            return resolved;
+        }
 
-    if (ptedit_paging_definition.has_pud) {
-        size_t pfn = (size_t)(ptedit_cast(p4d_entry, ptedit_p4d_t).pfn);
-        pud_entry = deref(pfn * ptedit_pfn_multiply + pudi * ptedit_entry_size);
-        resolved.valid |= PTEDIT_VALID_MASK_PUD;
-    }
-    else {
-        pud_entry = p4d_entry;
-    }
-    resolved.pud = pud_entry;
 
-    if (ptedit_cast(pud_entry, ptedit_pud_t).present != PTEDIT_PAGE_PRESENT) {
-        return resolved;
-    }
+        if (ptedit_paging_definition.has_pud) {
+            size_t pfn = (size_t)(ptedit_cast(p4d_entry, ptedit_p4d_t).pfn);
+            pud_entry = deref(pfn * ptedit_pfn_multiply + pudi * ptedit_entry_size);
+            resolved.valid |= PTEDIT_VALID_MASK_PUD;
+        }
+        else {
+            pud_entry = p4d_entry;
+        }
+        resolved.pud = pud_entry;
 
-    if (ptedit_paging_definition.has_pmd) {
-        size_t pfn = (size_t)(ptedit_cast(pud_entry, ptedit_pud_t).pfn);
-        pmd_entry = deref(pfn * ptedit_pfn_multiply + pmdi * ptedit_entry_size);
-        resolved.valid |= PTEDIT_VALID_MASK_PMD;
-    }
-    else {
-        pmd_entry = pud_entry;
+        if (ptedit_cast(pud_entry, ptedit_pud_t).present != PTEDIT_PAGE_PRESENT) {
+            return resolved;
+        }
+        if (ptedit_paging_definition.has_pmd) {
+            ptedit_resolve_cache_store(ptedit_resolve_cache_pud, root, addr >> pud_shift, &resolved);
+        }
     }
-    resolved.pmd = pmd_entry;
 
-    if (ptedit_cast(pmd_entry, ptedit_pmd_t).present != PTEDIT_PAGE_PRESENT) {
-        return resolved;
+    if (!pmd_cached) {
+        if (ptedit_paging_definition.has_pmd) {
+            size_t pfn = (size_t)(ptedit_cast(pud_entry, ptedit_pud_t).pfn);
+            pmd_entry = deref(pfn * ptedit_pfn_multiply + pmdi * ptedit_entry_size);
+            resolved.valid |= PTEDIT_VALID_MASK_PMD;
+        }
+        else {
+            pmd_entry = pud_entry;
+        }
+        resolved.pmd = pmd_entry;
+
+        if (ptedit_cast(pmd_entry, ptedit_pmd_t).present != PTEDIT_PAGE_PRESENT) {
+            return resolved;
+        }
+#if defined(__i386__) || defined(__x86_64__) || defined(_WIN64)
+        if (!ptedit_cast(pmd_entry, ptedit_pmd_t).size)
+#endif
+            ptedit_resolve_cache_store(ptedit_resolve_cache_pmd, root, addr >> pmd_shift, &resolved);
     }
 
 #if defined(__i386__) || defined(__x86_64__) || defined(_WIN64)
@@ -1202,6 +1429,14 @@ static ptedit_entry_t ptedit_resolve_user_map(void* address, pid_t pid) {
 }
 
 
+// ---------------------------------------------------------------------------
+ptedit_fnc void ptedit_after_fork(void) {
+    ptedit_resolve_cache_invalidate(NULL, 0);
+    if (ptedit_resolve == ptedit_resolve_user || ptedit_resolve == ptedit_resolve_user_map) {
+        ptedit_paging_root = ptedit_get_paging_root(0);
+    }
+}
+
 // ---------------------------------------------------------------------------
 ptedit_fnc void ptedit_update_kernel(void* address, pid_t pid, ptedit_entry_t* vm) {
     vm->vaddr = (size_t)address;
@@ -1239,6 +1474,9 @@ ptedit_fnc void ptedit_update_user_ext(void* address, pid_t pid, ptedit_entry_t*
         + ptedit_paging_definition.pt_entries)) % (1ull << ptedit_paging_definition.pmd_entries);
     pti = (addr >> ptedit_paging_definition.page_offset) % (1ull << ptedit_paging_definition.pt_entries);
 
+    if (vm->valid & (PTEDIT_VALID_MASK_PGD | PTEDIT_VALID_MASK_P4D | PTEDIT_VALID_MASK_PUD | PTEDIT_VALID_MASK_PMD)) {
+        ptedit_resolve_cache_invalidate(NULL, 0);
+    }
     if ((vm->valid & PTEDIT_VALID_MASK_PTE) && (current.valid & PTEDIT_VALID_MASK_PTE)) {
         pset((size_t)ptedit_cast(current.pmd, ptedit_pmd_t).pfn * ptedit_pfn_multiply + pti * ptedit_entry_size, vm->pte);
     }
@@ -1271,8 +1509,167 @@ static void ptedit_update_user_map(void* address, pid_t pid, ptedit_entry_t* vm)
     ptedit_invalidate_tlb(address);
 }
 
+// ---------------------------------------------------------------------------
+static size_t* ptedit_sim_entry(size_t table, size_t address, int level_shift) {
+    return (size_t*)(ptedit_sim_tables + table) + ((address >> level_shift) % (1ull << ptedit_paging_definition.pt_entries));
+}
+
+// ---------------------------------------------------------------------------
+static size_t* ptedit_sim_leaf(size_t address, int create) {
+    int shifts[] = { 39, 30, 21 };
+    size_t table = ptedit_sim_root;
+    for (int level = 0; level < 3; level++) {
+        size_t* entry = ptedit_sim_entry(table, address, shifts[level]);
+        if (!(*entry & 1)) {
+            if (!create || ptedit_sim_tables_used == PTEDIT_SIM_TABLE_FRAMES) return NULL;
+            *entry = ptedit_set_pfn(PTEDIT_SIM_TABLE_BITS, ptedit_sim_tables_used++);
+        }
+        table = ptedit_get_pfn(*entry) * ptedit_pfn_multiply;
+    }
+    return ptedit_sim_entry(table, address, 12);
+}
+
+// ---------------------------------------------------------------------------
+static ptedit_sim_slot_t* ptedit_sim_slot(size_t page) {
+    size_t slot = ((page >> 12) * 0x9E3779B97F4A7C15ull) >> 43;
+    for (size_t probe = 0; probe < PTEDIT_SIM_HASH_SLOTS; probe++) {
+        ptedit_sim_slot_t* candidate = &ptedit_sim_slots[(slot + probe) % PTEDIT_SIM_HASH_SLOTS];
+        if (candidate->page == page || candidate->page == 0) return candidate;
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+static size_t ptedit_sim_frame(size_t page) {
+    ptedit_sim_slot_t* slot = ptedit_sim_slot(page);
+    if (!slot) return 0;
+    if (!slot->pfn) {
+        if (ptedit_sim_data_used == PTEDIT_SIM_DATA_FRAMES) return 0;
+        slot->page = page;
+        slot->pfn = PTEDIT_SIM_TABLE_FRAMES + ptedit_sim_data_used;
+        ptedit_sim_frame_page[ptedit_sim_data_used++] = page;
+    }
+    return slot->pfn;
+}
+
+// ---------------------------------------------------------------------------
+static ptedit_entry_t ptedit_resolve_sim(void* address, pid_t pid) {
+    size_t page = (size_t)address & ~(size_t)(ptedit_pagesize - 1);
+    size_t* leaf = ptedit_sim_leaf(page, 0);
+    unsigned char residency;
+    // pages seen for the first time get an entry if the process maps them
+    if ((!leaf || !(*leaf & 1)) && mincore((void*)page, ptedit_pagesize, &residency) == 0) {
+        leaf = ptedit_sim_leaf(page, 1);
+        size_t pfn = ptedit_sim_frame(page);
+        if (leaf && pfn) *leaf = ptedit_set_pfn(PTEDIT_SIM_PAGE_BITS, pfn);
+    }
+    return ptedit_resolve_user_ext(address, pid, ptedit_phys_read_map);
+}
+
+// ---------------------------------------------------------------------------
+static void ptedit_update_sim(void* address, pid_t pid, ptedit_entry_t* vm) {
+    ptedit_update_user_ext(address, pid, vm, ptedit_phys_write_map);
+}
+
+// ---------------------------------------------------------------------------
+static int ptedit_sim_swap(size_t first, size_t second) {
+#if defined(LINUX)
+    // first is parked on the spare page while second moves in its place
+    size_t spare = (size_t)ptedit_sim_spare;
+    if ((void*)syscall(SYS_mremap, first, ptedit_pagesize, ptedit_pagesize, MREMAP_MAYMOVE | MREMAP_FIXED, spare) == MAP_FAILED) {
+        return 0;
+    }
+    if ((void*)syscall(SYS_mremap, second, ptedit_pagesize, ptedit_pagesize, MREMAP_MAYMOVE | MREMAP_FIXED, first) == MAP_FAILED) {
+        syscall(SYS_mremap, spare, ptedit_pagesize, ptedit_pagesize, MREMAP_MAYMOVE | MREMAP_FIXED, first);
+        mmap(ptedit_sim_spare, ptedit_pagesize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        return 0;
+    }
+    syscall(SYS_mremap, spare, ptedit_pagesize, ptedit_pagesize, MREMAP_MAYMOVE | MREMAP_FIXED, second);
+    // keep the spare address reserved
+    mmap(ptedit_sim_spare, ptedit_pagesize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+static void ptedit_invalidate_tlb_sim(void* address) {
+    size_t page = (size_t)address & ~(size_t)(ptedit_pagesize - 1);
+    size_t* leaf = ptedit_sim_leaf(page, 0);
+    if (!leaf || !(*leaf & 1)) return;
+    size_t pfn = ptedit_get_pfn(*leaf);
+    if (pfn < PTEDIT_SIM_TABLE_FRAMES || pfn >= PTEDIT_SIM_TABLE_FRAMES + ptedit_sim_data_used) return;
+    size_t source = ptedit_sim_frame_page[pfn - PTEDIT_SIM_TABLE_FRAMES];
+    if (source == page || source == 0) return;
+    // the page of the frame now backs address, and the page it replaces takes its place
+    if (!ptedit_sim_swap(source, page)) return;
+    ptedit_sim_slot_t* slot = ptedit_sim_slot(page);
+    size_t displaced = slot ? slot->pfn : 0;
+    if (slot) {
+        slot->page = page;
+        slot->pfn = pfn;
+    }
+    ptedit_sim_frame_page[pfn - PTEDIT_SIM_TABLE_FRAMES] = page;
+    slot = ptedit_sim_slot(source);
+    if (slot) slot->pfn = displaced;
+    if (displaced) ptedit_sim_frame_page[displaced - PTEDIT_SIM_TABLE_FRAMES] = source;
+    size_t* previous = ptedit_sim_leaf(source, 0);
+    if (previous && ptedit_get_pfn(*previous) == pfn) *previous = displaced ? ptedit_set_pfn(*previous, displaced) : 0;
+}
+
+// ---------------------------------------------------------------------------
+static void* ptedit_pmap_sim(size_t physical) {
+    size_t pfn = physical / ptedit_pfn_multiply;
+    if (pfn < PTEDIT_SIM_TABLE_FRAMES) return ptedit_sim_tables + physical;
+    if (pfn >= PTEDIT_SIM_TABLE_FRAMES + ptedit_sim_data_used) return NULL;
+    size_t page = ptedit_sim_frame_page[pfn - PTEDIT_SIM_TABLE_FRAMES];
+    return page ? (void*)(page + physical % ptedit_pfn_multiply) : NULL;
+}
+
+// ---------------------------------------------------------------------------
+ptedit_fnc int ptedit_init_simulation() {
+#if defined(LINUX) && defined(__x86_64__)
+    if (!ptedit_sim_tables) {
+        ptedit_sim_tables = (unsigned char*)mmap(NULL, PTEDIT_SIM_TABLE_FRAMES * 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        ptedit_sim_frame_page = (size_t*)mmap(NULL, PTEDIT_SIM_DATA_FRAMES * sizeof(size_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        ptedit_sim_slots = (ptedit_sim_slot_t*)mmap(NULL, PTEDIT_SIM_HASH_SLOTS * sizeof(ptedit_sim_slot_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        ptedit_sim_spare = mmap(NULL, getpagesize(), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptedit_sim_tables == MAP_FAILED || ptedit_sim_frame_page == MAP_FAILED || ptedit_sim_slots == MAP_FAILED || ptedit_sim_spare == MAP_FAILED) {
+            fprintf(stderr, PTEDIT_COLOR_RED "[-]" PTEDIT_COLOR_RESET "Error: Could not allocate the simulated page tables\n");
+            ptedit_sim_tables = NULL;
+            return -1;
+        }
+        // frame 0 is never handed out, frame 1 is the root
+        ptedit_sim_root = 1 * 4096;
+        ptedit_sim_tables_used = 2;
+    }
+    ptedit_fd = -1;
+    ptedit_umem = -1;
+    ptedit_pagesize = getpagesize();
+    ptedit_pfn_multiply = 4096;
+    ptedit_paging_definition.has_pgd = 1;
+    ptedit_paging_definition.has_p4d = 0;
+    ptedit_paging_definition.has_pud = 1;
+    ptedit_paging_definition.has_pmd = 1;
+    ptedit_paging_definition.has_pt = 1;
+    ptedit_paging_definition.pgd_entries = 9;
+    ptedit_paging_definition.p4d_entries = 0;
+    ptedit_paging_definition.pud_entries = 9;
+    ptedit_paging_definition.pmd_entries = 9;
+    ptedit_paging_definition.pt_entries = 9;
+    ptedit_paging_definition.page_offset = 12;
+    ptedit_use_implementation(PTEDIT_IMPL_SIMULATED);
+    return 0;
+#else
+    fprintf(stderr, PTEDIT_COLOR_RED "[-]" PTEDIT_COLOR_RESET "Error: Simulated page tables are only supported on x86-64 Linux\n");
+    return -1;
+#endif
+}
+
 // ---------------------------------------------------------------------------
 ptedit_fnc void* ptedit_pmap(size_t physical, size_t length) {
+    if (ptedit_simulated) return ptedit_pmap_sim(physical);
 #if defined(LINUX)
     char* m = (char*)mmap(0, length + (physical % ptedit_pagesize), PROT_READ | PROT_WRITE, MAP_SHARED, ptedit_umem, ((size_t)(physical / ptedit_pagesize)) * ptedit_pagesize);
     return m + (physical % ptedit_pagesize);
@@ -1478,6 +1875,8 @@ ptedit_fnc int ptedit_init() {
 
 // ---------------------------------------------------------------------------
 ptedit_fnc void ptedit_cleanup() {
+    ptedit_resolve_cache_invalidate(NULL, 0);
+    if (ptedit_simulated) return;
 #if defined(LINUX)
     if (ptedit_fd >= 0) {
         close(ptedit_fd);
@@ -1485,6 +1884,12 @@ ptedit_fnc void ptedit_cleanup() {
     if (ptedit_umem > 0) {
         close(ptedit_umem);
     }
+#if defined(PTEDIT_TLB_FLUSH_CEILING)
+    if (ptedit_tlb_flush_region) {
+        munmap(ptedit_tlb_flush_region, PTEDIT_TLB_FLUSH_PAGES * ptedit_pagesize);
+        ptedit_tlb_flush_region = NULL;
+    }
+#endif
 #else
     CloseHandle(ptedit_fd);
 #endif
@@ -1493,7 +1898,23 @@ ptedit_fnc void ptedit_cleanup() {
 
 // ---------------------------------------------------------------------------
 ptedit_fnc void ptedit_use_implementation(int implementation) {
-    if (implementation == PTEDIT_IMPL_KERNEL) {
+    ptedit_resolve_cache_invalidate(NULL, 0);
+    if (ptedit_simulated && implementation != PTEDIT_IMPL_SIMULATED) {
+        ptedit_simulated = 0;
+        ptedit_vmem = NULL;
+    }
+    if (implementation == PTEDIT_IMPL_SIMULATED) {
+        if (!ptedit_sim_tables) {
+            fprintf(stderr, PTEDIT_COLOR_RED "[-]" PTEDIT_COLOR_RESET " Error: call ptedit_init_simulation first\n");
+            return;
+        }
+        ptedit_simulated = 1;
+        ptedit_vmem = ptedit_sim_tables;
+        ptedit_paging_root = ptedit_sim_root;
+        ptedit_resolve = ptedit_resolve_sim;
+        ptedit_update = ptedit_update_sim;
+    }
+    else if (implementation == PTEDIT_IMPL_KERNEL) {
 #if defined(LINUX)
         ptedit_resolve = ptedit_resolve_kernel;
         ptedit_update = ptedit_update_kernel;
@@ -1527,6 +1948,7 @@ ptedit_fnc void ptedit_use_implementation(int implementation) {
 
 // ---------------------------------------------------------------------------
 ptedit_fnc int ptedit_get_pagesize() {
+    if (ptedit_simulated) return ptedit_pagesize;
 #if defined(LINUX)
     return (int)ioctl(ptedit_fd, PTEDITOR_IOCTL_CMD_GET_PAGESIZE, 0);
 #else
@@ -1589,6 +2011,7 @@ ptedit_fnc void ptedit_write_physical_page(size_t pfn, char* content) {
 
 // ---------------------------------------------------------------------------
 size_t ptedit_get_paging_root(pid_t pid) {
+    if (ptedit_simulated) return ptedit_sim_root;
 #if defined(LINUX)
     ptedit_paging_t cr3;
     cr3.pid = (size_t)pid;
@@ -1625,6 +2048,10 @@ void ptedit_set_paging_root(pid_t pid, size_t root) {
 
 // ---------------------------------------------------------------------------
 ptedit_fnc void ptedit_invalidate_tlb(void* address) {
+    if (ptedit_simulated) {
+        ptedit_invalidate_tlb_sim(address);
+        return;
+    }
 #if defined(LINUX)
     ioctl(ptedit_fd, PTEDITOR_IOCTL_CMD_INVALIDATE_TLB, (size_t)address);
 #else
@@ -1634,6 +2061,36 @@ ptedit_fnc void ptedit_invalidate_tlb(void* address) {
 #endif
 }
 
+// ---------------------------------------------------------------------------
+/*
+ * Flushes the TLB entries of the own process at once. PTEditor only invalidates
+ * single addresses, but the kernel flushes the whole address space instead of page
+ * by page when a protection change covers more pages than its ceiling: the spare
+ * ptedit_tlb_flush_region, populated with the zero page, is made inaccessible and
+ * readable again. Returns 0 on success, -1 if nothing was flushed (always for
+ * another process, whose address space the protection change does not touch).
+ */
+static int ptedit_invalidate_tlb_all(pid_t pid) {
+#if defined(LINUX) && defined(PTEDIT_TLB_FLUSH_CEILING)
+    if (pid != 0 && pid != getpid()) return -1;
+    size_t size = PTEDIT_TLB_FLUSH_PAGES * ptedit_pagesize;
+    if (!ptedit_tlb_flush_region) {
+        char* region = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) return -1;
+        // a huge zero page would be flushed as a few PMD entries, not as a range of pages
+        madvise(region, size, MADV_NOHUGEPAGE);
+        for (size_t offset = 0; offset < size; offset += ptedit_pagesize) {
+            (void)*(volatile char*)(region + offset);
+        }
+        ptedit_tlb_flush_region = region;
+    }
+    if (mprotect(ptedit_tlb_flush_region, size, PROT_NONE)) return -1;
+    return mprotect(ptedit_tlb_flush_region, size, PROT_READ);
+#else
+    return -1;
+#endif
+}
+
 // ---------------------------------------------------------------------------
 ptedit_fnc int ptedit_switch_tlb_invalidation(int implementation) {
 #if defined(LINUX)
@@ -1895,3 +2352,94 @@ ptedit_fnc void ptedit_pte_set_pfn(void* address, pid_t pid, size_t pfn) {
     vm.valid = PTEDIT_VALID_MASK_PTE;
     ptedit_update(address, pid, &vm);
 }
+
+// ---------------------------------------------------------------------------
+static size_t* ptedit_map_page_table(void* address, pid_t pid) {
+    ptedit_entry_t vm = ptedit_resolve(address, pid);
+    if (!(vm.valid & PTEDIT_VALID_MASK_PTE)) return NULL;
+    // simulated entries only exist once resolved, every address goes through ptedit_resolve
+    if (ptedit_simulated) return NULL;
+    size_t physical = (size_t)ptedit_cast(vm.pmd, ptedit_pmd_t).pfn * ptedit_pfn_multiply;
+    if (ptedit_vmem) return (size_t*)(ptedit_vmem + physical);
+#if defined(LINUX)
+    if (ptedit_umem <= 0) return NULL;
+    void* table = ptedit_pmap(physical, ptedit_pagesize);
+    return table == MAP_FAILED ? NULL : (size_t*)table;
+#else
+    return NULL;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+static void ptedit_unmap_page_table(size_t* table) {
+#if defined(LINUX)
+    if (table && !ptedit_vmem) munmap(table, ptedit_pagesize);
+#endif
+}
+
+// ---------------------------------------------------------------------------
+static inline size_t ptedit_page_table_of(void* address) {
+    return (size_t)address >> (ptedit_paging_definition.page_offset + ptedit_paging_definition.pt_entries);
+}
+
+// ---------------------------------------------------------------------------
+static inline size_t ptedit_page_table_index(void* address) {
+    return ((size_t)address >> ptedit_paging_definition.page_offset) % (1ull << ptedit_paging_definition.pt_entries);
+}
+
+// ---------------------------------------------------------------------------
+ptedit_fnc size_t ptedit_pte_get_batch(void** addresses, size_t count, pid_t pid, size_t* ptes) {
+    size_t read = 0;
+    size_t* table = NULL;
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || ptedit_page_table_of(addresses[i]) != ptedit_page_table_of(addresses[i - 1])) {
+            ptedit_unmap_page_table(table);
+            table = ptedit_map_page_table(addresses[i], pid);
+        }
+        if (table) {
+            ptes[i] = table[ptedit_page_table_index(addresses[i])];
+        } else {
+            ptedit_entry_t vm = ptedit_resolve(addresses[i], pid);
+            ptes[i] = (vm.valid & PTEDIT_VALID_MASK_PTE) ? vm.pte : 0;
+        }
+        read += ptes[i] != 0;
+    }
+    ptedit_unmap_page_table(table);
+    return read;
+}
+
+// ---------------------------------------------------------------------------
+ptedit_fnc size_t ptedit_remap_batch(ptedit_remap_t* remaps, size_t count, pid_t pid, size_t set_bits) {
+    size_t updated = 0;
+    size_t* table = NULL;
+    for (size_t i = 0; i < count; i++) {
+        void* address = remaps[i].address;
+        if (i == 0 || ptedit_page_table_of(address) != ptedit_page_table_of(remaps[i - 1].address)) {
+            ptedit_unmap_page_table(table);
+            table = ptedit_map_page_table(address, pid);
+        }
+        if (table) {
+            size_t* entry = table + ptedit_page_table_index(address);
+            *entry = ptedit_set_pfn(*entry, remaps[i].pfn) | set_bits;
+            updated++;
+            continue;
+        }
+        ptedit_entry_t vm = ptedit_resolve(address, pid);
+        if (!(vm.valid & PTEDIT_VALID_MASK_PTE)) continue;
+        vm.pte = ptedit_set_pfn(vm.pte, remaps[i].pfn) | set_bits;
+        vm.valid = PTEDIT_VALID_MASK_PTE;
+        ptedit_update(address, pid, &vm);
+        updated++;
+    }
+    ptedit_unmap_page_table(table);
+    // the simulated page tables swap frames on invalidation, they need every address
+#if defined(PTEDIT_TLB_FLUSH_CEILING)
+    if (!ptedit_simulated && count > PTEDIT_TLB_FLUSH_CEILING && ptedit_invalidate_tlb_all(pid) == 0) {
+        return updated;
+    }
+#endif
+    for (size_t i = 0; i < count; i++) {
+        ptedit_invalidate_tlb(remaps[i].address);
+    }
+    return updated;
+}
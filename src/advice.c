@@ -0,0 +1,92 @@
+#define _GNU_SOURCE // readahead, sync_file_range
+#include "api.h"
+
+/*
+Access hints. The writers' file mappings get access_policy (PSAR_ACCESS_POLICY)
+through madvise, and through posix_fadvise or readahead on the file range they
+map. The merge reads its inputs and writes its copy of the source once from
+start to end: what lies behind its cursor is dropped from the page cache, so
+that merging a large file does not evict the pages the writers use.
+*/
+
+static const char *access_policy_names[] = { "normal", "sequential", "random", "willneed", "hugepage" };
+
+const char *access_policy_name(AccessPolicy policy) {
+    return access_policy_names[policy];
+}
+
+/*
+Apply access_policy to region, the mapping of len bytes of fd at offset:
+  sequential, random: MADV_SEQUENTIAL or MADV_RANDOM, and the same readahead for
+    the file
+  willneed: MADV_WILLNEED, and the range read ahead into the page cache
+  hugepage: MADV_HUGEPAGE, which only file systems with large folios honour
+The hints are advisory, failures are logged and otherwise ignored.
+*/
+void advise_mapping(void *region, size_t len, int fd, off_t offset) {
+    int advice, file_advice = POSIX_FADV_NORMAL;
+    switch (psar_config.access_policy) {
+    case ACCESS_SEQUENTIAL:
+        advice = MADV_SEQUENTIAL;
+        file_advice = POSIX_FADV_SEQUENTIAL;
+        break;
+    case ACCESS_RANDOM:
+        advice = MADV_RANDOM;
+        file_advice = POSIX_FADV_RANDOM;
+        break;
+    case ACCESS_WILLNEED:
+        advice = MADV_WILLNEED;
+        break;
+    case ACCESS_HUGEPAGE:
+        advice = MADV_HUGEPAGE;
+        break;
+    default:
+        return;
+    }
+    if (madvise(region, len, advice) == -1) {
+        log_message(LOG_DEBUG, "madvise(%s) failed: %s", access_policy_name(psar_config.access_policy), strerror(errno));
+    }
+    if (psar_config.access_policy == ACCESS_WILLNEED) {
+        if (readahead(fd, offset, len) == -1) log_message(LOG_DEBUG, "readahead failed: %s", strerror(errno));
+    } else if (file_advice != POSIX_FADV_NORMAL) {
+        int error = posix_fadvise(fd, offset, len, file_advice);
+        if (error) log_message(LOG_DEBUG, "posix_fadvise failed: %s", strerror(error));
+    }
+}
+
+// Drop [offset, offset + len) of a file read once from the page cache
+void advise_read_done(int fd, off_t offset, off_t len) {
+    int error = posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+    if (error) log_message(LOG_DEBUG, "posix_fadvise failed: %s", strerror(error));
+}
+
+// Wait for the writeback of the range of behind and drop it from the page cache
+static void write_behind_drop(WriteBehind *behind) {
+    if (!behind->len) return;
+    if (sync_file_range(behind->fd, behind->offset, behind->len,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == -1) {
+        log_message(LOG_DEBUG, "sync_file_range failed: %s", strerror(errno));
+    }
+    advise_read_done(behind->fd, behind->offset, behind->len);
+    behind->len = 0;
+}
+
+/*
+[offset, offset + len) of behind->fd was just written: start its writeback, and
+drop the range written before it, whose writeback had the time of this write to
+complete. Dirty pages can not be dropped, so the writer waits one range behind
+instead of for every range.
+*/
+void write_behind(WriteBehind *behind, off_t offset, off_t len) {
+    if (sync_file_range(behind->fd, offset, len, SYNC_FILE_RANGE_WRITE) == -1) {
+        log_message(LOG_DEBUG, "sync_file_range failed: %s", strerror(errno));
+    }
+    write_behind_drop(behind);
+    behind->offset = offset;
+    behind->len = len;
+}
+
+// Drop the last range given to write_behind
+void write_behind_finish(WriteBehind *behind) {
+    write_behind_drop(behind);
+}
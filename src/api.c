@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // copy_file_range, SEEK_DATA
 #include "api.h"
 
 /*
@@ -5,9 +6,17 @@ This function will create NUMBER OF PROCESSES and each
 child process will attempt to write on a read only file
 */
 bool start_file_write_processes() {
-    configure_signal_handlers();
-    ptedit_init();
-    int pids[NUMBER_OF_PROCESSES];
+    if (!initialize_cow_engine()) {
+        if (!psar_config.dirty_tracking) return false;
+        // PTEditor only reads the dirty bits there, /proc/self/pagemap does without it
+        log_message(LOG_UPDATE, "Dirty tracking without PTEditor, using /proc/self/pagemap");
+    }
+    pid_t *pids = calloc(NUMBER_OF_PROCESSES, sizeof(pid_t));
+    if (!pids) {
+        log_message(LOG_ERROR, "Failed to allocate %d process ids", NUMBER_OF_PROCESSES);
+        cleanup_cow_engine();
+        return false;
+    }
     int num_started = 0;
     bool all_success = true;
     for(int i=0; i < NUMBER_OF_PROCESSES; i++) {
@@ -25,6 +34,7 @@ bool start_file_write_processes() {
             }
             exit(EXIT_SUCCESS);
         }else {
+            metrics_writer_started(pids[i]);
             num_started++;
         }
     }
@@ -33,11 +43,13 @@ bool start_file_write_processes() {
         for(int j = 0; j < num_started; j++) {
             kill(pids[j], SIGTERM);
             waitpid(pids[j], NULL, 0);
+            metrics_writer_stopped(pids[j]);
         }
     } else {
         int status;
-        for(int i=0; i < NUMBER_OF_PROCESSES; i++) {
+        for(int i=0; i < num_started; i++) {
             waitpid(pids[i], &status, 0);
+            metrics_writer_stopped(pids[i]);
             if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
                 log_message(LOG_ERROR, "Child process %d did not exit successfully", pids[i]);
                 all_success = false;
@@ -45,10 +57,146 @@ bool start_file_write_processes() {
         }
     }
 
-    ptedit_cleanup();
+    free(pids);
+    cleanup_cow_engine();
     return all_success;
 }
 
+static bool cow_engine_ready = false; // PTEditor acquired by initialize_cow_engine
+
+/*
+Privatized pages of this process, and private copies free for reuse. Both are
+allocated once by initialize_cow_engine since the signal handler cannot allocate.
+unmap_file_region gives the pages of a mapping their original PTE back and keeps
+their copies for the next privatizations, instead of leaking one anonymous page
+per privatized page for the lifetime of the process.
+*/
+static PrivatizedPage *privatized_pages = NULL;
+static size_t privatized_count = 0;
+static void **free_copies = NULL;
+static size_t free_copy_count = 0;
+
+static bool allocate_page_tracking() {
+    if (privatized_pages) return true;
+    privatized_pages = mmap(NULL, PRIVATIZED_PAGES_MAX * sizeof(PrivatizedPage), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    free_copies = mmap(NULL, FREE_COPIES_MAX * sizeof(void *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (privatized_pages == MAP_FAILED || free_copies == MAP_FAILED) {
+        log_message(LOG_ERROR, "mmap failed: %s", strerror(errno));
+        if (privatized_pages != MAP_FAILED) munmap(privatized_pages, PRIVATIZED_PAGES_MAX * sizeof(PrivatizedPage));
+        if (free_copies != MAP_FAILED) munmap(free_copies, FREE_COPIES_MAX * sizeof(void *));
+        privatized_pages = NULL;
+        free_copies = NULL;
+        return false;
+    }
+    return true;
+}
+
+// A free private copy, or a new anonymous page when none is left
+static void *take_copy_page() {
+    if (free_copy_count > 0) return free_copies[--free_copy_count];
+    void *page = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return page == MAP_FAILED ? NULL : page;
+}
+
+static void give_back_copy_page(void *copy) {
+    if (free_copy_count < FREE_COPIES_MAX) free_copies[free_copy_count++] = copy;
+    else munmap(copy, PAGE_SIZE);
+}
+
+// Past PRIVATIZED_PAGES_MAX the page stays privatized until the process exits
+static void track_privatized_page(void *page, void *copy, size_t original_pte) {
+    if (privatized_count == PRIVATIZED_PAGES_MAX) return;
+    privatized_pages[privatized_count++] = (PrivatizedPage){ page, copy, original_pte };
+}
+
+/*
+Point the privatized pages of [region, region + size) back to their original
+frame and keep their copies. The modifications must be logged already. A page
+whose PTE does not resolve any more is dropped from the table without touching
+its copy, and counted as skipped.
+*/
+static void release_privatized_pages(char *region, size_t size) {
+    size_t released = 0, skipped = 0;
+    for (size_t i = 0; i < privatized_count;) {
+        PrivatizedPage *privatized = &privatized_pages[i];
+        if ((char *)privatized->page < region || (char *)privatized->page >= region + size) {
+            i++;
+            continue;
+        }
+        ptedit_entry_t entry = ptedit_resolve(privatized->page, 0);
+        if (entry.valid & PTEDIT_VALID_MASK_PTE) {
+            entry.pte = privatized->original_pte;
+            entry.valid = PTEDIT_VALID_MASK_PTE;
+            ptedit_update(privatized->page, 0, &entry);
+            give_back_copy_page(privatized->copy);
+            released++;
+        } else {
+            skipped++;
+        }
+        *privatized = privatized_pages[--privatized_count];
+    }
+    if (released) metrics_add(METRIC_PAGES_RELEASED, released);
+    if (skipped) {
+        log_message(LOG_ERROR, "%zu privatized pages of %p kept their private copy, their PTE could not be resolved", skipped, (void *)region);
+        metrics_add(METRIC_PAGES_RELEASE_SKIPPED, skipped);
+    }
+}
+
+#if PSAR_STATS
+static void dump_fault_stats() {
+    stats_dump();
+}
+#endif
+
+// A forked writer walks its own page tables, not the cached ones of its parent
+static void cow_engine_after_fork() {
+    if (cow_engine_ready) ptedit_after_fork();
+}
+
+/*
+Install the SIGSEGV handler and acquire PTEditor, required before any process
+writes to a read only mapping
+*/
+bool initialize_cow_engine() {
+    if (!configure_signal_handlers()) {
+        return false;
+    }
+    // the signal handler logs without creating the ring or the writer thread itself
+    log_prepare();
+    // mapped before the writers fork so that they report into the same registry
+    metrics_init();
+    if (!allocate_page_tracking()) {
+        return false;
+    }
+    if (psar_config.simulate) {
+        if (ptedit_init_simulation() != 0) return false;
+        log_message(LOG_UPDATE, "Using simulated page tables");
+    } else if (ptedit_init() != 0) {
+        log_message(LOG_ERROR, "PTEditor is not available, is the pteditor module loaded? (--simulate runs without it)");
+        return false;
+    }
+    cow_engine_ready = true;
+    static bool fork_registered = false;
+    if (!fork_registered) {
+        pthread_atfork(NULL, NULL, cow_engine_after_fork);
+        fork_registered = true;
+    }
+#if PSAR_STATS
+    static bool stats_registered = false;
+    if (!stats_registered) {
+        // inherited by the forked writers, each dumps its own statistics when exiting
+        atexit(dump_fault_stats);
+        stats_registered = true;
+    }
+#endif
+    return true;
+}
+
+void cleanup_cow_engine() {
+    cow_engine_ready = false;
+    ptedit_cleanup();
+}
+
 bool ensure_directory_exists(const char* dir_path) {
     struct stat st = {0};
     if (stat(dir_path, &st) == -1) {
@@ -60,56 +208,407 @@ bool ensure_directory_exists(const char* dir_path) {
     return true;
 }
 
+/*
+True when [offset, offset + len) lies inside a region of region_size bytes,
+written so that no sum can overflow whatever the operands
+*/
+bool region_range_valid(off_t offset, size_t len, size_t region_size) {
+    return offset >= 0 && (uint64_t)offset <= region_size && len <= region_size - (uint64_t)offset;
+}
+
 /*
 This function will write to a log file the modification to the file. The write will occur on a 
 new write authorized mapped memory region.
 */
 bool log_and_write_memory_region(char *mapped_region, off_t offset, const char *data, size_t len, size_t region_size, char * file_name) {
-    if (offset + len > region_size) {
-        log_message(LOG_ERROR, "Write operation exceeds mapped region bounds.");
-        return false;
+    WriteEntry entry = { offset, data, len };
+    return log_and_write_memory_regions(mapped_region, &entry, 1, region_size, file_name);
+}
+
+static int compare_addresses(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void * const *)a, y = (uintptr_t)*(void * const *)b;
+    return (x > y) - (x < y);
+}
+
+// Add the walks of this process served by the PTEditor resolve cache since the last call to the metrics
+static void report_resolve_cache() {
+    static size_t reported_hits = 0, reported_misses = 0;
+    size_t hits, misses;
+    ptedit_resolve_cache_stats(&hits, &misses);
+    if (hits != reported_hits) metrics_add(METRIC_RESOLVE_CACHE_HITS, hits - reported_hits);
+    if (misses != reported_misses) metrics_add(METRIC_RESOLVE_CACHE_MISSES, misses - reported_misses);
+    reported_hits = hits;
+    reported_misses = misses;
+}
+
+/*
+Unmap a file mapping of the writers, once its modifications are logged. Its
+privatized pages get their original PTE back first, so that the kernel unmaps
+the frames it mapped there, and their copies are kept for reuse. The kernel may
+free the page tables of the range, so the upper levels cached by PTEditor for it
+are dropped too.
+*/
+void unmap_file_region(char *mapped_region, size_t region_size) {
+    if (cow_engine_ready) release_privatized_pages(mapped_region, region_size);
+    munmap(mapped_region, region_size);
+    ptedit_resolve_cache_invalidate(mapped_region, region_size);
+}
+
+// Copy the n pending pages, PTEs in ptes, to private copies and point their PTEs to the copies
+static size_t privatize_pending_pages(void **pending, size_t n, size_t *ptes, ptedit_remap_t *remaps) {
+    void **copy_pages = pending + n;
+    size_t *copy_ptes = ptes + n;
+    for (size_t i = 0; i < n; i++) {
+        copy_pages[i] = take_copy_page();
+        if (!copy_pages[i]) {
+            log_message(LOG_ERROR, "mmap failed: %s", strerror(errno));
+            while (i > 0) give_back_copy_page(copy_pages[--i]);
+            return 0;
+        }
+        memcpy(copy_pages[i], pending[i], PAGE_SIZE);
+#if LOG_DELTA_ENCODING
+        delta_snapshot_store(pending[i], copy_pages[i]);
+#endif
+    }
+    if (ptedit_pte_get_batch(copy_pages, n, 0, copy_ptes) != n) {
+        log_message(LOG_ERROR, "Cannot resolve the frames of %zu copied pages", n);
+        for (size_t i = 0; i < n; i++) give_back_copy_page(copy_pages[i]);
+        return 0;
     }
+    for (size_t i = 0; i < n; i++) {
+        remaps[i] = (ptedit_remap_t){ pending[i], ptedit_get_pfn(copy_ptes[i]) };
+        track_privatized_page(pending[i], copy_pages[i], ptes[i]);
+    }
+    return ptedit_remap_batch(remaps, n, 0, 1ull << PTEDIT_PAGE_BIT_RW);
+}
 
-    char log_dir_path[256];
-    snprintf(log_dir_path, sizeof(log_dir_path), "logs/logs_%d", getpid());
+/*
+Privatize at once the pages (sorted, of read only mappings) that no fault has
+privatized yet: the originals are copied into one anonymous mapping and
+ptedit_remap_batch points all of their PTEs to the copies, instead of one
+SIGSEGV with its own resolve, update and TLB invalidation per page. Returns the
+number of pages privatized, the others are left to the fault handler.
+*/
+size_t privatize_pages(void **pages, size_t count) {
+    if (!cow_engine_ready || count < PRIVATIZE_BATCH_MIN) {
+        return 0;
+    }
+    size_t *ptes = malloc(2 * count * sizeof(size_t)); // the PTEs of the pages, then of their copies
+    void **pending = malloc(2 * count * sizeof(void *)); // the pages, then their copies
+    ptedit_remap_t *remaps = malloc(count * sizeof(ptedit_remap_t));
+    size_t privatized = 0;
+    if (ptes && pending && remaps) {
+        // privatized pages already point to a writable frame
+        ptedit_pte_get_batch(pages, count, 0, ptes);
+        size_t n = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (!(ptes[i] & (1ull << PTEDIT_PAGE_BIT_RW))) {
+                pending[n] = pages[i];
+                ptes[n++] = ptes[i];
+            }
+        }
+        if (n >= PRIVATIZE_BATCH_MIN) {
+            privatized = privatize_pending_pages(pending, n, ptes, remaps);
+            metrics_add(METRIC_PAGES_PRIVATIZED, privatized);
+            log_message(LOG_UPDATE, "Process %d privatized %zu pages at once", getpid(), privatized);
+        }
+    }
+    free(ptes);
+    free(pending);
+    free(remaps);
+    report_resolve_cache();
+    return privatized;
+}
 
-    
-    if (!ensure_directory_exists(log_dir_path)) {
+/*
+Set the bits of bitmap for the pages of [region, region + pages) whose PTE has
+the dirty bit, and clear it in those PTEs so that the next call only sees later
+writes. Returns false when PTEditor is not in use (the simulated page tables do
+not see writes), the caller then falls back to /proc/self/pagemap.
+*/
+bool collect_dirty_ptes(char *region, size_t pages, uint64_t *bitmap, size_t *dirty) {
+    if (!cow_engine_ready || ptedit_simulated) {
+        return false;
+    }
+    void **addresses = malloc(pages * sizeof(void *));
+    size_t *ptes = malloc(pages * sizeof(size_t));
+    if (!addresses || !ptes) {
+        free(addresses);
+        free(ptes);
         return false;
     }
+    for (size_t page = 0; page < pages; page++) {
+        addresses[page] = region + page * PAGE_SIZE;
+    }
+    ptedit_pte_get_batch(addresses, pages, 0, ptes);
+    *dirty = 0;
+    for (size_t page = 0; page < pages; page++) {
+        if (!(ptes[page] & (1ull << PTEDIT_PAGE_BIT_DIRTY))) continue;
+        // cleared before the page is logged, a write racing with the log sets it again
+        ptedit_pte_clear_bit(addresses[page], 0, PTEDIT_PAGE_BIT_DIRTY);
+        bitmap[page / 64] |= 1ull << (page % 64);
+        (*dirty)++;
+    }
+    free(addresses);
+    free(ptes);
+    report_resolve_cache();
+    return true;
+}
 
-    const char* original_file_name = strrchr(file_name, '/');
-    if (!original_file_name) original_file_name = file_name;
-    else original_file_name++;
+// Privatize the pages the entries are about to write to, see privatize_pages
+static void privatize_written_pages(char *mapped_region, const WriteEntry *entries, size_t count) {
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].len) total += (entries[i].offset + entries[i].len - 1) / PAGE_SIZE - entries[i].offset / PAGE_SIZE + 1;
+    }
+    if (total < PRIVATIZE_BATCH_MIN) return;
+    void **pages = malloc(total * sizeof(void *));
+    if (!pages) return;
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!entries[i].len) continue;
+        for (size_t page = entries[i].offset / PAGE_SIZE; page <= (entries[i].offset + entries[i].len - 1) / PAGE_SIZE; page++) {
+            pages[n++] = mapped_region + page * PAGE_SIZE;
+        }
+    }
+    qsort(pages, n, sizeof(void *), compare_addresses);
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (unique == 0 || pages[i] != pages[unique - 1]) pages[unique++] = pages[i];
+    }
+    privatize_pages(pages, unique);
+    free(pages);
+}
 
+// Entries eligible for zero copy logging
+static bool covers_whole_pages(const WriteEntry *entry) {
+    return entry->len && entry->offset % PAGE_SIZE == 0 && entry->len % PAGE_SIZE == 0;
+}
 
-    time_t now = time(NULL);
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", localtime(&now));
-    char log_file_path[512];
-    snprintf(log_file_path, sizeof(log_file_path), "%s/log_%s_%s.log", log_dir_path, original_file_name, timestamp);
-    int log_fd = open(log_file_path, O_WRONLY | O_CREAT | O_APPEND, 0666);
-    if (log_fd == -1) {
-        log_message(LOG_ERROR, "Failed to open log file: %s", strerror(errno));
+/*
+Append records (a header iovec followed by a payload iovec each, record_bytes in
+total) to the current log segment of file_name, LOG_BATCH_IOVECS iovecs per pwritev.
+A short pwritev continues where it stopped, the iovecs are advanced in place. On
+failure the segment is truncated back to its size at entry, so that no record
+follows a torn one.
+*/
+bool append_log_records(const char *file_name, struct iovec *record, size_t records, size_t record_bytes) {
+    ssize_t written = 0;
+    LogSegment *segment = log_segment_for_file(file_name, record_bytes);
+    if (!segment) {
+        written = -1;
+    }
+    off_t start = segment ? segment->size : 0;
+    for (size_t done = 0; segment && done < 2 * records;) {
+        int chunk = 2 * records - done > LOG_BATCH_IOVECS ? LOG_BATCH_IOVECS : (int)(2 * records - done);
+        ssize_t bytes = pwritev(segment->fd, record + done, chunk, segment->size);
+        if (bytes == -1 && errno == EINTR) continue;
+        if (bytes <= 0) {
+            written = -1;
+            break;
+        }
+        segment->size += bytes;
+        written += bytes;
+        // skip the iovecs written, a partly written one is continued
+        for (; done < 2 * records && (size_t)bytes >= record[done].iov_len; done++) {
+            bytes -= record[done].iov_len;
+        }
+        if (bytes > 0) {
+            record[done].iov_base = (char *)record[done].iov_base + bytes;
+            record[done].iov_len -= bytes;
+        }
+    }
+    if (written != (ssize_t)record_bytes) {
+        log_message(LOG_ERROR, "Failed to write log record: %s", written == -1 ? strerror(errno) : "short write");
+        if (segment && segment->size != start) {
+            if (ftruncate(segment->fd, start) == -1) {
+                log_message(LOG_ERROR, "Failed to truncate the torn log record: %s", strerror(errno));
+            }
+            segment->size = start;
+        }
         return false;
     }
+    metrics_add(METRIC_LOG_RECORDS_WRITTEN, records);
+    metrics_add(METRIC_LOG_BYTES_WRITTEN, written);
+    return true;
+}
 
-    dprintf(log_fd, "Offset: %ld, Length: %zu, Data: ", (long)offset, len);
-    write(log_fd, data, len);
-    write(log_fd, "\n", 1);
+/*
+Batch version of log_and_write_memory_region for count modifications of the same
+mapped region: bounds are checked for every entry before anything is written, the
+records are appended to the log with a single pwritev (per LOG_BATCH_IOVECS iovecs), then
+all the stores are applied in entry order. With PSAR_ZERO_COPY set, entries covering
+whole pages are not part of the batch records: they are stored once the other records
+are logged, and logged from the mapping by zero_copy_flush.
+*/
+bool log_and_write_memory_regions(char *mapped_region, const WriteEntry *entries, size_t count, size_t region_size, char * file_name) {
+    return log_and_write_window(mapped_region, 0, entries, count, region_size, file_name);
+}
 
-    close(log_fd);
+/*
+log_and_write_memory_regions for a mapping of region_size bytes found at
+region_offset of the file, e.g. a window of windowed_write. The entry offsets are
+relative to the mapping, the records get file offsets.
+*/
+bool log_and_write_window(char *mapped_region, off_t region_offset, const WriteEntry *entries, size_t count, size_t region_size, char * file_name) {
+    size_t total_len = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!region_range_valid(entries[i].offset, entries[i].len, region_size)) {
+            log_message(LOG_ERROR, "Write operation exceeds mapped region bounds.");
+            return false;
+        }
+        if (entries[i].len <= LOG_DELTA_MAX_LEN) total_len += entries[i].len;
+    }
+    if (count == 0) {
+        return true;
+    }
+    bool zero_copy = zero_copy_enabled();
+    for (size_t i = 0; zero_copy && i < count; i++) {
+        if (covers_whole_pages(&entries[i]) && !zero_copy_prepare(mapped_region, region_offset, region_size, file_name)) return false;
+    }
+    if (cow_engine_ready) {
+        privatize_written_pages(mapped_region, entries, count);
+    }
+    LogRecordHeader *headers = malloc(count * sizeof(LogRecordHeader));
+    struct iovec *record = malloc(2 * count * sizeof(struct iovec));
+    char *scratch = NULL;
+#if LOG_DELTA_ENCODING
+    // originals followed by the encoded deltas, keep a delta only when it is smaller than the data itself
+    if (total_len) scratch = malloc(2 * total_len);
+#endif
+    if (!headers || !record) {
+        log_message(LOG_ERROR, "Failed to allocate %zu log records", count);
+        free(headers);
+        free(record);
+        free(scratch);
+        return false;
+    }
+    uint64_t timestamp = log_record_clock();
+    size_t record_bytes = 0;
+    size_t scratch_used = 0;
+    size_t records = 0;
+    for (size_t i = 0; i < count; i++) {
+        const WriteEntry *entry = &entries[i];
+        if (zero_copy && covers_whole_pages(entry)) continue; // logged by zero_copy_flush
+        LogRecordHeader header = { LOG_RECORD_MAGIC, LOG_ENCODING_RAW, (uint64_t)(region_offset + entry->offset), entry->len, entry->len, timestamp, 0, 0 };
+        const char *payload = entry->data;
+#if LOG_DELTA_ENCODING
+        char *original = scratch + scratch_used;
+        if (scratch && entry->len <= LOG_DELTA_MAX_LEN && delta_load_original(mapped_region, entry->offset, entry->len, original)) {
+            size_t encoded = delta_encode(original, entry->data, entry->len, scratch + total_len + scratch_used);
+            if (encoded) {
+                header.encoding = LOG_ENCODING_DELTA;
+                header.payload_size = encoded;
+                payload = scratch + total_len + scratch_used;
+            }
+        }
+        if (entry->len <= LOG_DELTA_MAX_LEN) scratch_used += entry->len;
+#endif
+        log_record_seal(&header, payload);
+        headers[records] = header;
+        record[2 * records] = (struct iovec){ &headers[records], sizeof(LogRecordHeader) };
+        record[2 * records + 1] = (struct iovec){ (void *)payload, header.payload_size };
+        records++;
+        record_bytes += sizeof(LogRecordHeader) + header.payload_size;
+    }
 
-    memcpy(mapped_region + offset, data, len);
+    bool appended = records == 0 || append_log_records(file_name, record, records, record_bytes);
+    free(headers);
+    free(record);
+    free(scratch);
+    if (!appended) {
+        return false;
+    }
+
+    // nothing is stored before the records are logged, then every store in order
+    for (size_t i = 0; i < count; i++) {
+        if (zero_copy && covers_whole_pages(&entries[i])) {
+            zero_copy_write(mapped_region, region_offset, entries[i].offset, entries[i].data, entries[i].len, region_size, file_name);
+        } else {
+            memcpy(mapped_region + entries[i].offset, entries[i].data, entries[i].len);
+        }
+    }
     // log_message(LOG_UPDATE, "Process %d logged %s", getpid(), log_file_path);
     return true;
 }
 
+/*
+Copy len bytes at from of from_fd to to of to_fd, inside the kernel with
+copy_file_range when the file systems allow it
+*/
+static bool copy_file_bytes(int from_fd, off_t from, int to_fd, off_t to, uint64_t len) {
+    while (len > 0) {
+        ssize_t bytes = copy_file_range(from_fd, &from, to_fd, &to, len, 0);
+        if (bytes <= 0) break;
+        len -= bytes;
+    }
+    char *buffer = len > 0 ? malloc(LOG_READER_BUFFER_SIZE) : NULL;
+    if (len > 0 && !buffer) return false;
+    while (len > 0) {
+        size_t chunk = len < LOG_READER_BUFFER_SIZE ? len : LOG_READER_BUFFER_SIZE;
+        ssize_t bytes = pread(from_fd, buffer, chunk, from);
+        if (bytes <= 0 || pwrite(to_fd, buffer, bytes, to) != bytes) break;
+        from += bytes;
+        to += bytes;
+        len -= bytes;
+    }
+    free(buffer);
+    return len == 0;
+}
+
+/*
+Copy [from, end) of the source to the same offsets of the merge output by
+MERGE_DROP_CHUNK bytes, dropping every chunk of both files from the page cache
+once copied
+*/
+static bool copy_source_range(int source_fd, WriteBehind *behind, off_t from, off_t end) {
+    while (from < end) {
+        off_t len = end - from < MERGE_DROP_CHUNK ? end - from : MERGE_DROP_CHUNK;
+        if (!copy_file_bytes(source_fd, from, behind->fd, from, len)) return false;
+        advise_read_done(source_fd, from, len);
+        write_behind(behind, from, len);
+        from += len;
+    }
+    return true;
+}
+
+/*
+Copy the source file to the merge output. Only the data is copied, the holes of
+a sparse source stay holes.
+*/
+static bool copy_source_file(int source_fd, int to_fd) {
+    struct stat st;
+    if (fstat(source_fd, &st) == -1 || ftruncate(to_fd, st.st_size) == -1) return false;
+    int error = posix_fadvise(source_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (error) log_message(LOG_DEBUG, "posix_fadvise failed: %s", strerror(error));
+    WriteBehind behind = { to_fd, 0, 0 };
+    bool copied = true;
+    off_t data = lseek(source_fd, 0, SEEK_DATA);
+    if (data == -1 && errno != ENXIO) {
+        copied = copy_source_range(source_fd, &behind, 0, st.st_size);
+        data = -1;
+    }
+    while (copied && data != -1 && data < st.st_size) {
+        off_t hole = lseek(source_fd, data, SEEK_HOLE);
+        if (hole == -1) hole = st.st_size;
+        copied = copy_source_range(source_fd, &behind, data, hole);
+        data = lseek(source_fd, hole, SEEK_DATA);
+    }
+    write_behind_finish(&behind);
+    return copied;
+}
+
 /*
 Function will copy original file contents, and write a new updated 
 version else where based off the log information
 */
 bool merge(const char* original_file_path, const char* log_file_path) {
+    uint64_t start = stats_clock();
+    bool recovered = recover_log(log_file_path);
+    if (!recovered) {
+        log_message(LOG_ERROR, "Log %s is corrupted beyond its tail, merge incomplete", log_file_path);
+    }
+
     int original_fd = open(original_file_path, O_RDONLY);
     if (original_fd == -1) {
         log_message(LOG_ERROR, "Failed to open original file: %s", strerror(errno));
@@ -144,48 +643,118 @@ bool merge(const char* original_file_path, const char* log_file_path) {
         return false;
     }
 
-    char buffer[1024];
-    ssize_t bytes_read;
-    while ((bytes_read = read(original_fd, buffer, sizeof(buffer))) > 0) {
-        if (write(merged_fd, buffer, bytes_read) != bytes_read) {
-            log_message(LOG_ERROR, "Failed to write all bytes to merged file");
-            close(original_fd);
-            close(log_fd);
-            close(merged_fd);
-            return false;
-        }
+    if (!copy_source_file(original_fd, merged_fd)) {
+        log_message(LOG_ERROR, "Failed to write all bytes to merged file");
+        close(original_fd);
+        close(log_fd);
+        close(merged_fd);
+        return false;
     }
 
-    apply_merge(merged_fd, log_fd);
+    bool applied = apply_merge(merged_fd, log_fd, original_fd, NULL);
 
     close(original_fd);
     close(log_fd);
     close(merged_fd);
+    metrics_observe(METRIC_MERGE_DURATION, stats_clock() - start);
     log_message(LOG_UPDATE, "merge created for file %s", original_file_name);
-    return true;
+    return recovered && applied;
 }
 
-void apply_merge(int to_fd, int from_fd) {
-    char log_line[1024];
-    ssize_t read_size;
-    lseek(from_fd, 0, SEEK_SET);
-    while ((read_size = read(from_fd, log_line, sizeof(log_line) - 1)) > 0) {
-        log_line[read_size] = '\0';
-        char* ptr = log_line;
-        while (ptr < log_line + read_size) {
-            char* end_ptr = strchr(ptr, '\n');
-            if (!end_ptr) break;
-            *end_ptr = '\0';
-            off_t offset;
-            size_t len;
-            char data[512];
-            if (sscanf(ptr, "Offset: %ld, Length: %zu, Data: %[^\n]", &offset, &len, data) == 3) {
-                lseek(to_fd, offset, SEEK_SET);
-                write(to_fd, data, strlen(data));
-            }
-            ptr = end_ptr + 1;
+/*
+Read exactly len bytes unless end of file comes first, returns the number of bytes read
+*/
+ssize_t read_fully(int fd, void *buffer, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t bytes = read(fd, (char *)buffer + done, len - done);
+        if (bytes == -1 && errno == EINTR) continue;
+        if (bytes <= 0) return bytes == -1 ? -1 : (ssize_t)done;
+        done += bytes;
+    }
+    return done;
+}
+
+/*
+Write one record on to_fd. Delta records are rebuilt against the unmodified
+source file source_fd. Records the reader left in the log (payload NULL) are
+copied from it a piece at a time.
+*/
+static bool apply_record(int to_fd, int source_fd, LogReader *reader, const LogRecordHeader *header, const char *payload) {
+    if (header->offset > INT64_MAX || header->length > INT64_MAX - header->offset) return false;
+    if (header->encoding == LOG_ENCODING_RAW) {
+        if (header->payload_size != header->length) return false;
+        if (!payload) return copy_file_bytes(reader->fd, reader->payload_position, to_fd, header->offset, header->length);
+        return pwrite(to_fd, payload, header->length, header->offset) == (ssize_t)header->length;
+    }
+    char *loaded = NULL;
+    if (!payload) {
+        // deltas only encode writes of up to LOG_DELTA_MAX_LEN bytes, the payload fits in memory
+        loaded = malloc(header->payload_size);
+        if (!loaded || log_reader_payload(reader, 0, loaded, header->payload_size) != (ssize_t)header->payload_size) {
+            free(loaded);
+            return false;
+        }
+        payload = loaded;
+    }
+    char *data = calloc(1, header->length);
+    bool applied = data && pread(source_fd, data, header->length, header->offset) != -1 &&
+                   delta_apply(data, header->length, payload, header->payload_size) &&
+                   pwrite(to_fd, data, header->length, header->offset) == (ssize_t)header->length;
+    free(data);
+    free(loaded);
+    return applied;
+}
+
+/*
+Count a conflict when a record writes a page that a previous log already wrote,
+then mark its pages as written by the current log
+*/
+static void track_merge_conflicts(MergeConflicts *conflicts, const LogRecordHeader *header) {
+    if (header->length == 0) return;
+    size_t first = header->offset / PAGE_SIZE;
+    size_t last = (header->offset + header->length - 1) / PAGE_SIZE;
+    bool conflict = false;
+    for (size_t page = first; page <= last && page < conflicts->pages; page++) {
+        uint32_t writer = conflicts->page_writer[page];
+        if (writer && writer != conflicts->writer) conflict = true;
+        conflicts->page_writer[page] = conflicts->writer;
+    }
+    if (conflict) conflicts->conflicts++;
+}
+
+/*
+Replay every record of the log from_fd on to_fd. Records are checked against their
+checksums and the merge stops at the first bad one, or at the first one that cannot
+be written on to_fd. Conflicting writes are counted in conflicts unless it is NULL.
+*/
+bool apply_merge(int to_fd, int from_fd, int source_fd, MergeConflicts *conflicts) {
+    LogReader reader;
+    if (!log_reader_open(&reader, from_fd)) {
+        log_message(LOG_ERROR, "Invalid log segment header, merge skipped");
+        log_reader_close(&reader);
+        return false;
+    }
+    LogRecordHeader header;
+    const char *payload;
+    LogReadStatus status;
+    bool applied = true;
+    while ((status = log_reader_next(&reader, &header, &payload)) == LOG_READ_OK) {
+        if (!apply_record(to_fd, source_fd, &reader, &header, payload)) {
+            log_message(LOG_ERROR, "Failed to apply log record at byte %lld, merge stopped", (long long)reader.position);
+            applied = false;
+            break;
+        }
+        metrics_add(METRIC_RECORDS_MERGED, 1);
+        if (conflicts) {
+            track_merge_conflicts(conflicts, &header);
         }
     }
+    if (applied && status != LOG_READ_END) {
+        log_message(LOG_ERROR, "Bad log record at byte %lld (%s), merge stopped", (long long)reader.position, log_read_status_string(status));
+    }
+    log_reader_close(&reader);
+    return applied && status == LOG_READ_END;
 }
 
 /*
@@ -211,12 +780,75 @@ bool is_log_file(const char *filename, const char *target) {
 
     return false;
 }
+/*
+Call visit with the path of every log file of every process inside logs whose
+source file name starts with target, the segments of a process in sequence order.
+Stops early when visit returns false.
+*/
+bool for_each_log_file(const char *target, LogFileVisitor visit, void *context) {
+    DIR * d = opendir(LOG_FOLDER);
+    if (!d) return true;
+
+    bool keep_going = true;
+    struct dirent *dir;
+    while(keep_going && (dir = readdir(d)) != NULL) {
+        if(dir->d_type == DT_DIR && strcmp(dir->d_name, ".") != 0 && strcmp(dir->d_name, "..")!=0) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", LOG_FOLDER, dir->d_name);
+            // segments are named after their sequence number, sorted they come in the order they were written
+            struct dirent **entries;
+            int count = scandir(path, &entries, NULL, alphasort);
+            if(count == -1) continue;
+            for(int i = 0; i < count; i++) {
+                if(keep_going && is_log_file(entries[i]->d_name, target)) {
+                    char log_path[1024];
+                    snprintf(log_path, sizeof(log_path), "%s/%s/%s", LOG_FOLDER, dir->d_name, entries[i]->d_name);
+                    keep_going = visit(log_path, context);
+                }
+                free(entries[i]);
+            }
+            free(entries);
+        }
+    }
+    closedir(d);
+    return keep_going;
+}
+
+typedef struct {
+    int merged_fd;
+    int source_fd;
+    MergeConflicts conflicts;
+    bool failed; // a log could not be recovered or applied entirely
+} MergeAllContext;
+
+// The other logs are still merged after a failing one, merge_all reports the failure
+static bool merge_all_visitor(const char *log_path, void *context) {
+    MergeAllContext *merge_context = context;
+    if (!recover_log(log_path)) {
+        log_message(LOG_ERROR, "Log %s is corrupted beyond its tail", log_path);
+        merge_context->failed = true;
+    }
+    int log_fd = open(log_path, O_RDONLY);
+    if (log_fd == -1) {
+        perror("Failed to open log file");
+        return false;
+    }
+    merge_context->conflicts.writer++;
+    if (!apply_merge(merge_context->merged_fd, log_fd, merge_context->source_fd, &merge_context->conflicts)) {
+        log_message(LOG_ERROR, "Log %s was not merged entirely", log_path);
+        merge_context->failed = true;
+    }
+    close(log_fd);
+    return true;
+}
+
 /*
 Function loop over every log folder inside logs and apply merge
 for all log files corresponding to that source file
 - incremental file updating
 */
 bool merge_all(char * source_file_path) {
+    uint64_t start = stats_clock();
     int source_file_fd = open(source_file_path, O_RDONLY);
     if (source_file_fd == -1) {
         perror("Failed to open original file");
@@ -236,44 +868,48 @@ bool merge_all(char * source_file_path) {
         return false;
     }
 
-    char buffer[1024];
-    ssize_t bytes_read;
-    while ((bytes_read = read(source_file_fd, buffer, sizeof(buffer))) > 0) {
-        write(merged_all_fd, buffer, bytes_read);
+    if (!copy_source_file(source_file_fd, merged_all_fd)) {
+        log_message(LOG_ERROR, "Failed to write all bytes to merged file");
+        close(source_file_fd);
+        close(merged_all_fd);
+        return false;
     }
 
-    char log_path[1024];
-    DIR * d;
-    struct dirent *dir;
-    d = opendir("logs");
-    if(d) {
-        while((dir = readdir(d)) != NULL) {
-            if(dir->d_type == DT_DIR && strcmp(dir->d_name, ".") != 0 && strcmp(dir->d_name, "..")!=0) {
-                char path[1024];
-                snprintf(path, sizeof(path), "logs/%s", dir->d_name);
-                DIR * subdir = opendir(path);
-                if(subdir) {
-                    struct dirent * subDirEntry;
-                    while((subDirEntry = readdir(subdir)) !=  NULL) {
-                        if(is_log_file(subDirEntry->d_name, original_file_name)) {
-                            snprintf(log_path, sizeof(log_path), "logs/%s/%s", dir->d_name, subDirEntry->d_name);
-                            int log_fd = open(log_path, O_RDONLY);
-                            if (log_fd == -1) {
-                                perror("Failed to open log file");
-                                return false;
-                            }
-                            apply_merge(merged_all_fd, log_fd);
-                            close(log_fd);
-                        }
-                    }
-                }
-                closedir(subdir);
-            }
-        }
+    struct stat st;
+    MergeAllContext context = { merged_all_fd, source_file_fd, { NULL, 0, 0, 0 }, false };
+    if (fstat(source_file_fd, &st) == 0) {
+        context.conflicts.pages = (st.st_size + PAGE_SIZE - 1) / PAGE_SIZE;
+        context.conflicts.page_writer = calloc(context.conflicts.pages, sizeof(uint32_t));
+        if (!context.conflicts.page_writer) context.conflicts.pages = 0;
     }
-    closedir(d);
+    bool merged = for_each_log_file(original_file_name, merge_all_visitor, &context);
+    close(source_file_fd);
+    close(merged_all_fd);
+    free(context.conflicts.page_writer);
+    metrics_add(METRIC_MERGE_CONFLICTS, context.conflicts.conflicts);
+    metrics_observe(METRIC_MERGE_DURATION, stats_clock() - start);
     log_message(LOG_UPDATE, "merge_all created for file %s", source_file_path);
-    return true;
+    return merged && !context.failed;
+}
+
+/*
+Dirty tracking counterpart of the modification below: a plain store into a
+private mapping, logged by the checkpoint that finds the page written
+*/
+static bool perform_tracked_modification(const char *file_name) {
+    DirtyRegion region;
+    if (!dirty_region_open(&region, file_name)) {
+        return false;
+    }
+    bool success = WRITE_OFFSET + strlen(WRITE_DEMO) <= region.size;
+    if (success) {
+        memcpy(region.region + WRITE_OFFSET, WRITE_DEMO, strlen(WRITE_DEMO));
+        success = dirty_region_checkpoint(&region);
+    } else {
+        log_message(LOG_ERROR, "Write operation exceeds mapped region bounds.");
+    }
+    dirty_region_close(&region);
+    return success;
 }
 
 /*
@@ -284,49 +920,59 @@ after mapping the file to read only memory.
 */
 bool perform_file_modifications() {
     log_message(LOG_UPDATE, "Process %d started reading and write routine", getpid());
-    int fd[NUMBER_OF_FILES];
     char file_name[FILE_NAME_SIZE];
     int i = 0;
     for(; i < NUMBER_OF_FILES; i++) {
-        snprintf(file_name, FILE_NAME_SIZE, "files/file%d", i);
-        fd[i] = open(file_name, O_RDONLY);
+        snprintf(file_name, FILE_NAME_SIZE, "%s/file%d", TEST_FILE_FOLDER, i);
+        if (psar_config.dirty_tracking) {
+            if (!perform_tracked_modification(file_name)) return false;
+            continue;
+        }
+        if (psar_config.window_size) {
+            if (!windowed_write(file_name, WRITE_OFFSET, WRITE_DEMO, strlen(WRITE_DEMO))) return false;
+            continue;
+        }
+        int fd = open(file_name, O_RDONLY);
         
-        if(fd[i] == -1) {
+        if(fd == -1) {
             log_message(LOG_ERROR, "file descriptor failed: %s", strerror(errno));
             return false;
         }
 
         struct stat st;
-        if(fstat(fd[i], &st) == -1) {
+        if(fstat(fd, &st) == -1) {
             log_message(LOG_ERROR, "fstat failed: %s", strerror(errno));
-            close(fd[i]);
+            close(fd);
             return false;
         }
-        char * mapped_region = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd[i], 0);
+        char * mapped_region = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
         if(mapped_region == MAP_FAILED) {
             log_message(LOG_ERROR, "mmap failed: %s", strerror(errno));
-            close(fd[i]);
+            close(fd);
             return false;
         }
+        advise_mapping(mapped_region, st.st_size, fd, 0);
         // log_message(LOG_DEBUG, "File size: %zu, Write offset: %d, Data length: %zu", st.st_size, WRITE_OFFSET, strlen(WRITE_DEMO));
         log_and_write_memory_region(mapped_region, WRITE_OFFSET, WRITE_DEMO, strlen(WRITE_DEMO), st.st_size, file_name);
-        munmap(mapped_region, st.st_size);
-        close(fd[i]);
+        zero_copy_flush(mapped_region);
+        delta_snapshot_release(mapped_region, st.st_size);
+        unmap_file_region(mapped_region, st.st_size);
+        close(fd);
     }
+    windows_release();
     log_message(LOG_UPDATE, "Process %d modified %d files", getpid(), i);
     return true;
 }
 
-void initialize_project_environment() {
+void initialize_project_environment(int threads) {
     /*This function will set up the project folder so that we can test the tool pteditor*/
     create_required_directories();
-    create_initial_project_files();
-    write_initial_data_to_files();
+    create_test_files(threads);
     configure_signal_handlers();
 }
 
 void create_required_directories() {
-    const char* directories[] = {"logs", "merge", "files"};
+    const char* directories[] = {LOG_FOLDER, "merge", TEST_FILE_FOLDER, STATS_FOLDER};
     size_t num_directories = sizeof(directories) / sizeof(directories[0]);
     for (size_t i = 0; i < num_directories; ++i) {
         struct stat st = {0};
@@ -339,44 +985,6 @@ void create_required_directories() {
     log_message(LOG_UPDATE, "Folders log, merge and files created");
 }
 
-bool create_initial_project_files() {
-    char file_name[FILE_NAME_SIZE];
-    int fd;
-    int i = 0;
-    for(; i < NUMBER_OF_FILES; i++) {
-        snprintf(file_name, FILE_NAME_SIZE, "files/file%d", i);
-        fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, FILE_PERMISSIONS);
-        if(fd == -1) {
-            log_message(LOG_ERROR, "open failed: %s", strerror(errno));
-            return false;
-        }
-        close(fd);
-    }
-    log_message(LOG_UPDATE, "%d files were created", i);
-    return true;
-}
-
-bool write_initial_data_to_files() {
-    char file_name[FILE_NAME_SIZE];
-    int fd;
-    for(int i=0; i < NUMBER_OF_FILES; i++) {
-        snprintf(file_name, FILE_NAME_SIZE, "files/file%d", i);
-        fd = open(file_name, O_WRONLY, FILE_PERMISSIONS);
-        if(fd == -1) {
-            log_message(LOG_ERROR, "open failed: %s", strerror(errno));
-            return false;
-        }
-        ssize_t bytes = write(fd, DATA_DEMO, strlen(DATA_DEMO));        
-        if(bytes == -1) {
-            log_message(LOG_ERROR, "write failed: %s", strerror(errno));
-            return false;
-        }
-        close(fd);
-    }
-    log_message(LOG_UPDATE, "Data written to test files");
-    return true;
-}
-
 // void log_virtual_to_physical(void* address) {
 //     ptedit_entry_t entry = ptedit_resolve(address, 0);
 //     size_t pfn = ptedit_get_pfn(entry.pte);
@@ -393,42 +1001,65 @@ It will then point to a valid write/read mapped memory region where we will writ
 Reminder: Page Frame Number (PFN) is an index into the physical memory of a computer
 */
 void signal_handler(int sig, siginfo_t * si, void * unused) {
-    log_message(LOG_INFO, "Handler caught SIGSEGV - write attempt by process %d\n", getpid());
+    log_signal_message(LOG_INFO, "Handler caught SIGSEGV - write attempt by process %d\n", getpid());
+    FAULT_TIMER_START();
+    metrics_add(METRIC_FAULTS_HANDLED, 1);
     void * fault_addr = si->si_addr;
     fault_addr = align_to_page_boundary(fault_addr);
     //log_message(LOG_INFO, "Faulting address (aligned): %p\n", fault_addr);
 
-    void *new_page = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (new_page == MAP_FAILED) {
-        log_message(LOG_ERROR, "mmap failed: %s", strerror(errno));
+    void *new_page = take_copy_page();
+    if (new_page == NULL) {
+        log_signal_message(LOG_ERROR, "mmap failed: errno %d", errno);
         _exit(EXIT_FAILURE);
     }
     // log_message(LOG_INFO, "New page mapped at: %p\n", new_page);
 
+    FAULT_TIMER_PHASE(FAULT_PHASE_MMAP);
     memcpy(new_page, fault_addr, PAGE_SIZE);
     //log_message(LOG_INFO, "Content copied to new page by process %d\n", getpid());
+#if LOG_DELTA_ENCODING
+    delta_snapshot_store(fault_addr, new_page);
+#endif
+    FAULT_TIMER_PHASE(FAULT_PHASE_MEMCPY);
 
     if (mprotect(new_page, PAGE_SIZE, PROT_READ | PROT_WRITE) == -1) {
-        log_message(LOG_ERROR, "mprotect failed: %s", strerror(errno));
+        log_signal_message(LOG_ERROR, "mprotect failed: errno %d", errno);
         _exit(EXIT_FAILURE);
     }
 
+    // mprotect is accounted to the resolve phase
     ptedit_entry_t fault_entry = ptedit_resolve(fault_addr, 0);
     ptedit_entry_t new_page_entry = ptedit_resolve(new_page, 0);
+    FAULT_TIMER_PHASE(FAULT_PHASE_RESOLVE);
 
     size_t pt_pfn = ptedit_cast(fault_entry.pmd, ptedit_pmd_t).pfn;
     char* pt = ptedit_pmap(pt_pfn * ptedit_get_pagesize(), ptedit_get_pagesize());
 
-    size_t entry_index = (((size_t)fault_addr) >> 12) & 0x1FF;
-    size_t *mapped_entry = ((size_t *)pt) + entry_index;
+    if (pt != MAP_FAILED && pt != NULL) {
+        size_t entry_index = ptedit_page_table_index(fault_addr);
+        size_t *mapped_entry = ((size_t *)pt) + entry_index;
 
-    *mapped_entry = ptedit_set_pfn(*mapped_entry, ptedit_get_pfn(new_page_entry.pte));
+        *mapped_entry = ptedit_set_pfn(*mapped_entry, ptedit_get_pfn(new_page_entry.pte));
+        // a mapping of physical memory per fault, except for the simulated tables
+        if (!ptedit_simulated) munmap(pt, ptedit_get_pagesize());
+    }
+    FAULT_TIMER_PHASE(FAULT_PHASE_PMAP);
 
-    ptedit_update(fault_addr, 0, &new_page_entry);
+    track_privatized_page(fault_addr, new_page, fault_entry.pte);
+    // only the PTE: the upper levels of new_page_entry belong to new_page
+    fault_entry.pte = new_page_entry.pte | (1ull << PTEDIT_PAGE_BIT_RW);
+    fault_entry.valid = PTEDIT_VALID_MASK_PTE;
+    ptedit_update(fault_addr, 0, &fault_entry);
+    FAULT_TIMER_PHASE(FAULT_PHASE_UPDATE);
 
     ptedit_invalidate_tlb(fault_addr);
+    FAULT_TIMER_PHASE(FAULT_PHASE_TLB);
+    FAULT_TIMER_END();
+    metrics_add(METRIC_PAGES_PRIVATIZED, 1);
+    report_resolve_cache();
 
-    log_message(LOG_UPDATE, "Process %d updated virtual address %p to new physical address %zu", getpid(), fault_addr, (new_page_entry.pte));
+    log_signal_message(LOG_UPDATE, "Process %d updated virtual address %p to new physical address %zu", getpid(), fault_addr, (new_page_entry.pte));
 }
 
 bool configure_signal_handlers() {
@@ -450,27 +1081,3 @@ void show_diff(const char *file1, const char *file2) {
     snprintf(command, sizeof(command), "diff %s %s", file1, file2);
     system(command);
 }
-
-void log_message(LogLevel level, const char* format, ...) {
-    va_list args;
-    va_start(args, format);
-
-    time_t now = time(NULL);
-    char* time_str = ctime(&now);
-    time_str[strlen(time_str) - 1] = '\0';
-
-    const char* color_red = "\033[1;31m";
-    const char* color_blue = "\033[1;34m";
-    const char* color_yellow = "\033[1;33m";
-    const char* color_green = "\033[1;32m";
-    const char* color_reset = "\033[0m";
-
-    const char* level_strs[] = {"INFO", "END", "DEBUG", "UPDATE"};
-    const char* level_colors[] = {color_blue, color_red, color_yellow, color_green};
-
-    printf("%s[%s] [%s]%s ", level_colors[level], time_str, level_strs[level], color_reset);
-    vprintf(format, args);
-    printf("\n");
-
-    va_end(args);
-}
\ No newline at end of file
@@ -0,0 +1,259 @@
+#include "api.h"
+#include <ctype.h>
+
+/*
+Runtime configuration. The settings, from lowest to highest priority:
+  the DEFAULT_ macros of api.h
+  CONFIG_FILE, or the file named by PSAR_CONFIG or --config: "key = value" lines
+  the environment: PSAR_FILES, PSAR_PROCESSES, PSAR_FILE_FOLDER, PSAR_LOG_FOLDER, PSAR_ZERO_COPY,
+  PSAR_SIMULATE, PSAR_DIRTY_TRACKING, PSAR_FILE_SIZE, PSAR_FILE_PATTERN, PSAR_DIRECT_IO,
+  PSAR_WINDOW_SIZE, PSAR_WINDOW_BUDGET, PSAR_ACCESS_POLICY
+  the options given before the command: --files, --processes, --file-folder, --log-folder, --zero-copy,
+  --simulate, --dirty-tracking, --file-size, --file-pattern, --direct-io, --window-size, --window-budget,
+  --access-policy (the flags take no value)
+The environment is already applied when main starts, so the benchmarks and every
+forked process see the same values without calling config_load.
+*/
+
+PsarConfig psar_config = {
+    DEFAULT_NUMBER_OF_FILES,
+    DEFAULT_NUMBER_OF_PROCESSES,
+    4096,
+    DEFAULT_TEST_FILE_FOLDER,
+    DEFAULT_LOG_FOLDER,
+    false,
+    false,
+    false,
+    DEFAULT_FILE_SIZE,
+    DATASET_PATTERN_DEMO,
+    false,
+    DEFAULT_WINDOW_SIZE,
+    DEFAULT_WINDOW_BUDGET,
+    ACCESS_NORMAL,
+};
+
+static const struct {
+    const char *key;
+    const char *variable;
+    const char *option;
+    bool flag;
+} config_keys[] = {
+    { "files", "PSAR_FILES", "--files", false },
+    { "processes", "PSAR_PROCESSES", "--processes", false },
+    { "file_folder", "PSAR_FILE_FOLDER", "--file-folder", false },
+    { "log_folder", "PSAR_LOG_FOLDER", "--log-folder", false },
+    { "zero_copy", "PSAR_ZERO_COPY", "--zero-copy", true },
+    { "simulate", "PSAR_SIMULATE", "--simulate", true },
+    { "dirty_tracking", "PSAR_DIRTY_TRACKING", "--dirty-tracking", true },
+    { "file_size", "PSAR_FILE_SIZE", "--file-size", false },
+    { "file_pattern", "PSAR_FILE_PATTERN", "--file-pattern", false },
+    { "direct_io", "PSAR_DIRECT_IO", "--direct-io", true },
+    { "window_size", "PSAR_WINDOW_SIZE", "--window-size", false },
+    { "window_budget", "PSAR_WINDOW_BUDGET", "--window-budget", false },
+    { "access_policy", "PSAR_ACCESS_POLICY", "--access-policy", false },
+};
+
+#define CONFIG_KEYS (sizeof(config_keys) / sizeof(config_keys[0]))
+
+static bool config_parse_count(const char *value, int *out) {
+    char *end;
+    long count = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || count < 1 || count > 1 << 20) return false;
+    *out = (int)count;
+    return true;
+}
+
+// Bytes, with an optional K, M or G suffix
+static bool config_parse_size(const char *value, size_t *out) {
+    char *end;
+    unsigned long long size = strtoull(value, &end, 10);
+    int shift = 0;
+    switch (toupper((unsigned char)*end)) {
+    case 'K': shift = 10; end++; break;
+    case 'M': shift = 20; end++; break;
+    case 'G': shift = 30; end++; break;
+    }
+    if (!isdigit((unsigned char)*value) || *end != '\0' || size == 0 || size > (1ull << 48) >> shift) return false;
+    *out = (size_t)(size << shift);
+    return true;
+}
+
+// A size, or 0 to turn the setting off
+static bool config_parse_optional_size(const char *value, size_t *out) {
+    if (strcmp(value, "0") == 0) {
+        *out = 0;
+        return true;
+    }
+    return config_parse_size(value, out);
+}
+
+static bool config_parse_pattern(const char *value, DatasetPattern *out) {
+    for (DatasetPattern pattern = DATASET_PATTERN_DEMO; pattern <= DATASET_PATTERN_COMPRESSIBLE; pattern++) {
+        if (strcmp(value, dataset_pattern_name(pattern)) == 0) {
+            *out = pattern;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool config_parse_access_policy(const char *value, AccessPolicy *out) {
+    for (AccessPolicy policy = ACCESS_NORMAL; policy <= ACCESS_HUGEPAGE; policy++) {
+        if (strcmp(value, access_policy_name(policy)) == 0) {
+            *out = policy;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool config_parse_folder(const char *value, char *out) {
+    size_t len = strlen(value);
+    if (len == 0 || len >= CONFIG_PATH_SIZE) return false;
+    memcpy(out, value, len + 1);
+    while (len > 1 && out[len - 1] == '/') out[--len] = '\0';
+    return true;
+}
+
+static bool config_parse_flag(const char *value, bool *out) {
+    *out = strcmp(value, "0") != 0 && strcmp(value, "false") != 0;
+    return true;
+}
+
+// Set key (index into config_keys) from its text value, origin names where it came from
+static bool config_set(size_t key, const char *value, const char *origin) {
+    bool valid = false;
+    switch (key) {
+    case 0: valid = config_parse_count(value, &psar_config.files); break;
+    case 1: valid = config_parse_count(value, &psar_config.processes); break;
+    case 2: valid = config_parse_folder(value, psar_config.file_folder); break;
+    case 3: valid = config_parse_folder(value, psar_config.log_folder); break;
+    case 4: valid = config_parse_flag(value, &psar_config.zero_copy); break;
+    case 5: valid = config_parse_flag(value, &psar_config.simulate); break;
+    case 6: valid = config_parse_flag(value, &psar_config.dirty_tracking); break;
+    case 7: valid = config_parse_size(value, &psar_config.file_size); break;
+    case 8: valid = config_parse_pattern(value, &psar_config.file_pattern); break;
+    case 9: valid = config_parse_flag(value, &psar_config.direct_io); break;
+    case 10: valid = config_parse_optional_size(value, &psar_config.window_size); break;
+    case 11: valid = config_parse_size(value, &psar_config.window_budget); break;
+    case 12: valid = config_parse_access_policy(value, &psar_config.access_policy); break;
+    }
+    if (!valid) {
+        fprintf(stderr, "Invalid value '%s' for %s (%s)\n", value, config_keys[key].key, origin);
+    }
+    return valid;
+}
+
+static void config_apply_environment() {
+    for (size_t key = 0; key < CONFIG_KEYS; key++) {
+        const char *value = getenv(config_keys[key].variable);
+        if (value) config_set(key, value, config_keys[key].variable);
+    }
+}
+
+static char *config_trim(char *text) {
+    while (isspace((unsigned char)*text)) text++;
+    size_t len = strlen(text);
+    while (len > 0 && isspace((unsigned char)text[len - 1])) text[--len] = '\0';
+    return text;
+}
+
+/*
+Read "key = value" lines, '#' starts a comment. A missing file is not an error
+unless it was asked for explicitly.
+*/
+static bool config_read_file(const char *path, bool required) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        if (required) fprintf(stderr, "Cannot read configuration file %s: %s\n", path, strerror(errno));
+        return !required;
+    }
+    bool valid = true;
+    char line[256];
+    for (int number = 1; fgets(line, sizeof(line), file); number++) {
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        char *text = config_trim(line);
+        if (*text == '\0') continue;
+        char *equal = strchr(text, '=');
+        size_t key = CONFIG_KEYS;
+        if (equal) {
+            *equal = '\0';
+            const char *name = config_trim(text);
+            for (key = 0; key < CONFIG_KEYS && strcmp(name, config_keys[key].key) != 0; key++);
+        }
+        if (key == CONFIG_KEYS) {
+            fprintf(stderr, "%s:%d: unknown setting\n", path, number);
+            valid = false;
+            continue;
+        }
+        valid = config_set(key, config_trim(equal + 1), path) && valid;
+    }
+    fclose(file);
+    return valid;
+}
+
+// Before main: the machine page size and the environment
+__attribute__((constructor)) static void config_defaults() {
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size > 0) psar_config.page_size = page_size;
+    config_apply_environment();
+}
+
+/*
+Apply the configuration file, the environment again over it, then the options
+found before the command, which are removed from argv.
+*/
+bool config_load(int *argc, char **argv) {
+    const char *path = getenv("PSAR_CONFIG");
+    bool required = path != NULL;
+    int first = 1;
+    if (first + 1 < *argc && strcmp(argv[first], "--config") == 0) {
+        path = argv[first + 1];
+        required = true;
+        first += 2;
+    }
+    if (!config_read_file(path ? path : CONFIG_FILE, required)) return false;
+    config_apply_environment();
+
+    bool valid = true;
+    while (first < *argc && strncmp(argv[first], "--", 2) == 0) {
+        size_t key;
+        for (key = 0; key < CONFIG_KEYS && strcmp(argv[first], config_keys[key].option) != 0; key++);
+        if (key == CONFIG_KEYS) {
+            fprintf(stderr, "Unknown option '%s'\n", argv[first]);
+            return false;
+        }
+        if (config_keys[key].flag) {
+            valid = config_set(key, "1", argv[first]) && valid;
+            first++;
+            continue;
+        }
+        if (first + 1 == *argc) {
+            fprintf(stderr, "Missing value for %s\n", argv[first]);
+            return false;
+        }
+        valid = config_set(key, argv[first + 1], argv[first]) && valid;
+        first += 2;
+    }
+    memmove(argv + 1, argv + first, (*argc - first + 1) * sizeof(char *));
+    *argc -= first - 1;
+    return valid;
+}
+
+void config_print(FILE *out) {
+    fprintf(out, "files = %d\n", psar_config.files);
+    fprintf(out, "processes = %d\n", psar_config.processes);
+    fprintf(out, "file_folder = %s\n", psar_config.file_folder);
+    fprintf(out, "log_folder = %s\n", psar_config.log_folder);
+    fprintf(out, "zero_copy = %d\n", psar_config.zero_copy);
+    fprintf(out, "simulate = %d\n", psar_config.simulate);
+    fprintf(out, "dirty_tracking = %d\n", psar_config.dirty_tracking);
+    fprintf(out, "file_size = %zu\n", psar_config.file_size);
+    fprintf(out, "file_pattern = %s\n", dataset_pattern_name(psar_config.file_pattern));
+    fprintf(out, "direct_io = %d\n", psar_config.direct_io);
+    fprintf(out, "window_size = %zu\n", psar_config.window_size);
+    fprintf(out, "window_budget = %zu\n", psar_config.window_budget);
+    fprintf(out, "access_policy = %s\n", access_policy_name(psar_config.access_policy));
+    fprintf(out, "# page_size = %zu (from the system)\n", psar_config.page_size);
+}
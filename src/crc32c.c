@@ -0,0 +1,180 @@
+#include "api.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78 // reflected Castagnoli polynomial
+
+static uint32_t crc32c_table[8][256];
+static bool crc32c_table_ready = false;
+
+static void crc32c_init_table() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int t = 1; t < 8; t++) {
+            crc32c_table[t][n] = (crc32c_table[t - 1][n] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][n] & 0xff];
+        }
+    }
+    crc32c_table_ready = true;
+}
+
+/*
+Portable slicing-by-8 version, used when the CPU has no crc32 instruction
+*/
+static uint32_t crc32c_software(uint32_t crc, const char *data, size_t len) {
+    if (!crc32c_table_ready) crc32c_init_table();
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+        data += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ (uint8_t)*data++) & 0xff];
+    }
+    return crc;
+}
+
+#if CRC32C_X86
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+// tables shifting a crc over CRC32C_LONG / CRC32C_SHORT zero bytes
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1) sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+/*
+Build the tables applying len zero bytes (a power of two) to a crc, so that
+crc(A . B) = shift(crc(A), len(B)) ^ crc(B) for raw register values.
+*/
+static void crc32c_zeros(uint32_t zeros[4][256], size_t len) {
+    uint32_t even[32], odd[32];
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+    uint32_t *op = even;
+    do {
+        gf2_matrix_square(even, odd);
+        op = even;
+        len >>= 1;
+        if (!len) break;
+        gf2_matrix_square(odd, even);
+        op = odd;
+        len >>= 1;
+    } while (len);
+
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static inline uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static inline uint64_t crc32c_load(const char *data) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    return word;
+}
+
+/*
+SSE4.2 crc32 instruction. It has a latency of three cycles but a throughput of
+one per cycle, so large inputs are split in three interleaved streams whose
+results are folded together with the zero shift tables.
+*/
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hardware(uint32_t crc, const char *data, size_t len) {
+    uint64_t crc0 = crc, crc1, crc2;
+    while (len && ((uintptr_t)data & 7)) {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, (uint8_t)*data++);
+        len--;
+    }
+    while (len >= 3 * CRC32C_LONG) {
+        crc1 = crc2 = 0;
+        for (const char *end = data + CRC32C_LONG; data < end; data += 8) {
+            crc0 = _mm_crc32_u64(crc0, crc32c_load(data));
+            crc1 = _mm_crc32_u64(crc1, crc32c_load(data + CRC32C_LONG));
+            crc2 = _mm_crc32_u64(crc2, crc32c_load(data + 2 * CRC32C_LONG));
+        }
+        crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc2;
+        data += 2 * CRC32C_LONG;
+        len -= 3 * CRC32C_LONG;
+    }
+    while (len >= 3 * CRC32C_SHORT) {
+        crc1 = crc2 = 0;
+        for (const char *end = data + CRC32C_SHORT; data < end; data += 8) {
+            crc0 = _mm_crc32_u64(crc0, crc32c_load(data));
+            crc1 = _mm_crc32_u64(crc1, crc32c_load(data + CRC32C_SHORT));
+            crc2 = _mm_crc32_u64(crc2, crc32c_load(data + 2 * CRC32C_SHORT));
+        }
+        crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc2;
+        data += 2 * CRC32C_SHORT;
+        len -= 3 * CRC32C_SHORT;
+    }
+    for (; len >= 8; data += 8, len -= 8) {
+        crc0 = _mm_crc32_u64(crc0, crc32c_load(data));
+    }
+    while (len--) {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, (uint8_t)*data++);
+    }
+    return (uint32_t)crc0;
+}
+#endif
+
+/*
+Update a CRC32C (Castagnoli) with len bytes. Start with crc = 0, the pre and
+post inversions are handled here so calls can be chained.
+*/
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    crc = ~crc;
+#if CRC32C_X86
+    static int hardware = -1;
+    if (hardware == -1) {
+        __builtin_cpu_init();
+        hardware = __builtin_cpu_supports("sse4.2");
+        if (hardware) {
+            crc32c_zeros(crc32c_long, CRC32C_LONG);
+            crc32c_zeros(crc32c_short, CRC32C_SHORT);
+        }
+    }
+    if (hardware) return ~crc32c_hardware(crc, data, len);
+#endif
+    return ~crc32c_software(crc, data, len);
+}
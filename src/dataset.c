@@ -0,0 +1,191 @@
+#define _GNU_SOURCE // fallocate, O_DIRECT
+#include "api.h"
+
+/*
+Test files created by init: NUMBER_OF_FILES files of psar_config.file_size bytes
+filled with psar_config.file_pattern. Every file is created and preallocated with
+fallocate once, then threads fill DATASET_CHUNK_SIZE chunks of any file from
+page aligned buffers, with O_DIRECT when direct_io is set. The content of a chunk
+only depends on the file and the offset, whichever thread writes it.
+*/
+
+static const char *dataset_pattern_names[] = { "demo", "constant", "random", "compressible" };
+
+typedef struct {
+    int *fds; // one per test file
+    int files;
+    size_t size;
+    size_t chunks_per_file;
+    bool direct;
+    size_t next_chunk; // taken with __atomic_fetch_add
+    bool failed;
+} Dataset;
+
+const char *dataset_pattern_name(DatasetPattern pattern) {
+    return dataset_pattern_names[pattern];
+}
+
+static uint64_t dataset_mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/*
+Fill len bytes (a multiple of 8) found at offset of file number file:
+  demo: DATA_DEMO repeated, the former content of the test files
+  constant: a single byte
+  random: a counter based generator, every 64-bit word from its own index
+  compressible: the first quarter of every 64 bytes random, the rest zero
+The loops run over whole words without branches so that the compiler can
+vectorize them.
+*/
+static void dataset_fill(uint64_t *words, size_t len, int file, size_t offset) {
+    size_t count = len / sizeof(uint64_t);
+    uint64_t seed = (uint64_t)file << 48;
+    uint64_t first = offset / sizeof(uint64_t);
+    switch (psar_config.file_pattern) {
+    case DATASET_PATTERN_DEMO: {
+        const size_t demo = sizeof(DATA_DEMO) - 1;
+        char *bytes = (char *)words;
+        for (size_t done = 0; done < len;) {
+            size_t start = (offset + done) % demo;
+            size_t piece = demo - start < len - done ? demo - start : len - done;
+            memcpy(bytes + done, DATA_DEMO + start, piece);
+            done += piece;
+        }
+        break;
+    }
+    case DATASET_PATTERN_CONSTANT:
+        memset(words, 'c', len);
+        break;
+    case DATASET_PATTERN_RANDOM:
+        for (size_t i = 0; i < count; i++) words[i] = dataset_mix(seed + first + i);
+        break;
+    case DATASET_PATTERN_COMPRESSIBLE:
+        for (size_t i = 0; i < count; i++) words[i] = (first + i) % 8 < 2 ? dataset_mix(seed + first + i) : 0;
+        break;
+    }
+}
+
+/*
+Write len bytes at offset of fd. With O_DIRECT the length is rounded up to a
+page (the file is truncated to its size afterwards); a file system refusing
+O_DIRECT gets the buffered write instead.
+*/
+static bool dataset_write(Dataset *dataset, int fd, const char *buffer, size_t len, size_t offset) {
+    size_t aligned = dataset->direct ? (len + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE : len;
+    for (size_t done = 0; done < aligned;) {
+        ssize_t bytes = pwrite(fd, buffer + done, aligned - done, offset + done);
+        if (bytes == -1 && errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT)) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            aligned = len;
+            continue;
+        }
+        if (bytes <= 0) {
+            log_message(LOG_ERROR, "write failed: %s", bytes == -1 ? strerror(errno) : "short write");
+            return false;
+        }
+        done += bytes;
+    }
+    return true;
+}
+
+static void *dataset_writer(void *argument) {
+    Dataset *dataset = argument;
+    char *buffer = NULL;
+    size_t buffer_size = dataset->size < DATASET_CHUNK_SIZE ? dataset->size : DATASET_CHUNK_SIZE;
+    buffer_size = (buffer_size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    if (posix_memalign((void **)&buffer, PAGE_SIZE, buffer_size) != 0) {
+        log_message(LOG_ERROR, "Failed to allocate a buffer of %zu bytes", buffer_size);
+        __atomic_store_n(&dataset->failed, true, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    size_t total = dataset->chunks_per_file * dataset->files;
+    size_t chunk;
+    while (!__atomic_load_n(&dataset->failed, __ATOMIC_RELAXED) && (chunk = __atomic_fetch_add(&dataset->next_chunk, 1, __ATOMIC_RELAXED)) < total) {
+        int file = chunk / dataset->chunks_per_file;
+        size_t offset = chunk % dataset->chunks_per_file * DATASET_CHUNK_SIZE;
+        size_t len = dataset->size - offset < DATASET_CHUNK_SIZE ? dataset->size - offset : DATASET_CHUNK_SIZE;
+        dataset_fill((uint64_t *)buffer, (len + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t), file, offset);
+        if (!dataset_write(dataset, dataset->fds[file], buffer, len, offset)) {
+            __atomic_store_n(&dataset->failed, true, __ATOMIC_RELAXED);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Create (truncate) and preallocate every test file
+static bool dataset_open(Dataset *dataset) {
+    char file_name[FILE_NAME_SIZE];
+    for (; dataset->files < NUMBER_OF_FILES; dataset->files++) {
+        snprintf(file_name, FILE_NAME_SIZE, "%s/file%d", TEST_FILE_FOLDER, dataset->files);
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+        int fd = open(file_name, flags | (dataset->direct ? O_DIRECT : 0), FILE_PERMISSIONS);
+        if (fd == -1 && dataset->direct && errno == EINVAL) {
+            fd = open(file_name, flags, FILE_PERMISSIONS);
+        }
+        if (fd == -1) {
+            log_message(LOG_ERROR, "open failed: %s", strerror(errno));
+            return false;
+        }
+        dataset->fds[dataset->files] = fd;
+        if (fallocate(fd, 0, 0, dataset->size) == -1 && errno != EOPNOTSUPP) {
+            log_message(LOG_ERROR, "fallocate failed for %s: %s", file_name, strerror(errno));
+            dataset->files++;
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+Create the NUMBER_OF_FILES test files with threads writer threads and report the
+throughput, the data is on disk when it returns
+*/
+bool create_test_files(int threads) {
+    Dataset *dataset = calloc(1, sizeof(Dataset));
+    if (dataset) dataset->fds = calloc(NUMBER_OF_FILES, sizeof(int));
+    if (!dataset || !dataset->fds) {
+        log_message(LOG_ERROR, "Failed to allocate the test files");
+        free(dataset);
+        return false;
+    }
+    dataset->size = psar_config.file_size;
+    dataset->chunks_per_file = (dataset->size + DATASET_CHUNK_SIZE - 1) / DATASET_CHUNK_SIZE;
+    dataset->direct = psar_config.direct_io;
+    if (threads < 1) threads = 1;
+    if (threads > DATASET_MAX_THREADS) threads = DATASET_MAX_THREADS;
+
+    uint64_t start = stats_clock();
+    bool success = dataset_open(dataset);
+    pthread_t writers[DATASET_MAX_THREADS];
+    int started = 0;
+    for (; success && started < threads; started++) {
+        if (pthread_create(&writers[started], NULL, dataset_writer, dataset) != 0) break;
+    }
+    if (success && started == 0) dataset_writer(dataset);
+    for (int i = 0; i < started; i++) {
+        pthread_join(writers[i], NULL);
+    }
+    success = success && !dataset->failed;
+    for (int i = 0; i < dataset->files; i++) {
+        if (dataset->direct && ftruncate(dataset->fds[i], dataset->size) == -1) success = false;
+        if (fdatasync(dataset->fds[i]) == -1) success = false;
+        close(dataset->fds[i]);
+    }
+    double seconds = (stats_clock() - start) / 1e9;
+    if (success) {
+        double megabytes = (double)dataset->size * dataset->files / (1 << 20);
+        log_message(LOG_UPDATE, "%d files of %zu bytes (%s) written by %d threads in %.3f s, %.1f MB/s",
+                    dataset->files, dataset->size, dataset_pattern_name(psar_config.file_pattern),
+                    started ? started : 1, seconds, seconds > 0 ? megabytes / seconds : 0);
+    } else {
+        log_message(LOG_ERROR, "Failed to create the test files");
+    }
+    free(dataset->fds);
+    free(dataset);
+    return success;
+}
@@ -0,0 +1,170 @@
+#include "api.h"
+
+/*
+Pages privatized by signal_handler keep a copy of their original contents here,
+so that later writes to an already modified page can still be encoded against
+the source file. The table lives in memory obtained with mmap so it can be
+filled from inside the signal handler.
+*/
+typedef struct {
+    const char *page;
+    char *original;
+} DeltaSnapshot;
+
+static DeltaSnapshot *snapshots = NULL;
+static char *snapshot_storage = NULL;
+static size_t snapshot_storage_used = 0;
+static bool snapshot_overflow = false;
+
+static size_t snapshot_slot(const void *page) {
+    return ((size_t)page / PAGE_SIZE) % DELTA_SNAPSHOT_CAPACITY;
+}
+
+static DeltaSnapshot *delta_snapshot_find(const void *page) {
+    if (!snapshots) return NULL;
+    size_t slot = snapshot_slot(page);
+    for (size_t probe = 0; probe < DELTA_SNAPSHOT_CAPACITY; probe++) {
+        DeltaSnapshot *entry = &snapshots[(slot + probe) % DELTA_SNAPSHOT_CAPACITY];
+        if (entry->page == page) return entry;
+        if (entry->page == NULL && entry->original == NULL) return NULL;
+    }
+    return NULL;
+}
+
+/*
+Called from signal_handler with the original page contents, before the
+page table entry is switched to the private copy.
+*/
+void delta_snapshot_store(void *page, const void *contents) {
+    if (snapshot_overflow) return;
+    if (!snapshots) {
+        snapshots = mmap(NULL, DELTA_SNAPSHOT_CAPACITY * sizeof(DeltaSnapshot), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        snapshot_storage = mmap(NULL, (size_t)DELTA_SNAPSHOT_CAPACITY * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (snapshots == MAP_FAILED || snapshot_storage == MAP_FAILED) {
+            snapshots = NULL;
+            snapshot_overflow = true;
+            return;
+        }
+    }
+
+    DeltaSnapshot *entry = delta_snapshot_find(page);
+    size_t slot = snapshot_slot(page);
+    for (size_t probe = 0; !entry && probe < DELTA_SNAPSHOT_CAPACITY; probe++) {
+        DeltaSnapshot *candidate = &snapshots[(slot + probe) % DELTA_SNAPSHOT_CAPACITY];
+        if (candidate->page == NULL) entry = candidate;
+    }
+    if (entry) {
+        if (!entry->original && snapshot_storage_used < DELTA_SNAPSHOT_CAPACITY) {
+            entry->original = snapshot_storage + snapshot_storage_used++ * PAGE_SIZE;
+        }
+        if (entry->original) {
+            memcpy(entry->original, contents, PAGE_SIZE);
+            entry->page = page;
+            return;
+        }
+    }
+    // a privatized page we cannot remember makes every later delta unsafe
+    snapshot_overflow = true;
+}
+
+const char *delta_snapshot_lookup(const void *page) {
+    DeltaSnapshot *entry = delta_snapshot_find(page);
+    return entry ? entry->original : NULL;
+}
+
+/*
+Forget every snapshot of a region that is about to be unmapped, the same
+virtual addresses may be handed out again for another file.
+Slots are kept (page set to NULL, storage kept) so probing chains stay intact.
+*/
+void delta_snapshot_release(void *region, size_t len) {
+    if (!snapshots) return;
+    char *start = align_to_page_boundary(region);
+    for (char *page = start; page < (char *)region + len; page += PAGE_SIZE) {
+        DeltaSnapshot *entry = delta_snapshot_find(page);
+        if (entry) entry->page = NULL;
+    }
+}
+
+/*
+Rebuild the original file bytes covering [offset, offset + len) of a mapping.
+Pages not privatized yet still show the file itself; privatized pages come from
+their snapshot. Returns false when the original cannot be known.
+*/
+bool delta_load_original(const char *mapped_region, off_t offset, size_t len, char *out) {
+    if (snapshot_overflow) return false;
+    size_t done = 0;
+    while (done < len) {
+        const char *addr = mapped_region + offset + done;
+        const char *page = align_to_page_boundary((void *)addr);
+        size_t page_offset = addr - page;
+        size_t chunk = PAGE_SIZE - page_offset;
+        if (chunk > len - done) chunk = len - done;
+
+        const char *original = delta_snapshot_lookup(page);
+        memcpy(out + done, original ? original + page_offset : addr, chunk);
+        done += chunk;
+    }
+    return true;
+}
+
+static void delta_put_u32(char *out, uint32_t value) {
+    memcpy(out, &value, sizeof(value));
+}
+
+static uint32_t delta_get_u32(const char *in) {
+    uint32_t value;
+    memcpy(&value, in, sizeof(value));
+    return value;
+}
+
+/*
+Encode data as a run-length XOR delta against original. The payload is a list of
+(skip, run, run bytes of original ^ data) triples; skipped bytes are unchanged.
+page_diff merges runs separated by fewer unchanged bytes than a triple header.
+Returns the encoded size, or 0 when the delta would not be smaller than len.
+*/
+size_t delta_encode(const char *original, const char *data, size_t len, char *out) {
+    const size_t header = 2 * sizeof(uint32_t);
+    DiffRun runs[DELTA_DIFF_RUNS];
+    size_t pos = 0, last_end = 0, used = 0;
+
+    while (pos < len) {
+        size_t count = page_diff(original + pos, data + pos, len - pos, header, runs, DELTA_DIFF_RUNS);
+        for (size_t i = 0; i < count; i++) {
+            size_t run_start = pos + runs[i].offset, run = runs[i].length;
+            if (used + header + run >= len || run > UINT32_MAX || run_start - last_end > UINT32_MAX) return 0;
+            delta_put_u32(out + used, (uint32_t)(run_start - last_end));
+            delta_put_u32(out + used + sizeof(uint32_t), (uint32_t)run);
+            used += header;
+            for (size_t j = run_start; j < run_start + run; j++) {
+                out[used++] = original[j] ^ data[j];
+            }
+            last_end = run_start + run;
+        }
+        if (count < DELTA_DIFF_RUNS) break;
+        pos = last_end;
+    }
+    return used < len ? used : 0;
+}
+
+/*
+Apply a payload produced by delta_encode to target, which holds the original
+bytes on entry and the modified bytes on return.
+*/
+bool delta_apply(char *target, size_t len, const char *payload, size_t payload_size) {
+    const size_t header = 2 * sizeof(uint32_t);
+    size_t pos = 0, used = 0;
+    while (used < payload_size) {
+        if (payload_size - used < header) return false;
+        size_t skip = delta_get_u32(payload + used);
+        size_t run = delta_get_u32(payload + used + sizeof(uint32_t));
+        used += header;
+        if (skip > len - pos || run > len - pos - skip || run > payload_size - used) return false;
+        pos += skip;
+        for (size_t i = 0; i < run; i++) {
+            target[pos++] ^= payload[used++];
+        }
+    }
+    return true;
+}
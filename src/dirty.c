@@ -0,0 +1,284 @@
+#include "api.h"
+
+/*
+Dirty page tracking (PSAR_DIRTY_TRACKING=1). The file is mapped writable but
+private, the writers store into it directly and the kernel gives every written
+page its private copy without a SIGSEGV. A checkpoint then finds the written
+pages with one pass over the region:
+  the dirty bits of the PTEs, read and cleared through PTEditor
+  without PTEditor, the soft-dirty bits of /proc/self/pagemap, reset through
+  /proc/self/clear_refs
+  when the kernel has no soft-dirty bits, the pages having a private copy, which
+  stay set once written
+Each dirty page is compared with its content at the previous checkpoint (the
+file itself before the first one) and only the changed runs are logged, as raw
+records merge_all applies like any other.
+*/
+
+static int soft_dirty_supported = -1; // probed on first use
+static uint64_t soft_dirty_epoch = 1; // bumped by every clear_refs of this process
+
+// /proc/self/pagemap of this process, reopened after a fork
+static int pagemap_fd = -1;
+static pid_t pagemap_pid = 0;
+static uint64_t *pagemap_entries = NULL; // DIRTY_PAGEMAP_BATCH entries
+
+static bool clear_soft_dirty() {
+    soft_dirty_epoch++;
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    bool cleared = fd != -1 && write(fd, "4", 1) == 1;
+    if (fd != -1) close(fd);
+    return cleared;
+}
+
+static int pagemap_open() {
+    if (pagemap_pid != getpid()) {
+        if (pagemap_fd != -1) close(pagemap_fd);
+        pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+        pagemap_pid = getpid();
+        if (pagemap_fd == -1) log_message(LOG_ERROR, "Cannot read /proc/self/pagemap: %s", strerror(errno));
+    }
+    return pagemap_fd;
+}
+
+// Read the pagemap entries of count pages from address
+static bool read_pagemap(const char *address, size_t count, uint64_t *entries) {
+    off_t position = (uintptr_t)address / PAGE_SIZE * sizeof(uint64_t);
+    int fd = pagemap_open();
+    return fd != -1 && pread(fd, entries, count * sizeof(uint64_t), position) == (ssize_t)(count * sizeof(uint64_t));
+}
+
+// A page written after clear_refs must show the soft-dirty bit
+static bool probe_soft_dirty() {
+    char *page = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uint64_t entry = 0;
+    bool supported = false;
+    if (page != MAP_FAILED) {
+        page[0] = 1;
+        if (clear_soft_dirty()) {
+            page[0] = 2;
+            supported = read_pagemap(page, 1, &entry) && (entry & PAGEMAP_SOFT_DIRTY);
+        }
+        munmap(page, PAGE_SIZE);
+    }
+    return supported;
+}
+
+/*
+Map file_name writable and private for dirty tracking. Pages count as written
+from now on only. The soft-dirty bits are left alone, the other regions may have
+writes pending in them: the first scan looks for private copies instead.
+*/
+bool dirty_region_open(DirtyRegion *region, const char *file_name) {
+    memset(region, 0, sizeof(*region));
+    region->fd = open(file_name, O_RDONLY);
+    if (region->fd == -1) {
+        log_message(LOG_ERROR, "open failed for %s: %s", file_name, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(region->fd, &st) == -1 || st.st_size == 0) {
+        log_message(LOG_ERROR, "Cannot map %s", file_name);
+        close(region->fd);
+        return false;
+    }
+    region->size = st.st_size;
+    size_t pages = (region->size + PAGE_SIZE - 1) / PAGE_SIZE;
+    region->region = mmap(NULL, region->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, region->fd, 0);
+    // only the pages ever logged are backed
+    region->baseline = mmap(NULL, pages * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    region->bitmap = calloc((pages + 63) / 64, sizeof(uint64_t));
+    region->logged = calloc((pages + 63) / 64, sizeof(uint64_t));
+    if (region->region == MAP_FAILED || region->baseline == MAP_FAILED || !region->bitmap || !region->logged) {
+        log_message(LOG_ERROR, "Failed to map %s for dirty tracking: %s", file_name, strerror(errno));
+        if (region->region != MAP_FAILED) munmap(region->region, region->size);
+        if (region->baseline != MAP_FAILED) munmap(region->baseline, pages * PAGE_SIZE);
+        free(region->bitmap);
+        free(region->logged);
+        close(region->fd);
+        return false;
+    }
+    advise_mapping(region->region, region->size, region->fd, 0);
+    snprintf(region->file_name, sizeof(region->file_name), "%s", file_name);
+    if (soft_dirty_supported == -1) soft_dirty_supported = probe_soft_dirty();
+    // a new mapping reports every page soft-dirty until the next clear_refs
+    region->soft_dirty_epoch = 0;
+    return true;
+}
+
+static bool scan_pagemap(DirtyRegion *region, size_t pages, bool soft_dirty) {
+    if (!pagemap_entries) pagemap_entries = malloc(DIRTY_PAGEMAP_BATCH * sizeof(uint64_t));
+    if (!pagemap_entries) return false;
+    bool success = true;
+    for (size_t first = 0; success && first < pages; first += DIRTY_PAGEMAP_BATCH) {
+        size_t count = pages - first < DIRTY_PAGEMAP_BATCH ? pages - first : DIRTY_PAGEMAP_BATCH;
+        success = read_pagemap(region->region + first * PAGE_SIZE, count, pagemap_entries);
+        for (size_t i = 0; success && i < count; i++) {
+            uint64_t entry = pagemap_entries[i];
+            bool dirty = soft_dirty
+                ? (entry & PAGEMAP_SOFT_DIRTY) != 0
+                : (entry & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) && !(entry & PAGEMAP_FILE);
+            if (dirty) {
+                region->bitmap[(first + i) / 64] |= 1ull << ((first + i) % 64);
+                region->dirty_pages++;
+            }
+        }
+    }
+    return success;
+}
+
+/*
+Fill the bitmap with the pages written since the previous checkpoint (since the
+mapping for the private copy source). Soft-dirty bits are only reset by
+dirty_regions_checkpoint, once every region is scanned, since clear_refs resets
+those of the whole process. They are only used when the last clear_refs was the
+one of the previous checkpoint of the region: after the mapping, or a clear_refs
+for other regions, the pages having a private copy are scanned instead. They
+include the pages written before, whose unchanged content log_dirty_pages does
+not log again. Returns the number of dirty pages.
+*/
+size_t dirty_region_scan(DirtyRegion *region) {
+    size_t pages = (region->size + PAGE_SIZE - 1) / PAGE_SIZE;
+    memset(region->bitmap, 0, (pages + 63) / 64 * sizeof(uint64_t));
+    region->dirty_pages = 0;
+    if (collect_dirty_ptes(region->region, pages, region->bitmap, &region->dirty_pages)) {
+        region->source = DIRTY_SOURCE_PTE;
+    } else {
+        bool soft_dirty = soft_dirty_supported && region->soft_dirty_epoch == soft_dirty_epoch;
+        region->source = soft_dirty ? DIRTY_SOURCE_SOFT_DIRTY : DIRTY_SOURCE_PRIVATE_COPY;
+        if (!scan_pagemap(region, pages, soft_dirty)) region->dirty_pages = 0;
+    }
+    return region->dirty_pages;
+}
+
+static bool page_bit(const uint64_t *bitmap, size_t page) {
+    return bitmap[page / 64] & (1ull << (page % 64));
+}
+
+// Records waiting for one append_log_records, their payloads point into the region
+typedef struct {
+    LogRecordHeader headers[LOG_BATCH_IOVECS / 2];
+    struct iovec record[LOG_BATCH_IOVECS];
+    size_t records;
+    size_t record_bytes;
+    uint64_t timestamp;
+} DirtyLogBatch;
+
+static bool dirty_batch_flush(DirtyLogBatch *batch, const char *file_name) {
+    bool success = batch->records == 0 || append_log_records(file_name, batch->record, batch->records, batch->record_bytes);
+    batch->records = 0;
+    batch->record_bytes = 0;
+    return success;
+}
+
+static bool dirty_batch_add(DirtyLogBatch *batch, DirtyRegion *region, size_t offset, size_t len) {
+    LogRecordHeader *header = &batch->headers[batch->records];
+    *header = (LogRecordHeader){ LOG_RECORD_MAGIC, LOG_ENCODING_RAW, offset, len, len, batch->timestamp, 0, 0 };
+    log_record_seal(header, region->region + offset);
+    batch->record[2 * batch->records] = (struct iovec){ header, sizeof(LogRecordHeader) };
+    batch->record[2 * batch->records + 1] = (struct iovec){ region->region + offset, len };
+    batch->records++;
+    batch->record_bytes += sizeof(LogRecordHeader) + len;
+    return batch->records < LOG_BATCH_IOVECS / 2 || dirty_batch_flush(batch, region->file_name);
+}
+
+/*
+Log the runs of a dirty page that differ from its content at the previous
+checkpoint, or from the file before the first one, then keep the page as the
+next baseline. Runs closer than a record header are logged as one.
+*/
+static bool log_page_changes(DirtyLogBatch *batch, DirtyRegion *region, size_t page, char *scratch, size_t *changed) {
+    size_t offset = page * PAGE_SIZE;
+    size_t len = region->size - offset < PAGE_SIZE ? region->size - offset : PAGE_SIZE;
+    char *baseline = region->baseline + offset;
+    const char *previous = baseline;
+    if (!page_bit(region->logged, page)) {
+        if (pread(region->fd, scratch, len, offset) != (ssize_t)len) {
+            log_message(LOG_ERROR, "Cannot read page %zu of %s: %s", page, region->file_name, strerror(errno));
+            return false;
+        }
+        previous = scratch;
+    }
+    const char *current = region->region + offset;
+    DiffRun runs[DELTA_DIFF_RUNS];
+    size_t position = 0;
+    while (position < len) {
+        size_t count = page_diff(previous + position, current + position, len - position, sizeof(LogRecordHeader), runs, DELTA_DIFF_RUNS);
+        for (size_t i = 0; i < count; i++) {
+            if (!dirty_batch_add(batch, region, offset + position + runs[i].offset, runs[i].length)) return false;
+            *changed += runs[i].length;
+        }
+        if (count < DELTA_DIFF_RUNS) break;
+        position += runs[count - 1].offset + runs[count - 1].length;
+    }
+    memcpy(baseline, current, len);
+    region->logged[page / 64] |= 1ull << (page % 64);
+    return true;
+}
+
+static bool log_dirty_pages(DirtyLogBatch *batch, DirtyRegion *region, char *scratch) {
+    size_t pages = (region->size + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t changed = 0;
+    bool success = true;
+    for (size_t page = 0; success && page < pages; page++) {
+        if (page_bit(region->bitmap, page)) success = log_page_changes(batch, region, page, scratch, &changed);
+    }
+    success = dirty_batch_flush(batch, region->file_name) && success;
+    if (success) {
+        metrics_add(METRIC_DIRTY_PAGES_LOGGED, region->dirty_pages);
+        log_message(LOG_DEBUG, "Checkpoint of %s: %zu dirty pages, %zu bytes changed", region->file_name, region->dirty_pages, changed);
+    }
+    return success;
+}
+
+/*
+Checkpoint count regions together: every region is scanned, the soft-dirty bits
+are reset once, then the changes of the dirty pages are logged. The writers must
+not store into the regions while it runs.
+*/
+bool dirty_regions_checkpoint(DirtyRegion *regions, int count) {
+    size_t dirty = 0;
+    bool soft_dirty = false;
+    for (int i = 0; i < count; i++) {
+        dirty += dirty_region_scan(&regions[i]);
+        soft_dirty = soft_dirty || regions[i].source != DIRTY_SOURCE_PTE;
+    }
+    bool success = true;
+    if (soft_dirty && soft_dirty_supported) {
+        success = clear_soft_dirty();
+        for (int i = 0; i < count; i++) regions[i].soft_dirty_epoch = soft_dirty_epoch;
+    }
+    if (dirty == 0) return success;
+    DirtyLogBatch *batch = malloc(sizeof(DirtyLogBatch));
+    char *scratch = malloc(PAGE_SIZE);
+    if (!batch || !scratch) {
+        log_message(LOG_ERROR, "Failed to allocate the records of %zu dirty pages", dirty);
+        free(batch);
+        free(scratch);
+        return false;
+    }
+    batch->records = 0;
+    batch->record_bytes = 0;
+    batch->timestamp = log_record_clock();
+    for (int i = 0; i < count; i++) {
+        if (regions[i].dirty_pages) success = log_dirty_pages(batch, &regions[i], scratch) && success;
+    }
+    free(batch);
+    free(scratch);
+    return success;
+}
+
+bool dirty_region_checkpoint(DirtyRegion *region) {
+    return dirty_regions_checkpoint(region, 1);
+}
+
+void dirty_region_close(DirtyRegion *region) {
+    size_t pages = (region->size + PAGE_SIZE - 1) / PAGE_SIZE;
+    munmap(region->region, region->size);
+    munmap(region->baseline, pages * PAGE_SIZE);
+    close(region->fd);
+    free(region->bitmap);
+    free(region->logged);
+    region->bitmap = NULL;
+    region->logged = NULL;
+}
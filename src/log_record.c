@@ -0,0 +1,455 @@
+#include "api.h"
+
+static LogSegment log_segments[LOG_SEGMENTS_OPEN];
+static int log_segment_count = 0;
+static pid_t log_segments_pid = 0; // process owning the table, a forked child starts its own
+static uint32_t log_segment_sequence = 0;
+
+uint64_t log_record_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+Open a log segment for writing. A new segment starts with a LogSegmentHeader
+identifying the format and the writer, protected by its own checksum. The file is
+not opened with O_APPEND: writers keep track of its end and write there, which
+also lets splice into it. Fails with EEXIST when path exists already, a file left
+by an earlier process with the same pid is never appended to.
+*/
+int log_segment_open(const char *path, uint32_t sequence) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd == -1) {
+        return -1;
+    }
+    LogSegmentHeader segment = { LOG_SEGMENT_MAGIC, LOG_FORMAT_VERSION, (uint64_t)getpid(), log_record_clock(), sequence, 0 };
+    segment.crc = crc32c(0, &segment, offsetof(LogSegmentHeader, crc));
+    if (write(fd, &segment, sizeof(segment)) != sizeof(segment)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool log_segment_create(LogSegment *segment, const char *file_name) {
+    char log_dir_path[256];
+    snprintf(log_dir_path, sizeof(log_dir_path), "%s/logs_%d", LOG_FOLDER, getpid());
+    if (!ensure_directory_exists(log_dir_path)) {
+        return false;
+    }
+    const char *original_file_name = strrchr(file_name, '/');
+    if (!original_file_name) original_file_name = file_name;
+    else original_file_name++;
+
+    // zero padded so that the segments of a process sort in the order they were written,
+    // the numbers taken by the segments of a dead process with the same pid are skipped
+    char log_file_path[512];
+    do {
+        uint32_t sequence = log_segment_sequence++;
+        snprintf(log_file_path, sizeof(log_file_path), "%s/log_%s_%06u.log", log_dir_path, original_file_name, sequence);
+        segment->fd = log_segment_open(log_file_path, sequence);
+    } while (segment->fd == -1 && errno == EEXIST);
+    segment->size = segment->fd == -1 ? -1 : lseek(segment->fd, 0, SEEK_END);
+    if (segment->size == -1) {
+        log_message(LOG_ERROR, "Failed to open log file %s: %s", log_file_path, strerror(errno));
+        if (segment->fd != -1) close(segment->fd);
+        segment->fd = -1;
+        return false;
+    }
+    snprintf(segment->file_name, sizeof(segment->file_name), "%s", file_name);
+    segment->opened = stats_clock();
+    return true;
+}
+
+/*
+Segment of this process to append record_bytes of records for file_name to. The
+segment stays open from one write to the next; a new one, with the next sequence
+number, is started once it would grow past LOG_SEGMENT_MAX_SIZE or is older than
+LOG_SEGMENT_MAX_AGE. The caller writes at size and advances it.
+*/
+LogSegment *log_segment_for_file(const char *file_name, size_t record_bytes) {
+    pid_t pid = getpid();
+    if (log_segments_pid != pid) {
+        for (int i = 0; i < log_segment_count; i++) close(log_segments[i].fd);
+        log_segment_count = 0;
+        log_segment_sequence = 0;
+        log_segments_pid = pid;
+    }
+    LogSegment *segment = NULL;
+    for (int i = 0; i < log_segment_count; i++) {
+        if (strcmp(log_segments[i].file_name, file_name) == 0) {
+            segment = &log_segments[i];
+            break;
+        }
+    }
+    if (segment) {
+        bool full = segment->size > (off_t)sizeof(LogSegmentHeader) && segment->size + record_bytes > LOG_SEGMENT_MAX_SIZE;
+        bool old = stats_clock() - segment->opened > LOG_SEGMENT_MAX_AGE * 1000000000ull;
+        if (!full && !old) return segment;
+        close(segment->fd);
+    } else if (log_segment_count < LOG_SEGMENTS_OPEN) {
+        segment = &log_segments[log_segment_count++];
+    } else {
+        // table full, close the segment open for the longest time
+        segment = &log_segments[0];
+        for (int i = 1; i < log_segment_count; i++) {
+            if (log_segments[i].opened < segment->opened) segment = &log_segments[i];
+        }
+        close(segment->fd);
+    }
+    if (!log_segment_create(segment, file_name)) {
+        *segment = log_segments[--log_segment_count];
+        return NULL;
+    }
+    return segment;
+}
+
+/*
+Fill in the magic and both checksums of a record header before it is written
+*/
+void log_record_seal(LogRecordHeader *header, const void *payload) {
+    header->magic = LOG_RECORD_MAGIC;
+    header->payload_crc = crc32c(0, payload, header->payload_size);
+    header->header_crc = crc32c(0, header, offsetof(LogRecordHeader, header_crc));
+}
+
+/*
+Make sure at least len bytes (no more than the capacity) are buffered from the
+current record on. Returns false at end of file. The log is read once, the
+records already returned are dropped from the page cache a buffer at a time.
+*/
+static bool log_reader_fill(LogReader *reader, size_t len) {
+    if (reader->end - reader->start >= len) return true;
+    if (reader->position - reader->dropped >= (off_t)reader->capacity) {
+        advise_read_done(reader->fd, reader->dropped, reader->position - reader->dropped);
+        reader->dropped = reader->position;
+    }
+    if (reader->start > 0) {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    while (reader->end < len) {
+        ssize_t bytes = read_fully(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end);
+        if (bytes <= 0) return false;
+        reader->end += bytes;
+    }
+    return true;
+}
+
+/*
+Start reading the log fd from its beginning, checks the segment header
+*/
+bool log_reader_open(LogReader *reader, int fd) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+    reader->capacity = LOG_READER_BUFFER_SIZE;
+    reader->buffer = malloc(reader->capacity);
+    struct stat st;
+    if (!reader->buffer || fstat(fd, &st) == -1 || lseek(fd, 0, SEEK_SET) == -1) return false;
+    reader->file_size = st.st_size;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (!log_reader_fill(reader, sizeof(LogSegmentHeader))) return false;
+    memcpy(&reader->segment, reader->buffer, sizeof(LogSegmentHeader));
+    if (reader->segment.magic != LOG_SEGMENT_MAGIC || reader->segment.version != LOG_FORMAT_VERSION ||
+        reader->segment.crc != crc32c(0, &reader->segment, offsetof(LogSegmentHeader, crc))) {
+        return false;
+    }
+    reader->start = sizeof(LogSegmentHeader);
+    reader->position = sizeof(LogSegmentHeader);
+    return true;
+}
+
+/*
+Check the payload of a record larger than the buffer a buffer at a time and
+continue after it. The payload is left in the file for log_reader_payload.
+*/
+static LogReadStatus log_reader_skip_payload(LogReader *reader, const LogRecordHeader *header) {
+    off_t payload_position = reader->position + sizeof(LogRecordHeader);
+    uint32_t crc = 0;
+    for (uint64_t done = 0; done < header->payload_size;) {
+        size_t chunk = header->payload_size - done < reader->capacity ? header->payload_size - done : reader->capacity;
+        ssize_t bytes = pread(reader->fd, reader->buffer, chunk, payload_position + done);
+        if (bytes <= 0) return LOG_READ_TRUNCATED;
+        crc = crc32c(crc, reader->buffer, bytes);
+        done += bytes;
+    }
+    if (crc != header->payload_crc) return LOG_READ_CORRUPT;
+    if (!log_reader_seek(reader, payload_position + header->payload_size)) return LOG_READ_TRUNCATED;
+    reader->payload_position = payload_position;
+    reader->records++;
+    return LOG_READ_OK;
+}
+
+/*
+Read the next record. On LOG_READ_OK payload points into the reader buffer until
+the next call, or is NULL for a record larger than the buffer, whose payload is
+read with log_reader_payload. On any other status position is the offset of the
+bad record.
+*/
+LogReadStatus log_reader_next(LogReader *reader, LogRecordHeader *header, const char **payload) {
+    if (reader->position >= reader->file_size) return LOG_READ_END;
+    if (reader->file_size - reader->position < (off_t)sizeof(LogRecordHeader)) return LOG_READ_TRUNCATED;
+    if (!log_reader_fill(reader, sizeof(LogRecordHeader))) return LOG_READ_TRUNCATED;
+
+    memcpy(header, reader->buffer + reader->start, sizeof(LogRecordHeader));
+    if (header->magic != LOG_RECORD_MAGIC || header->header_crc != crc32c(0, header, offsetof(LogRecordHeader, header_crc))) {
+        return LOG_READ_CORRUPT;
+    }
+    if (header->payload_size > (uint64_t)(reader->file_size - reader->position) - sizeof(LogRecordHeader)) {
+        return LOG_READ_TRUNCATED;
+    }
+    size_t total = sizeof(LogRecordHeader) + header->payload_size;
+    if (total > reader->capacity) {
+        *payload = NULL;
+        return log_reader_skip_payload(reader, header);
+    }
+    if (!log_reader_fill(reader, total)) return LOG_READ_TRUNCATED;
+
+    *payload = reader->buffer + reader->start + sizeof(LogRecordHeader);
+    if (header->payload_crc != crc32c(0, *payload, header->payload_size)) return LOG_READ_CORRUPT;
+    reader->start += total;
+    reader->position += total;
+    reader->records++;
+    return LOG_READ_OK;
+}
+
+/*
+Continue reading at position, which must be the offset of a record
+*/
+bool log_reader_seek(LogReader *reader, off_t position) {
+    if (lseek(reader->fd, position, SEEK_SET) == -1) return false;
+    reader->start = reader->end = 0;
+    reader->position = position;
+    return true;
+}
+
+/*
+Read len bytes at offset of the payload of the last record log_reader_next
+returned without one
+*/
+ssize_t log_reader_payload(LogReader *reader, uint64_t offset, void *buffer, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t bytes = pread(reader->fd, (char *)buffer + done, len - done, reader->payload_position + offset + done);
+        if (bytes == -1 && errno == EINTR) continue;
+        if (bytes <= 0) return bytes == -1 ? -1 : (ssize_t)done;
+        done += bytes;
+    }
+    return done;
+}
+
+void log_reader_close(LogReader *reader) {
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+const char *log_read_status_string(LogReadStatus status) {
+    const char *names[] = { "ok", "end of log", "truncated record", "checksum mismatch" };
+    return names[status];
+}
+
+/*
+Check the segment header and every record of a log, report the first bad record
+*/
+bool verify_log(const char *log_path) {
+    int fd = open(log_path, O_RDONLY);
+    if (fd == -1) {
+        log_message(LOG_ERROR, "Failed to open log file %s: %s", log_path, strerror(errno));
+        return false;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    LogReader reader;
+    if (!log_reader_open(&reader, fd)) {
+        log_message(LOG_ERROR, "%s: invalid segment header", log_path);
+        log_reader_close(&reader);
+        close(fd);
+        return false;
+    }
+    LogRecordHeader header;
+    const char *payload;
+    LogReadStatus status;
+    while ((status = log_reader_next(&reader, &header, &payload)) == LOG_READ_OK);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (status == LOG_READ_END) {
+        log_message(LOG_UPDATE, "%s: %zu records, %lld bytes verified (%.1f MB/s)", log_path, reader.records,
+                    (long long)reader.file_size, seconds > 0 ? reader.file_size / seconds / 1e6 : 0.0);
+    } else {
+        log_message(LOG_ERROR, "%s: first bad record is #%zu at byte %lld: %s", log_path, reader.records,
+                    (long long)reader.position, log_read_status_string(status));
+    }
+    log_reader_close(&reader);
+    close(fd);
+    return status == LOG_READ_END;
+}
+
+static bool verify_log_visitor(const char *log_path, void *context) {
+    bool *all_valid = context;
+    if (!verify_log(log_path)) *all_valid = false;
+    return true;
+}
+
+bool verify_all_logs() {
+    bool all_valid = true;
+    for_each_log_file("", verify_log_visitor, &all_valid);
+    return all_valid;
+}
+
+/*
+Look for a record with a valid header anywhere after position. Used to tell a
+torn tail (nothing valid follows) from corruption in the middle of a log.
+*/
+static bool log_has_valid_record_after(int fd, off_t position, off_t file_size) {
+    char *buffer = malloc(LOG_READER_BUFFER_SIZE + sizeof(LogRecordHeader));
+    if (!buffer) return true;
+    bool found = false;
+    for (off_t chunk = position + 1; !found && chunk < file_size; chunk += LOG_READER_BUFFER_SIZE) {
+        ssize_t bytes = pread(fd, buffer, LOG_READER_BUFFER_SIZE + sizeof(LogRecordHeader), chunk);
+        if (bytes <= 0) break;
+        for (ssize_t i = 0; i + (ssize_t)sizeof(LogRecordHeader) <= bytes && i < LOG_READER_BUFFER_SIZE; i++) {
+            LogRecordHeader header;
+            memcpy(&header, buffer + i, sizeof(header));
+            if (header.magic == LOG_RECORD_MAGIC && header.header_crc == crc32c(0, &header, offsetof(LogRecordHeader, header_crc))) {
+                found = true;
+                break;
+            }
+        }
+    }
+    free(buffer);
+    return found;
+}
+
+static void log_checkpoint_path(const char *log_path, char *path, size_t size) {
+    snprintf(path, size, "%s.ckpt", log_path);
+}
+
+/*
+The checkpoint remembers up to where a segment was last found valid, so the next
+recovery pass only scans what was appended since.
+*/
+static off_t log_checkpoint_load(const char *log_path, const LogSegmentHeader *segment) {
+    char path[1024];
+    log_checkpoint_path(log_path, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return 0;
+    LogCheckpoint checkpoint;
+    bool valid = read_fully(fd, &checkpoint, sizeof(checkpoint)) == sizeof(checkpoint) &&
+                 checkpoint.crc == crc32c(0, &checkpoint, offsetof(LogCheckpoint, crc)) &&
+                 checkpoint.segment_crc == segment->crc;
+    close(fd);
+    return valid ? (off_t)checkpoint.position : 0;
+}
+
+static void log_checkpoint_store(const char *log_path, const LogSegmentHeader *segment, off_t position) {
+    char path[1024], temporary[1024];
+    log_checkpoint_path(log_path, path, sizeof(path));
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    LogCheckpoint checkpoint = { (uint64_t)position, segment->crc, 0 };
+    checkpoint.crc = crc32c(0, &checkpoint, offsetof(LogCheckpoint, crc));
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) return;
+    bool written = write(fd, &checkpoint, sizeof(checkpoint)) == sizeof(checkpoint);
+    close(fd);
+    if (!written || rename(temporary, path) == -1) unlink(temporary);
+}
+
+// True when writer, another process, is still running and may be writing the log
+static bool log_writer_alive(pid_t writer) {
+    return writer > 0 && writer != getpid() && (kill(writer, 0) == 0 || errno == EPERM);
+}
+
+// Writer of a log from its logs_<pid> directory, 0 when the path does not tell
+static pid_t log_path_writer(const char *log_path) {
+    const char *end = strrchr(log_path, '/');
+    if (!end) return 0;
+    const char *start = end;
+    while (start > log_path && start[-1] != '/') start--;
+    if (end - start <= 5 || strncmp(start, "logs_", 5) != 0) return 0;
+    char *digits_end;
+    long pid = strtol(start + 5, &digits_end, 10);
+    return digits_end == end && pid > 0 ? (pid_t)pid : 0;
+}
+
+/*
+Recovery pass run before a log is merged. Scans the records appended since the last
+checkpoint; an incomplete or corrupted record with nothing valid after it is a tail
+torn by a writer that died mid-record, and is truncated away. Logs whose writer is
+still alive are left untouched. Returns false when the log is corrupted beyond its tail.
+*/
+bool recover_log(const char *log_path) {
+    int fd = open(log_path, O_RDWR);
+    if (fd == -1) {
+        log_message(LOG_ERROR, "Failed to open log file %s: %s", log_path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        log_message(LOG_ERROR, "fstat failed: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+    LogReader reader;
+    if (!log_reader_open(&reader, fd)) {
+        bool torn = st.st_size < (off_t)sizeof(LogSegmentHeader);
+        log_reader_close(&reader);
+        close(fd);
+        pid_t writer = log_path_writer(log_path);
+        if (torn && log_writer_alive(writer)) {
+            // the writer may have just created the segment and not written its header yet
+            log_message(LOG_INFO, "%s: writer %d still running, recovery skipped", log_path, writer);
+            return true;
+        }
+        if (torn) {
+            // the writer died before the segment header was complete, nothing to keep
+            log_message(LOG_UPDATE, "Recovered %s: removed segment with torn header", log_path);
+            unlink(log_path);
+            return true;
+        }
+        log_message(LOG_ERROR, "%s: invalid segment header", log_path);
+        return false;
+    }
+
+    off_t checkpoint = log_checkpoint_load(log_path, &reader.segment);
+    if (checkpoint > reader.position && checkpoint <= reader.file_size) {
+        log_reader_seek(&reader, checkpoint);
+    }
+
+    LogRecordHeader header;
+    const char *payload;
+    LogReadStatus status;
+    while ((status = log_reader_next(&reader, &header, &payload)) == LOG_READ_OK);
+
+    bool recovered = true;
+    if (status != LOG_READ_END) {
+        pid_t writer = (pid_t)reader.segment.pid;
+        if (log_writer_alive(writer)) {
+            log_message(LOG_INFO, "%s: writer %d still running, recovery skipped", log_path, writer);
+            log_reader_close(&reader);
+            close(fd);
+            return true;
+        }
+        if (status == LOG_READ_CORRUPT && log_has_valid_record_after(fd, reader.position, reader.file_size)) {
+            log_message(LOG_ERROR, "%s: corrupted record at byte %lld is not at the tail", log_path, (long long)reader.position);
+            recovered = false;
+        } else if (ftruncate(fd, reader.position) == -1) {
+            log_message(LOG_ERROR, "%s: truncation failed: %s", log_path, strerror(errno));
+            recovered = false;
+        } else {
+            log_message(LOG_UPDATE, "Recovered %s: torn tail (%s) truncated at byte %lld, %lld bytes dropped", log_path,
+                        log_read_status_string(status), (long long)reader.position, (long long)(reader.file_size - reader.position));
+        }
+    }
+    if (recovered) {
+        log_checkpoint_store(log_path, &reader.segment, reader.position);
+    }
+    log_reader_close(&reader);
+    close(fd);
+    return recovered;
+}
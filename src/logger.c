@@ -0,0 +1,444 @@
+#include "api.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <strings.h>
+
+/*
+Asynchronous logging. log_emit formats the message into a ring owned by the
+calling thread and returns; a background thread per process sleeps on a futex
+until messages arrive, drains every ring and writes them as text, JSON lines or
+binary LogEvent records. The producer side takes no lock, so writers do not
+serialize on the output. The SIGSEGV handler logs with log_signal_message, which
+formats without stdio and uses the ring and writer thread created beforehand by
+log_prepare.
+
+Configured from the environment by log_init:
+  PSAR_LOG_LEVEL   debug, info, update, error or off (default debug)
+  PSAR_LOG_FORMAT  text, json or binary (default text)
+  PSAR_LOG_FILE    file to append to (default the standard output)
+Text output is colored only when it goes to a terminal and NO_COLOR is unset.
+
+A ring is released when its thread exits and claimed again by the next thread
+logging for the first time once the writer has drained it, so the rings of a
+process are bounded by the number of its threads alive at once.
+*/
+
+typedef struct {
+    uint32_t ready; // set by the producer once the slot is filled, cleared by the writer
+    LogEvent event;
+    char text[LOG_MESSAGE_SIZE];
+} LogSlot;
+
+typedef struct LogRing {
+    uint64_t head; // next slot to fill, only moved by the owning thread
+    uint32_t pid;
+    uint32_t tid;
+    uint32_t owned; // cleared when the thread owning the ring exits
+    char head_padding[44];
+    uint64_t tail; // next slot to drain, only moved by the writer
+    uint64_t dropped;
+    char tail_padding[48];
+    struct LogRing *next;
+    LogSlot slots[LOG_RING_SLOTS];
+} LogRing;
+
+LogLevel log_threshold = LOG_DEBUG;
+
+static const char *log_level_names[] = { "DEBUG", "INFO", "UPDATE", "ERROR" };
+static const char *log_level_colors[] = { "\033[1;33m", "\033[1;34m", "\033[1;32m", "\033[1;31m" };
+
+static LogFormat log_format = LOG_FORMAT_TEXT;
+static int log_fd = STDOUT_FILENO;
+static bool log_colors = false;
+static bool log_configured = false;
+
+static LogRing *log_rings = NULL; // every ring ever created, pushed with a compare and swap
+static __thread LogRing *log_ring = NULL;
+static pthread_key_t log_ring_key; // its destructor releases the ring of an exiting thread
+
+static uint32_t log_published = 0; // futex, bumped by every message
+static uint32_t log_writer_waiting = 0;
+
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pid_t log_writer_pid = 0; // process in which the writer thread runs
+static char log_output[LOG_WRITER_BUFFER_SIZE];
+static size_t log_output_used = 0;
+
+static void log_output_flush() {
+    size_t done = 0;
+    while (done < log_output_used) {
+        ssize_t bytes = write(log_fd, log_output + done, log_output_used - done);
+        if (bytes == -1 && errno == EINTR) continue;
+        if (bytes <= 0) break;
+        done += bytes;
+    }
+    log_output_used = 0;
+}
+
+static void log_output_append(const void *data, size_t len) {
+    if (log_output_used + len > sizeof(log_output)) log_output_flush();
+    memcpy(log_output + log_output_used, data, len);
+    log_output_used += len;
+}
+
+static void log_output_printf(const char *format, ...) {
+    char line[2 * LOG_MESSAGE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len > 0) log_output_append(line, len < (int)sizeof(line) ? (size_t)len : sizeof(line) - 1);
+}
+
+static void log_output_json_string(const char *text, size_t len) {
+    log_output_append("\"", 1);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\') {
+            char escaped[2] = { '\\', (char)c };
+            log_output_append(escaped, 2);
+        } else if (c < 0x20) {
+            log_output_printf("\\u%04x", c);
+        } else {
+            log_output_append(&text[i], 1);
+        }
+    }
+    log_output_append("\"", 1);
+}
+
+static void log_output_event(const LogEvent *event, const char *text) {
+    if (log_format == LOG_FORMAT_BINARY) {
+        log_output_append(event, sizeof(*event));
+        log_output_append(text, event->length);
+        return;
+    }
+    time_t seconds = event->timestamp / 1000000000ull;
+    if (log_format == LOG_FORMAT_JSON) {
+        struct tm utc;
+        char date[32];
+        gmtime_r(&seconds, &utc);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &utc);
+        log_output_printf("{\"time\":\"%s.%09lluZ\",\"level\":\"%s\",\"pid\":%u,\"tid\":%u,\"message\":", date,
+                          (unsigned long long)(event->timestamp % 1000000000ull), log_level_names[event->level], event->pid, event->tid);
+        log_output_json_string(text, event->length);
+        log_output_append("}\n", 2);
+        return;
+    }
+    struct tm local;
+    char date[32];
+    localtime_r(&seconds, &local);
+    strftime(date, sizeof(date), "%a %b %e %H:%M:%S %Y", &local);
+    if (log_colors) {
+        log_output_printf("%s[%s] [%s]\033[0m ", log_level_colors[event->level], date, log_level_names[event->level]);
+    } else {
+        log_output_printf("[%s] [%s] ", date, log_level_names[event->level]);
+    }
+    log_output_append(text, event->length);
+    log_output_append("\n", 1);
+}
+
+/*
+Write out everything buffered in the rings, called with log_drain_lock held.
+Returns the number of messages written.
+*/
+static size_t log_drain() {
+    size_t drained = 0;
+    for (LogRing *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            char text[64];
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            LogEvent event = { (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec, ring->pid, ring->tid, LOG_ERROR, 0, 0 };
+            event.length = snprintf(text, sizeof(text), "%llu log messages dropped, ring full", (unsigned long long)dropped);
+            log_output_event(&event, text);
+        }
+        uint64_t tail = ring->tail;
+        LogSlot *slot;
+        while (__atomic_load_n(&(slot = &ring->slots[tail % LOG_RING_SLOTS])->ready, __ATOMIC_ACQUIRE)) {
+            log_output_event(&slot->event, slot->text);
+            __atomic_store_n(&slot->ready, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&ring->tail, ++tail, __ATOMIC_RELEASE);
+            drained++;
+        }
+    }
+    log_output_flush();
+    return drained;
+}
+
+void log_flush() {
+    pthread_mutex_lock(&log_drain_lock);
+    log_drain();
+    pthread_mutex_unlock(&log_drain_lock);
+}
+
+// Wake the writer thread if it sleeps, after a message was published
+static void log_wake_writer() {
+    __atomic_fetch_add(&log_published, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_writer_waiting, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &log_published, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/*
+Drain, then sleep until a message is published. The waiting flag is raised
+before the futex value is checked again, so a message published in between
+either is seen by the check or wakes the futex.
+*/
+static void *log_writer_main(void *unused) {
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    for (;;) {
+        uint32_t published = __atomic_load_n(&log_published, __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&log_drain_lock);
+        size_t drained = log_drain();
+        pthread_mutex_unlock(&log_drain_lock);
+        if (drained) continue;
+        __atomic_store_n(&log_writer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&log_published, __ATOMIC_SEQ_CST) == published) {
+            syscall(SYS_futex, &log_published, FUTEX_WAIT_PRIVATE, published, NULL, NULL, 0);
+        }
+        __atomic_store_n(&log_writer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+static void log_start_writer() {
+    pid_t pid = getpid();
+    pid_t previous = __atomic_load_n(&log_writer_pid, __ATOMIC_ACQUIRE);
+    if (previous == pid || !__atomic_compare_exchange_n(&log_writer_pid, &previous, pid, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, log_writer_main, NULL) == 0) {
+        pthread_detach(writer);
+    }
+}
+
+// Drain before forking so that the child does not print the parent's messages again
+static void log_before_fork() {
+    pthread_mutex_lock(&log_drain_lock);
+    log_drain();
+}
+
+static void log_after_fork_parent() {
+    pthread_mutex_unlock(&log_drain_lock);
+}
+
+// The writer thread is not inherited, the child starts its own right away
+static void log_after_fork_child() {
+    pthread_mutex_init(&log_drain_lock, NULL);
+    log_writer_waiting = 0;
+    // only the forking thread exists in the child, the rings of the others are free
+    for (LogRing *ring = log_rings; ring; ring = ring->next) {
+        if (ring != log_ring) ring->owned = 0;
+    }
+    if (log_ring) log_ring->pid = getpid();
+    log_start_writer();
+}
+
+static void log_ring_release(void *ring) {
+    log_ring = NULL;
+    __atomic_store_n(&((LogRing *)ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+// A released ring the writer has drained, claimed for the calling thread
+static LogRing *log_ring_claim() {
+    for (LogRing *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        uint32_t owned = 0;
+        if (__atomic_load_n(&ring->owned, __ATOMIC_ACQUIRE) || __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head ||
+            __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&ring->owned, &owned, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return ring;
+    }
+    return NULL;
+}
+
+static LogRing *log_ring_create() {
+    LogRing *ring = log_ring_claim();
+    if (!ring) {
+        ring = mmap(NULL, sizeof(LogRing), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) return NULL;
+        ring->owned = 1;
+        ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    ring->pid = getpid();
+    ring->tid = (uint32_t)syscall(SYS_gettid);
+    log_ring = ring;
+    pthread_setspecific(log_ring_key, ring);
+    return ring;
+}
+
+static LogLevel log_parse_level(const char *name) {
+    for (int level = LOG_DEBUG; level < LOG_OFF; level++) {
+        if (strcasecmp(name, log_level_names[level]) == 0) return level;
+    }
+    return strcasecmp(name, "off") == 0 ? LOG_OFF : LOG_DEBUG;
+}
+
+/*
+Read the logging configuration from the environment and start the writer thread.
+Called early by main, and by the first message of processes that did not.
+*/
+void log_init() {
+    if (!log_configured) {
+        log_configured = true;
+        const char *level = getenv("PSAR_LOG_LEVEL");
+        const char *format = getenv("PSAR_LOG_FORMAT");
+        const char *file = getenv("PSAR_LOG_FILE");
+        if (level) log_threshold = log_parse_level(level);
+        if (format && strcmp(format, "json") == 0) log_format = LOG_FORMAT_JSON;
+        if (format && strcmp(format, "binary") == 0) log_format = LOG_FORMAT_BINARY;
+        if (file) {
+            int fd = open(file, O_WRONLY | O_CREAT | O_APPEND, FILE_PERMISSIONS);
+            if (fd != -1) log_fd = fd;
+        }
+        log_colors = log_format == LOG_FORMAT_TEXT && isatty(log_fd) && !getenv("NO_COLOR");
+        pthread_key_create(&log_ring_key, log_ring_release);
+        pthread_atfork(log_before_fork, log_after_fork_parent, log_after_fork_child);
+        atexit(log_flush);
+    }
+    log_start_writer();
+}
+
+/*
+Configure logging, create the ring of the calling thread and start the writer
+now, before a signal handler running on this thread (or on the thread of a
+forked child) may log with log_signal_message
+*/
+void log_prepare() {
+    if (!log_configured) log_init();
+    if (!log_ring) log_ring_create();
+    log_start_writer();
+}
+
+// Reserve the next slot of ring, NULL (counted as dropped) when the ring is full
+static LogSlot *log_reserve(LogRing *ring, uint64_t *position) {
+    // a signal handler logging between the load and the swap takes the next slot
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    do {
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            log_wake_writer();
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&ring->head, &head, head + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    *position = head;
+    return &ring->slots[head % LOG_RING_SLOTS];
+}
+
+static void log_publish(LogRing *ring, LogSlot *slot, LogLevel level, int len) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (len < 0) len = 0;
+    if (len >= LOG_MESSAGE_SIZE) len = LOG_MESSAGE_SIZE - 1;
+    while (len > 0 && slot->text[len - 1] == '\n') len--;
+    LogEvent event = { (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec, ring->pid, ring->tid, level, (uint16_t)len, 0 };
+    slot->event = event;
+    __atomic_store_n(&slot->ready, 1, __ATOMIC_RELEASE);
+    log_wake_writer();
+}
+
+void log_emit(LogLevel level, const char* format, ...) {
+    if (!log_configured) log_init();
+    if (level < log_threshold || level >= LOG_OFF) return;
+    LogRing *ring = log_ring ? log_ring : log_ring_create();
+    if (!ring) return;
+    if (__atomic_load_n(&log_writer_pid, __ATOMIC_RELAXED) != (pid_t)ring->pid) log_start_writer();
+
+    uint64_t position;
+    LogSlot *slot = log_reserve(ring, &position);
+    if (!slot) return;
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(slot->text, LOG_MESSAGE_SIZE, format, args);
+    va_end(args);
+    log_publish(ring, slot, level, len);
+
+    // errors are often followed by _exit, write them out now unless the writer is busy
+    if (level == LOG_ERROR && pthread_mutex_trylock(&log_drain_lock) == 0) {
+        log_drain();
+        pthread_mutex_unlock(&log_drain_lock);
+    }
+}
+
+// Append the decimal digits of value at text + len, returns the new length
+static size_t log_safe_unsigned(char *text, size_t len, size_t size, unsigned long long value, unsigned base) {
+    char digits[24];
+    int count = 0;
+    do {
+        digits[count++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value);
+    while (count > 0 && len < size) text[len++] = digits[--count];
+    return len;
+}
+
+/*
+Format into text without stdio, so that it can run in a signal handler: %d, %u,
+%zu, %llu, %p, %s and %% only, other conversions are copied as they are
+*/
+static size_t log_safe_format(char *text, size_t size, const char *format, va_list args) {
+    size_t len = 0;
+    for (const char *c = format; *c && len < size; c++) {
+        if (*c != '%') {
+            text[len++] = *c;
+            continue;
+        }
+        c++;
+        if (*c == 'd') {
+            int value = va_arg(args, int);
+            if (value < 0 && len < size) text[len++] = '-';
+            len = log_safe_unsigned(text, len, size, value < 0 ? -(unsigned long long)value : (unsigned long long)value, 10);
+        } else if (*c == 'u') {
+            len = log_safe_unsigned(text, len, size, va_arg(args, unsigned), 10);
+        } else if (c[0] == 'z' && c[1] == 'u') {
+            len = log_safe_unsigned(text, len, size, va_arg(args, size_t), 10);
+            c++;
+        } else if (c[0] == 'l' && c[1] == 'l' && c[2] == 'u') {
+            len = log_safe_unsigned(text, len, size, va_arg(args, unsigned long long), 10);
+            c += 2;
+        } else if (*c == 'p') {
+            if (len + 2 <= size) {
+                text[len++] = '0';
+                text[len++] = 'x';
+            }
+            len = log_safe_unsigned(text, len, size, (uintptr_t)va_arg(args, void *), 16);
+        } else if (*c == 's') {
+            for (const char *string = va_arg(args, const char *); string && *string && len < size; string++) text[len++] = *string;
+        } else if (*c == '%') {
+            text[len++] = '%';
+        } else {
+            if (!*c) break;
+            text[len++] = '%';
+            if (len < size) text[len++] = *c;
+        }
+    }
+    return len;
+}
+
+/*
+log_emit for signal handlers: async-signal-safe, with the formats of
+log_safe_format. The message is dropped when the thread has no ring or the
+process no writer yet (see log_prepare). An error is usually followed by _exit,
+so the handler waits, a bounded time, until the writer has drained it.
+*/
+void log_emit_signal(LogLevel level, const char *format, ...) {
+    LogRing *ring = log_ring;
+    if (!ring || level < log_threshold || level >= LOG_OFF || __atomic_load_n(&log_writer_pid, __ATOMIC_RELAXED) != (pid_t)ring->pid) return;
+    uint64_t position;
+    LogSlot *slot = log_reserve(ring, &position);
+    if (!slot) return;
+    va_list args;
+    va_start(args, format);
+    size_t len = log_safe_format(slot->text, LOG_MESSAGE_SIZE - 1, format, args);
+    va_end(args);
+    log_publish(ring, slot, level, (int)len);
+    for (int wait = 0; level == LOG_ERROR && wait < LOG_SIGNAL_DRAIN_WAIT_MS && __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) <= position; wait++) {
+        struct timespec pause = { 0, 1000000 };
+        nanosleep(&pause, NULL);
+    }
+}
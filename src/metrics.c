@@ -0,0 +1,222 @@
+#include "api.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef enum { METRIC_COUNTER, METRIC_GAUGE } MetricType;
+
+typedef struct {
+    const char *name;
+    MetricType type;
+    const char *help;
+} MetricDescription;
+
+static const MetricDescription metric_descriptions[METRIC_COUNT] = {
+    { "psar_faults_handled_total", METRIC_COUNTER, "Write faults caught by the SIGSEGV handler" },
+    { "psar_pages_privatized_total", METRIC_COUNTER, "Pages remapped to a private copy by the SIGSEGV handler" },
+    { "psar_log_records_written_total", METRIC_COUNTER, "Log records appended by the writers" },
+    { "psar_log_bytes_written_total", METRIC_COUNTER, "Bytes appended to the logs, headers included" },
+    { "psar_records_merged_total", METRIC_COUNTER, "Log records applied by merge and merge_all" },
+    { "psar_merge_conflicts_total", METRIC_COUNTER, "Records of merge_all overwriting a page written by another log" },
+    { "psar_writers_active", METRIC_GAUGE, "Writer processes currently running" },
+    { "psar_resolve_cache_hits_total", METRIC_COUNTER, "Page table walks reusing the cached upper levels" },
+    { "psar_resolve_cache_misses_total", METRIC_COUNTER, "Page table walks reading every level" },
+    { "psar_pages_released_total", METRIC_COUNTER, "Privatized pages given their original PTE back when their mapping was released" },
+    { "psar_dirty_pages_logged_total", METRIC_COUNTER, "Pages found written by dirty tracking and logged" },
+    { "psar_windows_mapped", METRIC_GAUGE, "File windows currently mapped by the writers" },
+    { "psar_window_evictions_total", METRIC_COUNTER, "Least recently used windows unmapped to stay within the window budget" },
+    { "psar_pages_release_skipped_total", METRIC_COUNTER, "Privatized pages left alone on release because their PTE could not be resolved" },
+};
+
+static const MetricDescription histogram_descriptions[METRIC_HISTOGRAM_COUNT] = {
+    { .name = "psar_merge_duration_seconds", .help = "Duration of merge and merge_all calls" },
+};
+
+// Upper bounds of the exported histogram buckets, in seconds
+static const double histogram_bounds[] = { 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1, 10 };
+
+static MetricsRegistry *metrics_registry = NULL;
+static bool metrics_unavailable = false;
+
+/*
+Map the registry. Called by initialize_cow_engine before the writers are forked
+so that they inherit the mapping, and on first use by any other process.
+*/
+bool metrics_init() {
+    if (metrics_registry) return true;
+    if (metrics_unavailable || !ensure_directory_exists(STATS_FOLDER)) {
+        metrics_unavailable = true;
+        return false;
+    }
+    int fd = open(METRICS_FILE, O_RDWR | O_CREAT, FILE_PERMISSIONS);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 ||
+        ((size_t)st.st_size < sizeof(MetricsRegistry) && ftruncate(fd, sizeof(MetricsRegistry)) == -1)) {
+        log_message(LOG_ERROR, "Failed to open metrics registry %s: %s", METRICS_FILE, strerror(errno));
+        if (fd != -1) close(fd);
+        metrics_unavailable = true;
+        return false;
+    }
+    MetricsRegistry *registry = mmap(NULL, sizeof(MetricsRegistry), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (registry == MAP_FAILED) {
+        log_message(LOG_ERROR, "mmap failed: %s", strerror(errno));
+        metrics_unavailable = true;
+        return false;
+    }
+    // a registry left by a build with other metrics is started over rather than misread
+    if (registry->magic != METRICS_MAGIC || registry->version != METRICS_VERSION || registry->size != sizeof(MetricsRegistry)) {
+        memset(registry, 0, sizeof(MetricsRegistry));
+        registry->version = METRICS_VERSION;
+        registry->size = sizeof(MetricsRegistry);
+        __atomic_store_n(&registry->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+    }
+    metrics_registry = registry;
+    return true;
+}
+
+void metrics_add(Metric metric, int64_t delta) {
+    if (metrics_init()) {
+        __atomic_fetch_add(&metrics_registry->values[metric], delta, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_observe(MetricHistogram histogram, uint64_t nanoseconds) {
+    if (metrics_init()) {
+        stats_histogram_record(&metrics_registry->histograms[histogram], nanoseconds);
+    }
+}
+
+/*
+The psar_writers_active gauge counts registered writers rather than adding and
+subtracting, so that a writer killed before it was unregistered (or with its
+parent) stops counting once it is gone
+*/
+void metrics_writer_started(pid_t pid) {
+    if (!metrics_init()) return;
+    for (int i = 0; i < METRICS_WRITER_SLOTS; i++) {
+        int32_t free_slot = 0;
+        if (__atomic_compare_exchange_n(&metrics_registry->writers[i], &free_slot, pid, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+    }
+    log_message(LOG_DEBUG, "Writer %d not counted, %d writers registered already", pid, METRICS_WRITER_SLOTS);
+}
+
+void metrics_writer_stopped(pid_t pid) {
+    if (!metrics_init()) return;
+    for (int i = 0; i < METRICS_WRITER_SLOTS; i++) {
+        int32_t registered = pid;
+        if (__atomic_compare_exchange_n(&metrics_registry->writers[i], &registered, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+    }
+}
+
+// Registered writers still running, the slots of the others are freed
+static int64_t metrics_writers_active() {
+    int64_t active = 0;
+    for (int i = 0; i < METRICS_WRITER_SLOTS; i++) {
+        int32_t pid = __atomic_load_n(&metrics_registry->writers[i], __ATOMIC_RELAXED);
+        if (!pid) continue;
+        if (kill(pid, 0) == -1 && errno == ESRCH) {
+            __atomic_compare_exchange_n(&metrics_registry->writers[i], &pid, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        } else {
+            active++;
+        }
+    }
+    return active;
+}
+
+/*
+Write every metric in the Prometheus text exposition format
+*/
+void metrics_render(FILE *out) {
+    if (!metrics_init()) return;
+    __atomic_store_n(&metrics_registry->values[METRIC_WRITERS_ACTIVE], metrics_writers_active(), __ATOMIC_RELAXED);
+    for (int metric = 0; metric < METRIC_COUNT; metric++) {
+        const MetricDescription *description = &metric_descriptions[metric];
+        fprintf(out, "# HELP %s %s\n", description->name, description->help);
+        fprintf(out, "# TYPE %s %s\n", description->name, description->type == METRIC_COUNTER ? "counter" : "gauge");
+        fprintf(out, "%s %lld\n", description->name,
+                (long long)__atomic_load_n(&metrics_registry->values[metric], __ATOMIC_RELAXED));
+    }
+    for (int histogram = 0; histogram < METRIC_HISTOGRAM_COUNT; histogram++) {
+        const char *name = histogram_descriptions[histogram].name;
+        const StatsHistogram *values = &metrics_registry->histograms[histogram];
+        uint64_t count = __atomic_load_n(&values->count, __ATOMIC_ACQUIRE);
+        fprintf(out, "# HELP %s %s\n", name, histogram_descriptions[histogram].help);
+        fprintf(out, "# TYPE %s histogram\n", name);
+        for (size_t i = 0; i < sizeof(histogram_bounds) / sizeof(histogram_bounds[0]); i++) {
+            uint64_t below = stats_histogram_count_below(values, (uint64_t)(histogram_bounds[i] * 1e9));
+            fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", name, histogram_bounds[i], (unsigned long long)(below < count ? below : count));
+        }
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)count);
+        fprintf(out, "%s_sum %.9f\n", name, values->sum / 1e9);
+        fprintf(out, "%s_count %llu\n", name, (unsigned long long)count);
+    }
+}
+
+/*
+Serve the metrics on a Unix stream socket, one exposition per connection, until
+the process is interrupted
+*/
+static bool metrics_serve(const char *socket_path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        log_message(LOG_ERROR, "Socket path too long: %s", socket_path);
+        return false;
+    }
+    strcpy(address.sun_path, socket_path);
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (server == -1 || bind(server, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(server, 8) == -1) {
+        log_message(LOG_ERROR, "Failed to listen on %s: %s", socket_path, strerror(errno));
+        if (server != -1) close(server);
+        return false;
+    }
+    log_message(LOG_UPDATE, "Serving metrics on unix:%s", socket_path);
+    for (;;) {
+        int client = accept(server, NULL, NULL);
+        if (client == -1) {
+            if (errno == EINTR) continue;
+            log_message(LOG_ERROR, "accept failed: %s", strerror(errno));
+            break;
+        }
+        FILE *out = fdopen(client, "w");
+        if (!out) {
+            close(client);
+            continue;
+        }
+        metrics_render(out);
+        fclose(out);
+    }
+    close(server);
+    unlink(socket_path);
+    return false;
+}
+
+/*
+Export the metrics to target: "-" for the standard output, "unix:<path>" to serve
+them on a local socket, any other value is a file replaced atomically so that a
+scraper never reads it half written.
+*/
+bool metrics_export(const char *target) {
+    if (!metrics_init()) return false;
+    if (strcmp(target, "-") == 0) {
+        metrics_render(stdout);
+        return true;
+    }
+    if (strncmp(target, "unix:", 5) == 0) {
+        return metrics_serve(target + 5);
+    }
+    char temporary_path[FILE_NAME_SIZE * 2];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", target);
+    FILE *out = fopen(temporary_path, "w");
+    if (!out) {
+        log_message(LOG_ERROR, "Failed to open %s: %s", temporary_path, strerror(errno));
+        return false;
+    }
+    metrics_render(out);
+    if (fclose(out) != 0 || rename(temporary_path, target) == -1) {
+        log_message(LOG_ERROR, "Failed to write metrics to %s: %s", target, strerror(errno));
+        unlink(temporary_path);
+        return false;
+    }
+    return true;
+}
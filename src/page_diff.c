@@ -0,0 +1,180 @@
+#include "api.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PAGE_DIFF_X86 1
+#endif
+
+#define PAGE_DIFF_BLOCK 64
+
+/*
+Runs are built from the differing segments found in each 64 byte block.
+A segment closer than min_gap to the current run extends it, otherwise the
+current run is stored and a new one starts. A run is only stored once it is
+closed, so when the array is full the caller can resume right after the last run.
+*/
+typedef struct {
+    DiffRun *runs;
+    size_t max_runs;
+    size_t count;
+    size_t min_gap;
+    bool open;
+    size_t start, end;
+} PageDiffState;
+
+static inline __attribute__((always_inline)) bool page_diff_add(PageDiffState *state, size_t start, size_t end) {
+    if (state->open && (start == state->end || start - state->end < state->min_gap)) {
+        state->end = end;
+        return true;
+    }
+    if (state->open) {
+        state->runs[state->count].offset = state->start;
+        state->runs[state->count].length = state->end - state->start;
+        if (++state->count == state->max_runs) {
+            state->open = false;
+            return false;
+        }
+    }
+    state->open = true;
+    state->start = start;
+    state->end = end;
+    return true;
+}
+
+static inline __attribute__((always_inline)) bool page_diff_add_mask(PageDiffState *state, size_t base, uint64_t mask) {
+    while (mask) {
+        unsigned first = __builtin_ctzll(mask);
+        uint64_t rest = ~(mask >> first);
+        unsigned length = rest ? __builtin_ctzll(rest) : 64 - first;
+        if (!page_diff_add(state, base + first, base + first + length)) return false;
+        mask = first + length >= 64 ? 0 : mask & (~0ull << (first + length));
+    }
+    return true;
+}
+
+static inline __attribute__((always_inline)) size_t page_diff_finish(PageDiffState *state) {
+    if (state->open) {
+        state->runs[state->count].offset = state->start;
+        state->runs[state->count].length = state->end - state->start;
+        state->count++;
+    }
+    return state->count;
+}
+
+static uint64_t page_diff_tail_mask(const char *a, const char *b, size_t len) {
+    uint64_t mask = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (a[i] != b[i]) mask |= 1ull << i;
+    }
+    return mask;
+}
+
+static inline __attribute__((always_inline)) uint64_t page_diff_block_scalar(const char *a, const char *b) {
+    uint64_t mask = 0;
+    for (int word = 0; word < PAGE_DIFF_BLOCK / 8; word++) {
+        uint64_t x, y;
+        memcpy(&x, a + word * 8, 8);
+        memcpy(&y, b + word * 8, 8);
+        uint64_t diff = x ^ y;
+        if (!diff) continue;
+        for (int byte = 0; byte < 8; byte++) {
+            if ((diff >> (byte * 8)) & 0xff) mask |= 1ull << (word * 8 + byte);
+        }
+    }
+    return mask;
+}
+
+/*
+Shared body of every kernel, block_mask returns one bit per differing byte of a
+64 byte block and is inlined into each target specific copy.
+*/
+#define PAGE_DIFF_KERNEL(name, attributes, block_mask)                                       \
+    attributes size_t name(const char *a, const char *b, size_t len, size_t min_gap,        \
+                           DiffRun *runs, size_t max_runs) {                                 \
+        PageDiffState state = { runs, max_runs, 0, min_gap, false, 0, 0 };                   \
+        if (!max_runs) return 0;                                                             \
+        size_t pos = 0;                                                                      \
+        for (; pos + PAGE_DIFF_BLOCK <= len; pos += PAGE_DIFF_BLOCK) {                       \
+            uint64_t mask = block_mask(a + pos, b + pos);                                    \
+            if (mask && !page_diff_add_mask(&state, pos, mask)) return state.count;          \
+        }                                                                                    \
+        if (pos < len) {                                                                     \
+            uint64_t mask = page_diff_tail_mask(a + pos, b + pos, len - pos);                \
+            if (!page_diff_add_mask(&state, pos, mask)) return state.count;                  \
+        }                                                                                    \
+        return page_diff_finish(&state);                                                     \
+    }
+
+PAGE_DIFF_KERNEL(page_diff_scalar, static, page_diff_block_scalar)
+
+#if PAGE_DIFF_X86
+__attribute__((target("sse2"))) static inline __attribute__((always_inline)) uint64_t page_diff_block_sse2(const char *a, const char *b) {
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i * 16));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i * 16));
+        uint64_t equal = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+        mask |= (~equal & 0xffff) << (i * 16);
+    }
+    return mask;
+}
+
+__attribute__((target("avx2"))) static inline __attribute__((always_inline)) uint64_t page_diff_block_avx2(const char *a, const char *b) {
+    __m256i x0 = _mm256_loadu_si256((const __m256i *)a);
+    __m256i y0 = _mm256_loadu_si256((const __m256i *)b);
+    __m256i x1 = _mm256_loadu_si256((const __m256i *)(a + 32));
+    __m256i y1 = _mm256_loadu_si256((const __m256i *)(b + 32));
+    uint64_t low = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, y0));
+    uint64_t high = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x1, y1));
+    return ~(low | (high << 32));
+}
+
+__attribute__((target("avx512f,avx512bw"))) static inline __attribute__((always_inline)) uint64_t page_diff_block_avx512(const char *a, const char *b) {
+    __m512i x = _mm512_loadu_si512((const void *)a);
+    __m512i y = _mm512_loadu_si512((const void *)b);
+    return _mm512_cmpneq_epi8_mask(x, y);
+}
+
+PAGE_DIFF_KERNEL(page_diff_sse2, __attribute__((target("sse2"))) static, page_diff_block_sse2)
+PAGE_DIFF_KERNEL(page_diff_avx2, __attribute__((target("avx2"))) static, page_diff_block_avx2)
+PAGE_DIFF_KERNEL(page_diff_avx512, __attribute__((target("avx512f,avx512bw"))) static, page_diff_block_avx512)
+#endif
+
+/*
+Return the kernel for an instruction set ("scalar", "sse2", "avx2", "avx512"),
+NULL if the CPU does not support it. isa NULL picks the best supported one.
+*/
+PageDiffFn page_diff_kernel(const char *isa) {
+#if PAGE_DIFF_X86
+    __builtin_cpu_init();
+    bool any = isa == NULL;
+    if ((any || strcmp(isa, "avx512") == 0) && __builtin_cpu_supports("avx512bw")) return page_diff_avx512;
+    if ((any || strcmp(isa, "avx2") == 0) && __builtin_cpu_supports("avx2")) return page_diff_avx2;
+    if ((any || strcmp(isa, "sse2") == 0) && __builtin_cpu_supports("sse2")) return page_diff_sse2;
+    if (any) return page_diff_scalar;
+#else
+    if (isa == NULL) return page_diff_scalar;
+#endif
+    return strcmp(isa, "scalar") == 0 ? page_diff_scalar : NULL;
+}
+
+const char *page_diff_isa() {
+    PageDiffFn best = page_diff_kernel(NULL);
+#if PAGE_DIFF_X86
+    if (best == page_diff_avx512) return "avx512";
+    if (best == page_diff_avx2) return "avx2";
+    if (best == page_diff_sse2) return "sse2";
+#endif
+    return "scalar";
+}
+
+/*
+Find the byte runs where a and b differ, runs separated by fewer than min_gap equal
+bytes are reported as one. Returns the number of runs stored; when it equals
+max_runs the scan stopped early and can be resumed after the last run.
+*/
+size_t page_diff(const char *a, const char *b, size_t len, size_t min_gap, DiffRun *runs, size_t max_runs) {
+    static PageDiffFn kernel = NULL;
+    if (!kernel) kernel = page_diff_kernel(NULL);
+    return kernel(a, b, len, min_gap, runs, max_runs);
+}
@@ -0,0 +1,283 @@
+#include "api.h"
+
+/*
+Writer pool: instead of forking a process per run that maps every file, writes
+once and exits, workers stay alive and take modification tasks from a lock-free
+queue in shared memory, and send a TaskCompletion back on a second one. Each
+worker keeps its mappings (or its windows with PSAR_WINDOW_SIZE set), and the
+pages it already privatized, from one task to the next. A coordinator waiting on
+completions checks every POOL_LIVENESS_CHECK_MS that its workers are alive, the
+tasks lost with a dead worker fail instead of being waited for forever.
+*/
+
+typedef struct {
+    char file_name[FILE_NAME_SIZE];
+    int fd;
+    char *region;
+    size_t size;
+} PoolMapping;
+
+static PoolMapping pool_mappings[POOL_MAPPINGS];
+static int pool_mapping_count = 0;
+
+// Mapping of file_name in this worker, created read only on first use
+static PoolMapping *pool_mapping(const char *file_name) {
+    for (int i = 0; i < pool_mapping_count; i++) {
+        if (strcmp(pool_mappings[i].file_name, file_name) == 0) return &pool_mappings[i];
+    }
+    if (pool_mapping_count == POOL_MAPPINGS) {
+        log_message(LOG_ERROR, "Worker %d maps too many files, %s skipped", getpid(), file_name);
+        return NULL;
+    }
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        log_message(LOG_ERROR, "open failed for %s: %s", file_name, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        log_message(LOG_ERROR, "Cannot map %s", file_name);
+        close(fd);
+        return NULL;
+    }
+    char *region = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+        log_message(LOG_ERROR, "mmap failed: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    advise_mapping(region, st.st_size, fd, 0);
+    PoolMapping *mapping = &pool_mappings[pool_mapping_count++];
+    snprintf(mapping->file_name, sizeof(mapping->file_name), "%s", file_name);
+    mapping->fd = fd;
+    mapping->region = region;
+    mapping->size = st.st_size;
+    return mapping;
+}
+
+static void pool_release_mappings() {
+    for (int i = 0; i < pool_mapping_count; i++) {
+        zero_copy_flush(pool_mappings[i].region);
+        delta_snapshot_release(pool_mappings[i].region, pool_mappings[i].size);
+        unmap_file_region(pool_mappings[i].region, pool_mappings[i].size);
+        close(pool_mappings[i].fd);
+    }
+    pool_mapping_count = 0;
+    windows_release();
+}
+
+static void pool_worker(WriterPool *pool, int index) {
+    log_message(LOG_UPDATE, "Worker %d started", getpid());
+    WriteTask task;
+    uint64_t tasks = 0;
+    while (mpmc_queue_pop(pool->tasks, &task)) {
+        __atomic_store_n(&pool->running[index], task.id + 1, __ATOMIC_RELEASE);
+        bool success;
+        if (psar_config.window_size) {
+            success = windowed_write(task.file_name, task.offset, task.data, task.len);
+        } else {
+            PoolMapping *mapping = pool_mapping(task.file_name);
+            success = mapping && log_and_write_memory_region(mapping->region, task.offset, task.data, task.len, mapping->size, task.file_name);
+        }
+        // a task is acknowledged once its zero copy pages are in the log, not when the worker exits
+        if (success && zero_copy_enabled()) success = zero_copy_flush(NULL);
+        TaskCompletion completion = { task.id, getpid(), success };
+        mpmc_queue_push(pool->completions, &completion);
+        tasks++;
+    }
+    pool_release_mappings();
+    log_message(LOG_UPDATE, "Worker %d stopped after %llu tasks", getpid(), (unsigned long long)tasks);
+    exit(EXIT_SUCCESS);
+}
+
+/*
+Create the shared queues and fork the workers. initialize_cow_engine must have
+been called, the workers inherit the signal handler and PTEditor from it.
+*/
+bool writer_pool_start(WriterPool *pool, int workers) {
+    memset(pool, 0, sizeof(*pool));
+    pool->pids = calloc(workers, sizeof(pid_t));
+    pool->last_completed = calloc(workers, sizeof(uint64_t));
+    pool->running = mmap(NULL, workers * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    pool->tasks = mpmc_queue_create(POOL_QUEUE_CAPACITY, sizeof(WriteTask));
+    pool->completions = mpmc_queue_create(POOL_QUEUE_CAPACITY, sizeof(TaskCompletion));
+    if (!pool->pids || !pool->last_completed || pool->running == MAP_FAILED || !pool->tasks || !pool->completions) {
+        log_message(LOG_ERROR, "Failed to allocate the writer pool");
+        if (pool->tasks) mpmc_queue_destroy(pool->tasks);
+        if (pool->completions) mpmc_queue_destroy(pool->completions);
+        if (pool->running != MAP_FAILED) munmap(pool->running, workers * sizeof(uint64_t));
+        free(pool->pids);
+        free(pool->last_completed);
+        return false;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            log_message(LOG_ERROR, "fork failed: %s", strerror(errno));
+            writer_pool_stop(pool);
+            return false;
+        }
+        if (pid == 0) {
+            pool_worker(pool, i);
+        }
+        pool->pids[pool->workers++] = pid;
+        pool->alive++;
+        metrics_writer_started(pid);
+    }
+    return true;
+}
+
+static void writer_pool_complete(WriterPool *pool, const TaskCompletion *completion) {
+    for (int i = 0; i < pool->workers; i++) {
+        if (pool->pids[i] == completion->pid) pool->last_completed[i] = completion->id + 1;
+    }
+    pool->outstanding--;
+    if (!completion->success) {
+        log_message(LOG_ERROR, "Task %llu failed in worker %d", (unsigned long long)completion->id, completion->pid);
+        pool->failed++;
+    }
+}
+
+/*
+Reap the workers that died. The task a dead worker was running fails unless its
+completion was collected (a worker killed between taking a task and recording it
+is only noticed once no worker is left), and so does every outstanding task once
+no worker is left to run it.
+*/
+static void writer_pool_check_workers(WriterPool *pool) {
+    for (int i = 0; i < pool->workers; i++) {
+        int status;
+        if (!pool->pids[i] || waitpid(pool->pids[i], &status, WNOHANG) != pool->pids[i]) continue;
+        log_message(LOG_ERROR, "Worker %d died (%s %d)", pool->pids[i], WIFSIGNALED(status) ? "signal" : "status",
+                    WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+        // the completions it pushed before dying
+        TaskCompletion completion;
+        while (mpmc_queue_try_pop(pool->completions, &completion)) {
+            writer_pool_complete(pool, &completion);
+        }
+        uint64_t running = __atomic_load_n(&pool->running[i], __ATOMIC_ACQUIRE);
+        if (running && running != pool->last_completed[i] && pool->outstanding > 0) {
+            log_message(LOG_ERROR, "Task %llu lost with worker %d", (unsigned long long)(running - 1), pool->pids[i]);
+            pool->outstanding--;
+            pool->failed++;
+        }
+        metrics_writer_stopped(pool->pids[i]);
+        pool->pids[i] = 0;
+        pool->alive--;
+    }
+    if (pool->alive == 0 && pool->outstanding > 0) {
+        log_message(LOG_ERROR, "%llu tasks lost, no worker is left", (unsigned long long)pool->outstanding);
+        pool->failed += pool->outstanding;
+        pool->outstanding = 0;
+    }
+}
+
+// Collect one completion, or give up on the tasks of the workers found dead meanwhile
+static void writer_pool_collect(WriterPool *pool) {
+    TaskCompletion completion;
+    if (mpmc_queue_pop_timed(pool->completions, &completion, POOL_LIVENESS_CHECK_MS)) {
+        writer_pool_complete(pool, &completion);
+    } else {
+        writer_pool_check_workers(pool);
+    }
+}
+
+/*
+Queue a modification of len bytes at offset of file_name, blocks while the
+queue is full. No more than POOL_QUEUE_CAPACITY completions are left uncollected,
+so workers never block on a full completion queue while we block on them.
+*/
+bool writer_pool_submit(WriterPool *pool, const char *file_name, off_t offset, const char *data, size_t len) {
+    if (len > POOL_TASK_DATA_SIZE || strlen(file_name) >= FILE_NAME_SIZE) {
+        log_message(LOG_ERROR, "Task too large for the writer pool");
+        return false;
+    }
+    WriteTask task;
+    task.id = pool->next_id++;
+    snprintf(task.file_name, sizeof(task.file_name), "%s", file_name);
+    task.offset = offset;
+    task.len = len;
+    memcpy(task.data, data, len);
+    while (pool->outstanding >= POOL_QUEUE_CAPACITY) {
+        writer_pool_collect(pool);
+    }
+    if (pool->alive == 0) {
+        log_message(LOG_ERROR, "No worker is left in the writer pool");
+        return false;
+    }
+    if (!mpmc_queue_push(pool->tasks, &task)) return false;
+    pool->outstanding++;
+    return true;
+}
+
+/*
+Wait until every submitted task has been executed, returns false if any failed
+since the previous wait
+*/
+bool writer_pool_wait(WriterPool *pool) {
+    while (pool->outstanding > 0) {
+        writer_pool_collect(pool);
+    }
+    bool success = pool->failed == 0;
+    pool->failed = 0;
+    return success;
+}
+
+/*
+Let the workers finish the queued tasks, then stop them and free the pool
+*/
+bool writer_pool_stop(WriterPool *pool) {
+    bool all_success = writer_pool_wait(pool);
+    mpmc_queue_close(pool->tasks);
+
+    for (int i = 0; i < pool->workers; i++) {
+        int status;
+        if (!pool->pids[i]) {
+            all_success = false; // died earlier
+            continue;
+        }
+        waitpid(pool->pids[i], &status, 0);
+        metrics_writer_stopped(pool->pids[i]);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            log_message(LOG_ERROR, "Worker %d did not exit successfully", pool->pids[i]);
+            all_success = false;
+        }
+    }
+    mpmc_queue_destroy(pool->tasks);
+    mpmc_queue_destroy(pool->completions);
+    munmap(pool->running, pool->workers * sizeof(uint64_t));
+    free(pool->pids);
+    free(pool->last_completed);
+    pool->workers = 0;
+    return all_success;
+}
+
+/*
+Pool counterpart of start_file_write_processes: NUMBER_OF_PROCESSES workers
+apply the demo modification to every test file, rounds times, without being
+restarted between rounds
+*/
+bool start_file_write_pool(int rounds) {
+    if (!initialize_cow_engine()) {
+        return false;
+    }
+    WriterPool pool;
+    if (!writer_pool_start(&pool, NUMBER_OF_PROCESSES)) {
+        cleanup_cow_engine();
+        return false;
+    }
+    bool all_success = true;
+    char file_name[FILE_NAME_SIZE];
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < NUMBER_OF_FILES; i++) {
+            snprintf(file_name, FILE_NAME_SIZE, "%s/file%d", TEST_FILE_FOLDER, i);
+            all_success = writer_pool_submit(&pool, file_name, WRITE_OFFSET, WRITE_DEMO, strlen(WRITE_DEMO)) && all_success;
+        }
+        all_success = writer_pool_wait(&pool) && all_success;
+    }
+    log_message(LOG_UPDATE, "Writer pool ran %d rounds over %d files", rounds, NUMBER_OF_FILES);
+    all_success = writer_pool_stop(&pool) && all_success;
+    cleanup_cow_engine();
+    return all_success;
+}
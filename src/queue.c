@@ -0,0 +1,172 @@
+#include "api.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/*
+Every cell starts with a sequence number telling whose turn it is: equal to the
+position for the producer of that position, position + 1 once the element is
+there for the consumer, position + capacity when the slot is free again for the
+next lap. Producers and consumers claim positions with a compare and swap on
+their own cache line and never touch each other's counter.
+*/
+typedef struct {
+    uint64_t sequence;
+    char element[];
+} MpmcCell;
+
+static inline MpmcCell *mpmc_cell(MpmcQueue *queue, uint64_t position) {
+    return (MpmcCell *)(queue->cells + (position & (queue->capacity - 1)) * queue->cell_size);
+}
+
+// Not FUTEX_PRIVATE: the waiters are in different processes. timeout is relative, NULL waits forever.
+static void futex_wait(uint32_t *address, uint32_t expected, const struct timespec *timeout) {
+    syscall(SYS_futex, address, FUTEX_WAIT, expected, timeout, NULL, 0);
+}
+
+static void futex_wake(uint32_t *address, int count) {
+    syscall(SYS_futex, address, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+/*
+Create a queue of capacity (a power of two) elements of element_size bytes in
+shared anonymous memory. Must be called before forking the processes using it.
+*/
+MpmcQueue *mpmc_queue_create(size_t capacity, size_t element_size) {
+    if (capacity < 2 || (capacity & (capacity - 1))) {
+        log_message(LOG_ERROR, "Queue capacity %zu is not a power of two", capacity);
+        return NULL;
+    }
+    // each cell on its own cache lines so that neighbours do not false share
+    size_t cell_size = (sizeof(MpmcCell) + element_size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    size_t mapping_size = sizeof(MpmcQueue) + capacity * cell_size;
+    MpmcQueue *queue = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (queue == MAP_FAILED) {
+        log_message(LOG_ERROR, "mmap failed: %s", strerror(errno));
+        return NULL;
+    }
+    queue->capacity = capacity;
+    queue->element_size = element_size;
+    queue->cell_size = cell_size;
+    queue->mapping_size = mapping_size;
+    for (uint64_t position = 0; position < capacity; position++) {
+        mpmc_cell(queue, position)->sequence = position;
+    }
+    return queue;
+}
+
+void mpmc_queue_destroy(MpmcQueue *queue) {
+    munmap(queue, queue->mapping_size);
+}
+
+bool mpmc_queue_try_push(MpmcQueue *queue, const void *element) {
+    uint64_t position = __atomic_load_n(&queue->enqueue_position, __ATOMIC_RELAXED);
+    for (;;) {
+        MpmcCell *cell = mpmc_cell(queue, position);
+        uint64_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        int64_t difference = (int64_t)(sequence - position);
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&queue->enqueue_position, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                memcpy(cell->element, element, queue->element_size);
+                __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+                break;
+            }
+        } else if (difference < 0) {
+            return false; // full
+        } else {
+            position = __atomic_load_n(&queue->enqueue_position, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_fetch_add(&queue->pushed, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->consumers_waiting, __ATOMIC_SEQ_CST)) {
+        futex_wake(&queue->pushed, 1);
+    }
+    return true;
+}
+
+bool mpmc_queue_try_pop(MpmcQueue *queue, void *element) {
+    uint64_t position = __atomic_load_n(&queue->dequeue_position, __ATOMIC_RELAXED);
+    for (;;) {
+        MpmcCell *cell = mpmc_cell(queue, position);
+        uint64_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        int64_t difference = (int64_t)(sequence - (position + 1));
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&queue->dequeue_position, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                memcpy(element, cell->element, queue->element_size);
+                __atomic_store_n(&cell->sequence, position + queue->capacity, __ATOMIC_RELEASE);
+                break;
+            }
+        } else if (difference < 0) {
+            return false; // empty
+        } else {
+            position = __atomic_load_n(&queue->dequeue_position, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_fetch_add(&queue->popped, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->producers_waiting, __ATOMIC_SEQ_CST)) {
+        futex_wake(&queue->popped, 1);
+    }
+    return true;
+}
+
+/*
+Blocking push, sleeps on the popped futex while the queue is full. The waiter
+count is raised before the futex value is sampled and the queue retried, so a
+pop happening in between either is seen by the retry or changes the futex value.
+Returns false if the queue was closed.
+*/
+bool mpmc_queue_push(MpmcQueue *queue, const void *element) {
+    while (!mpmc_queue_try_push(queue, element)) {
+        __atomic_fetch_add(&queue->producers_waiting, 1, __ATOMIC_SEQ_CST);
+        uint32_t popped = __atomic_load_n(&queue->popped, __ATOMIC_SEQ_CST);
+        bool pushed = mpmc_queue_try_push(queue, element);
+        bool closed = __atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE);
+        if (!pushed && !closed) futex_wait(&queue->popped, popped, NULL);
+        __atomic_fetch_sub(&queue->producers_waiting, 1, __ATOMIC_SEQ_CST);
+        if (pushed) return true;
+        if (closed) return false;
+    }
+    return true;
+}
+
+/*
+Blocking pop, sleeps on the pushed futex while the queue is empty. Returns false
+once the queue is closed and drained.
+*/
+bool mpmc_queue_pop(MpmcQueue *queue, void *element) {
+    while (!mpmc_queue_try_pop(queue, element)) {
+        __atomic_fetch_add(&queue->consumers_waiting, 1, __ATOMIC_SEQ_CST);
+        uint32_t pushed = __atomic_load_n(&queue->pushed, __ATOMIC_SEQ_CST);
+        bool popped = mpmc_queue_try_pop(queue, element);
+        bool closed = __atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE);
+        if (!popped && !closed) futex_wait(&queue->pushed, pushed, NULL);
+        __atomic_fetch_sub(&queue->consumers_waiting, 1, __ATOMIC_SEQ_CST);
+        if (popped) return true;
+        if (closed) return mpmc_queue_try_pop(queue, element);
+    }
+    return true;
+}
+
+/*
+Pop that sleeps at most timeout_ms while the queue is empty. Returns false on
+timeout, when the queue is closed and drained, and on an early wakeup, so that
+the caller can check what it waits for is still alive before calling again.
+*/
+bool mpmc_queue_pop_timed(MpmcQueue *queue, void *element, int timeout_ms) {
+    if (mpmc_queue_try_pop(queue, element)) return true;
+    struct timespec timeout = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000 };
+    __atomic_fetch_add(&queue->consumers_waiting, 1, __ATOMIC_SEQ_CST);
+    uint32_t pushed = __atomic_load_n(&queue->pushed, __ATOMIC_SEQ_CST);
+    bool popped = mpmc_queue_try_pop(queue, element);
+    if (!popped && !__atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE)) futex_wait(&queue->pushed, pushed, &timeout);
+    __atomic_fetch_sub(&queue->consumers_waiting, 1, __ATOMIC_SEQ_CST);
+    return popped || mpmc_queue_try_pop(queue, element);
+}
+
+// Wake every waiter, blocking calls fail from now on once the queue is empty
+void mpmc_queue_close(MpmcQueue *queue) {
+    __atomic_store_n(&queue->closed, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&queue->pushed, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&queue->popped, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&queue->pushed, INT32_MAX);
+    futex_wake(&queue->popped, INT32_MAX);
+}
@@ -0,0 +1,202 @@
+#include "api.h"
+
+#define STATS_HALF_BUCKETS (1 << (STATS_SUB_BUCKET_BITS - 1))
+
+static FaultStats fault_stats;
+
+static const char *fault_phase_names[FAULT_PHASE_COUNT] = {
+    "mmap", "memcpy", "resolve", "pmap", "update", "tlb", "total"
+};
+
+/*
+Nanosecond clock for the fault phases. CLOCK_MONOTONIC_RAW is served by the vDSO,
+is async signal safe and is not slewed by NTP while a fault is being timed.
+*/
+uint64_t stats_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t stats_bucket_index(uint64_t value) {
+    if (value < 2 * STATS_HALF_BUCKETS) return value;
+    int shift = 63 - __builtin_clzll(value) - STATS_SUB_BUCKET_BITS + 1;
+    return (shift + 1) * STATS_HALF_BUCKETS + (value >> shift) - STATS_HALF_BUCKETS;
+}
+
+// Smallest value falling in a bucket, and the width of the bucket
+static uint64_t stats_bucket_value(size_t index, uint64_t *width) {
+    if (index < 2 * STATS_HALF_BUCKETS) {
+        *width = 1;
+        return index;
+    }
+    int shift = index / STATS_HALF_BUCKETS - 1;
+    *width = 1ull << shift;
+    return (uint64_t)(index % STATS_HALF_BUCKETS + STATS_HALF_BUCKETS) << shift;
+}
+
+void stats_histogram_record(StatsHistogram *histogram, uint64_t value) {
+    __atomic_fetch_add(&histogram->buckets[stats_bucket_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+    uint64_t seen = __atomic_load_n(&histogram->min, __ATOMIC_RELAXED);
+    while ((seen == 0 || value < seen) &&
+           !__atomic_compare_exchange_n(&histogram->min, &seen, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    seen = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (value > seen &&
+           !__atomic_compare_exchange_n(&histogram->max, &seen, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    // count last, a reader seeing it has the rest of the sample
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELEASE);
+}
+
+void stats_histogram_merge(StatsHistogram *into, const StatsHistogram *from) {
+    if (from->count == 0) return;
+    if (into->count == 0 || from->min < into->min) into->min = from->min;
+    if (from->max > into->max) into->max = from->max;
+    into->count += from->count;
+    into->sum += from->sum;
+    for (size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+/*
+Value below which percentile (0 to 100) of the samples fall, reported as the
+middle of its bucket and clamped to the recorded extremes.
+*/
+uint64_t stats_histogram_percentile(const StatsHistogram *histogram, double percentile) {
+    if (histogram->count == 0) return 0;
+    uint64_t rank = (uint64_t)(percentile / 100 * histogram->count + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            uint64_t width;
+            uint64_t value = stats_bucket_value(i, &width) + width / 2;
+            if (value < histogram->min) return histogram->min;
+            return value > histogram->max ? histogram->max : value;
+        }
+    }
+    return histogram->max;
+}
+
+/*
+Number of samples not above value, counting whole buckets (a bucket straddling
+value is left out)
+*/
+uint64_t stats_histogram_count_below(const StatsHistogram *histogram, uint64_t value) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        uint64_t width;
+        if (stats_bucket_value(i, &width) + width - 1 > value) break;
+        count += histogram->buckets[i];
+    }
+    return count;
+}
+
+/*
+Record the time spent in a phase of signal_handler since the given clock value,
+returns the current clock so that phases can be chained
+*/
+uint64_t stats_fault_phase(FaultPhase phase, uint64_t since) {
+    uint64_t now = stats_clock();
+    stats_histogram_record(&fault_stats.phases[phase], now - since);
+    return now;
+}
+
+/*
+Write the fault statistics of this process to STATS_FOLDER/stats_<pid>.bin.
+Registered with atexit by initialize_cow_engine; processes that never faulted
+write nothing.
+*/
+bool stats_dump() {
+    if (fault_stats.phases[FAULT_PHASE_TOTAL].count == 0) return true;
+    if (!ensure_directory_exists(STATS_FOLDER)) return false;
+    fault_stats.magic = STATS_MAGIC;
+    fault_stats.version = STATS_VERSION;
+    fault_stats.pid = (uint64_t)getpid();
+
+    char path[FILE_NAME_SIZE];
+    snprintf(path, sizeof(path), "%s/stats_%d.bin", STATS_FOLDER, getpid());
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, FILE_PERMISSIONS);
+    if (fd == -1) {
+        log_message(LOG_ERROR, "open failed: %s", strerror(errno));
+        return false;
+    }
+    bool written = write(fd, &fault_stats, sizeof(fault_stats)) == sizeof(fault_stats);
+    if (!written) {
+        log_message(LOG_ERROR, "Failed to write fault statistics to %s", path);
+    }
+    close(fd);
+    return written;
+}
+
+static bool stats_load(const char *path, FaultStats *total, int *processes) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        log_message(LOG_ERROR, "open failed for %s: %s", path, strerror(errno));
+        return false;
+    }
+    FaultStats *stats = malloc(sizeof(FaultStats));
+    struct stat st;
+    // a file of a build with other fault phases has another size
+    bool valid = stats && fstat(fd, &st) == 0 && (size_t)st.st_size == sizeof(FaultStats) &&
+                 read_fully(fd, stats, sizeof(FaultStats)) == sizeof(FaultStats) &&
+                 stats->magic == STATS_MAGIC && stats->version == STATS_VERSION;
+    if (valid) {
+        for (int phase = 0; phase < FAULT_PHASE_COUNT; phase++) {
+            stats_histogram_merge(&total->phases[phase], &stats->phases[phase]);
+        }
+        (*processes)++;
+    } else {
+        log_message(LOG_ERROR, "%s is not a fault statistics file", path);
+    }
+    free(stats);
+    close(fd);
+    return valid;
+}
+
+/*
+Print the per phase fault latencies of one statistics file, or aggregated over
+every file of STATS_FOLDER when stats_path is NULL
+*/
+bool stats_report(const char *stats_path) {
+    FaultStats *total = calloc(1, sizeof(FaultStats));
+    if (!total) return false;
+    int processes = 0;
+    bool success = true;
+    if (stats_path) {
+        success = stats_load(stats_path, total, &processes);
+    } else {
+        DIR *dir = opendir(STATS_FOLDER);
+        struct dirent *entry;
+        while (dir && (entry = readdir(dir)) != NULL) {
+            if (strncmp(entry->d_name, "stats_", 6) != 0) continue;
+            char path[FILE_NAME_SIZE * 2];
+            snprintf(path, sizeof(path), "%s/%s", STATS_FOLDER, entry->d_name);
+            success = stats_load(path, total, &processes) && success;
+        }
+        if (dir) closedir(dir);
+    }
+
+    if (processes == 0) {
+        printf("No fault statistics found in %s, were the processes built with PSAR_STATS?\n", stats_path ? stats_path : STATS_FOLDER);
+    } else {
+        printf("Fault latency over %d process(es), in nanoseconds\n", processes);
+        printf("%-8s %10s %10s %10s %10s %10s %10s %10s %10s\n", "phase", "count", "mean", "min", "p50", "p90", "p99", "p99.9", "max");
+        for (int phase = 0; phase < FAULT_PHASE_COUNT; phase++) {
+            const StatsHistogram *histogram = &total->phases[phase];
+            printf("%-8s %10llu %10llu %10llu %10llu %10llu %10llu %10llu %10llu\n", fault_phase_names[phase],
+                   (unsigned long long)histogram->count,
+                   (unsigned long long)(histogram->count ? histogram->sum / histogram->count : 0),
+                   (unsigned long long)histogram->min,
+                   (unsigned long long)stats_histogram_percentile(histogram, 50),
+                   (unsigned long long)stats_histogram_percentile(histogram, 90),
+                   (unsigned long long)stats_histogram_percentile(histogram, 99),
+                   (unsigned long long)stats_histogram_percentile(histogram, 99.9),
+                   (unsigned long long)histogram->max);
+        }
+    }
+    free(total);
+    return success;
+}
@@ -0,0 +1,176 @@
+#include "api.h"
+
+/*
+Windowed mappings (PSAR_WINDOW_SIZE): instead of a whole file, the writers map
+window_size bytes of it at a time, read only like the whole file mappings, so
+the first store into a page still takes the SIGSEGV path. Windows stay mapped
+until the windows of every file would pass window_budget; the least recently
+used one is then logged out and unmapped like a whole mapping. Its privatized
+pages go with it: a window mapped again shows the file, the earlier writes are
+in the log only. Windowed mode is therefore write only: windowed_write is the
+only way into the windows, the writes of a process are read back through
+merge_all, never through its mappings.
+*/
+
+typedef struct {
+    char file_name[FILE_NAME_SIZE];
+    int fd;
+    size_t size;
+} WindowFile;
+
+typedef struct {
+    int file; // index into window_files
+    off_t offset; // in the file, a multiple of window_size
+    size_t len;
+    char *region;
+    uint64_t last_used;
+} MappedWindow;
+
+static WindowFile window_files[POOL_MAPPINGS];
+static int window_file_count = 0;
+static MappedWindow *windows = NULL; // window_slots slots, window_count used
+static int window_slots = 0;
+static int window_count = 0;
+static int window_last = -1; // slot of the last window used, checked first
+static uint64_t window_clock = 0;
+static uint64_t windows_mapped = 0, windows_evicted = 0;
+
+// Window size in bytes, rounded up to pages
+static size_t window_size() {
+    return (psar_config.window_size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+}
+
+static WindowFile *window_file(const char *file_name) {
+    for (int i = 0; i < window_file_count; i++) {
+        if (strcmp(window_files[i].file_name, file_name) == 0) return &window_files[i];
+    }
+    if (window_file_count == POOL_MAPPINGS) {
+        log_message(LOG_ERROR, "Process %d maps windows of too many files, %s skipped", getpid(), file_name);
+        return NULL;
+    }
+    int fd = open(file_name, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        log_message(LOG_ERROR, "open failed for %s: %s", file_name, strerror(errno));
+        if (fd != -1) close(fd);
+        return NULL;
+    }
+    WindowFile *file = &window_files[window_file_count++];
+    snprintf(file->file_name, sizeof(file->file_name), "%s", file_name);
+    file->fd = fd;
+    file->size = st.st_size;
+    return file;
+}
+
+// Log the deferred pages of a window and unmap it
+static void window_unmap(MappedWindow *window) {
+    zero_copy_flush(window->region);
+    delta_snapshot_release(window->region, window->len);
+    unmap_file_region(window->region, window->len);
+    metrics_add(METRIC_WINDOWS_MAPPED, -1);
+}
+
+/*
+The window of file covering offset, mapped on first use. When window_slots
+windows are mapped already the least recently used one makes room.
+*/
+static MappedWindow *window_for(int file, off_t offset) {
+    if (window_last != -1 && windows[window_last].file == file && offset >= windows[window_last].offset &&
+        (size_t)(offset - windows[window_last].offset) < windows[window_last].len) {
+        windows[window_last].last_used = ++window_clock;
+        return &windows[window_last];
+    }
+    int slot = -1;
+    for (int i = 0; i < window_count; i++) {
+        if (windows[i].file == file && offset >= windows[i].offset && (size_t)(offset - windows[i].offset) < windows[i].len) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == -1) {
+        if (window_count < window_slots) {
+            slot = window_count++;
+        } else {
+            slot = 0;
+            for (int i = 1; i < window_count; i++) {
+                if (windows[i].last_used < windows[slot].last_used) slot = i;
+            }
+            window_unmap(&windows[slot]);
+            windows_evicted++;
+            metrics_add(METRIC_WINDOW_EVICTIONS, 1);
+        }
+        size_t size = window_size();
+        off_t window_offset = offset / size * size;
+        size_t len = window_files[file].size - window_offset < size ? window_files[file].size - window_offset : size;
+        char *region = mmap(NULL, len, PROT_READ, MAP_SHARED, window_files[file].fd, window_offset);
+        if (region == MAP_FAILED) {
+            log_message(LOG_ERROR, "mmap failed: %s", strerror(errno));
+            windows[slot] = windows[--window_count];
+            window_last = -1;
+            return NULL;
+        }
+        advise_mapping(region, len, window_files[file].fd, window_offset);
+        windows[slot] = (MappedWindow){ file, window_offset, len, region, 0 };
+        windows_mapped++;
+        metrics_add(METRIC_WINDOWS_MAPPED, 1);
+    }
+    windows[slot].last_used = ++window_clock;
+    window_last = slot;
+    return &windows[slot];
+}
+
+/*
+log_and_write_memory_region through the windows of file_name, a write crossing
+windows is logged as one record per window. Nothing returns the window contents:
+after an eviction they no longer hold the earlier writes.
+*/
+bool windowed_write(const char *file_name, off_t offset, const char *data, size_t len) {
+    if (!windows) {
+        window_slots = psar_config.window_budget / window_size();
+        if (window_slots < 1) window_slots = 1;
+        windows = calloc(window_slots, sizeof(MappedWindow));
+        if (!windows) {
+            log_message(LOG_ERROR, "Failed to allocate %d windows", window_slots);
+            return false;
+        }
+    }
+    WindowFile *file = window_file(file_name);
+    if (!file) return false;
+    if (!region_range_valid(offset, len, file->size)) {
+        log_message(LOG_ERROR, "Write operation exceeds mapped region bounds.");
+        return false;
+    }
+    for (size_t done = 0; done < len;) {
+        MappedWindow *window = window_for(file - window_files, offset + done);
+        if (!window) return false;
+        off_t window_offset = offset + done - window->offset;
+        size_t piece = window->len - window_offset < len - done ? window->len - window_offset : len - done;
+        WriteEntry entry = { window_offset, data + done, piece };
+        if (!log_and_write_window(window->region, window->offset, &entry, 1, window->len, file->file_name)) return false;
+        done += piece;
+    }
+    return true;
+}
+
+/*
+Log out and unmap every window and close their files, before the process exits
+or the window settings change
+*/
+void windows_release() {
+    for (int i = 0; i < window_count; i++) {
+        window_unmap(&windows[i]);
+    }
+    for (int i = 0; i < window_file_count; i++) {
+        close(window_files[i].fd);
+    }
+    free(windows);
+    windows = NULL;
+    window_slots = window_count = window_file_count = 0;
+    window_last = -1;
+}
+
+// Windows mapped and evicted by this process so far
+void window_stats(uint64_t *mapped, uint64_t *evicted) {
+    *mapped = windows_mapped;
+    *evicted = windows_evicted;
+}
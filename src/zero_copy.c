@@ -0,0 +1,194 @@
+#define _GNU_SOURCE // vmsplice, splice, F_SETPIPE_SZ
+#include "api.h"
+
+/*
+Zero copy logging of whole page modifications (PSAR_ZERO_COPY=1). The data is
+stored in the privatized page only and the page is marked dirty; the log record
+is produced later by zero_copy_flush straight from the page, with vmsplice and
+splice when the kernel allows it and pwritev otherwise. This removes the copy of
+the data into the log on the write path, and a page written many times before a
+flush is logged once.
+*/
+
+typedef struct {
+    char *region;
+    off_t region_offset; // in the file
+    size_t size;
+    char file_name[FILE_NAME_SIZE];
+    uint8_t *dirty; // one byte per page of the region
+    size_t dirty_pages;
+} ZeroCopyRegion;
+
+static ZeroCopyRegion zero_copy_regions[POOL_MAPPINGS];
+static int zero_copy_region_count = 0;
+static bool zero_copy_splice = true; // cleared once splice turned out to be unsupported
+
+bool zero_copy_enabled() {
+    return psar_config.zero_copy;
+}
+
+static ZeroCopyRegion *zero_copy_region(char *mapped_region, off_t region_offset, size_t region_size, const char *file_name) {
+    for (int i = 0; i < zero_copy_region_count; i++) {
+        if (zero_copy_regions[i].region == mapped_region) return &zero_copy_regions[i];
+    }
+    if (zero_copy_region_count == POOL_MAPPINGS) {
+        log_message(LOG_ERROR, "Too many regions with deferred pages");
+        return NULL;
+    }
+    uint8_t *dirty = calloc((region_size + PAGE_SIZE - 1) / PAGE_SIZE, 1);
+    if (!dirty) return NULL;
+    ZeroCopyRegion *region = &zero_copy_regions[zero_copy_region_count++];
+    region->region = mapped_region;
+    region->region_offset = region_offset;
+    region->size = region_size;
+    snprintf(region->file_name, sizeof(region->file_name), "%s", file_name);
+    region->dirty = dirty;
+    region->dirty_pages = 0;
+    return region;
+}
+
+/*
+Set up the dirty page tracking of a mapping before its first zero_copy_write, so
+that a batch can fail before it logs or stores anything
+*/
+bool zero_copy_prepare(char *mapped_region, off_t region_offset, size_t region_size, char *file_name) {
+    return zero_copy_region(mapped_region, region_offset, region_size, file_name) != NULL;
+}
+
+/*
+Store len bytes (whole pages) at offset of a mapping found at region_offset of
+the file and remember the pages for the next zero_copy_flush of the region
+*/
+bool zero_copy_write(char *mapped_region, off_t region_offset, off_t offset, const char *data, size_t len, size_t region_size, char *file_name) {
+    if (!region_range_valid(offset, len, region_size) || offset % PAGE_SIZE || len % PAGE_SIZE) {
+        log_message(LOG_ERROR, "Zero copy writes must cover whole pages of the mapped region");
+        return false;
+    }
+    ZeroCopyRegion *region = zero_copy_region(mapped_region, region_offset, region_size, file_name);
+    if (!region) return false;
+    memcpy(mapped_region + offset, data, len);
+    for (size_t page = offset / PAGE_SIZE; page < (offset + len) / PAGE_SIZE; page++) {
+        if (!region->dirty[page]) {
+            region->dirty[page] = 1;
+            region->dirty_pages++;
+        }
+    }
+    return true;
+}
+
+static void iovec_advance(struct iovec **iov, int *count, size_t bytes) {
+    while (bytes > 0 && *count > 0) {
+        if (bytes >= (*iov)->iov_len) {
+            bytes -= (*iov)->iov_len;
+            (*iov)++;
+            (*count)--;
+        } else {
+            (*iov)->iov_base = (char *)(*iov)->iov_base + bytes;
+            (*iov)->iov_len -= bytes;
+            bytes = 0;
+        }
+    }
+}
+
+/*
+Append count iovecs to the log at *position. vmsplice references the user pages
+in the pipe and splice moves them on to the file; pwritev is used when the
+kernel refuses either of them.
+*/
+static bool zero_copy_append(int log_fd, int pipe_fds[2], struct iovec *iov, int count, off_t *position) {
+    while (count > 0 && zero_copy_splice && pipe_fds[0] != -1) {
+        ssize_t queued = vmsplice(pipe_fds[1], iov, count, 0);
+        if (queued <= 0) {
+            zero_copy_splice = false;
+            break;
+        }
+        ssize_t moved = 0;
+        while (moved < queued) {
+            ssize_t bytes = splice(pipe_fds[0], NULL, log_fd, position, queued - moved, SPLICE_F_MOVE);
+            if (bytes <= 0) break;
+            moved += bytes;
+        }
+        if (moved < queued) {
+            // splice refused, write what the pipe still holds the usual way
+            zero_copy_splice = false;
+            char buffer[PAGE_SIZE];
+            while (moved < queued) {
+                ssize_t pending = read(pipe_fds[0], buffer, sizeof(buffer));
+                if (pending <= 0 || pwrite(log_fd, buffer, pending, *position) != pending) return false;
+                *position += pending;
+                moved += pending;
+            }
+        }
+        iovec_advance(&iov, &count, queued);
+    }
+    while (count > 0) {
+        ssize_t bytes = pwritev(log_fd, iov, count, *position);
+        if (bytes <= 0) return false;
+        *position += bytes;
+        iovec_advance(&iov, &count, bytes);
+    }
+    return true;
+}
+
+// One raw record per run of consecutive dirty pages, the payload read from the pages
+static bool zero_copy_flush_region(ZeroCopyRegion *region, int pipe_fds[2]) {
+    bool success = true;
+    uint64_t timestamp = log_record_clock();
+    size_t pages = (region->size + PAGE_SIZE - 1) / PAGE_SIZE;
+    for (size_t page = 0; success && page < pages; page++) {
+        if (!region->dirty[page]) continue;
+        size_t run = 1;
+        while (page + run < pages && region->dirty[page + run]) run++;
+        size_t len = run * PAGE_SIZE;
+        LogRecordHeader header = { LOG_RECORD_MAGIC, LOG_ENCODING_RAW, (uint64_t)(region->region_offset + page * PAGE_SIZE), len, len, timestamp, 0, 0 };
+        log_record_seal(&header, region->region + page * PAGE_SIZE);
+        struct iovec record[2] = {
+            { &header, sizeof(header) },
+            { region->region + page * PAGE_SIZE, len },
+        };
+        LogSegment *segment = log_segment_for_file(region->file_name, sizeof(header) + len);
+        success = segment && zero_copy_append(segment->fd, pipe_fds, record, 2, &segment->size);
+        if (success) {
+            metrics_add(METRIC_LOG_RECORDS_WRITTEN, 1);
+            metrics_add(METRIC_LOG_BYTES_WRITTEN, sizeof(header) + len);
+        }
+        memset(region->dirty + page, 0, run);
+        page += run - 1;
+    }
+    region->dirty_pages = 0;
+    if (!success) {
+        log_message(LOG_ERROR, "Failed to write deferred pages of %s: %s", region->file_name, strerror(errno));
+    }
+    return success;
+}
+
+/*
+Log the pages written with zero_copy_write since the last flush, for the region
+mapped at mapped_region or for every region when it is NULL, and forget the
+regions. Must be called before the region is unmapped.
+*/
+bool zero_copy_flush(char *mapped_region) {
+    if (zero_copy_region_count == 0) return true;
+    int pipe_fds[2] = { -1, -1 };
+    if (zero_copy_splice && pipe2(pipe_fds, O_CLOEXEC) == 0) {
+        fcntl(pipe_fds[1], F_SETPIPE_SZ, 1 << 20);
+    }
+    bool success = true;
+    for (int i = 0; i < zero_copy_region_count;) {
+        ZeroCopyRegion *region = &zero_copy_regions[i];
+        if (mapped_region && region->region != mapped_region) {
+            i++;
+            continue;
+        }
+        if (region->dirty_pages) {
+            success = zero_copy_flush_region(region, pipe_fds) && success;
+        }
+        free(region->dirty);
+        *region = zero_copy_regions[--zero_copy_region_count];
+    }
+    if (pipe_fds[0] != -1) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    return success;
+}